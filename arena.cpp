@@ -0,0 +1,67 @@
+#include "arena.hpp"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+
+/* maps bytes at an address aligned to ARENA_ALIGN: maps ARENA_ALIGN
+   more and unmaps the slack on both sides */
+static void* map_aligned(size_t bytes) {
+
+  size_t total = bytes + ARENA_ALIGN;
+  char* m = (char*)mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (m == MAP_FAILED) {
+    printf("arena_map: cannot map %.1f MB\n", bytes / 1048576.0);
+    exit(1);
+  }
+  char* p = (char*)(((uintptr_t)m + ARENA_ALIGN - 1) & ~(uintptr_t)(ARENA_ALIGN - 1));
+  if (p > m) munmap(m, p - m);
+  if (m + total > p + bytes) munmap(p + bytes, m + total - (p + bytes));
+  return p;
+}
+
+
+static void advise_huge_pages(void* p, size_t bytes) {
+#ifdef MADV_HUGEPAGE
+  //only a hint: without transparent huge pages it fails, harmlessly
+  madvise(p, bytes, MADV_HUGEPAGE);
+#endif
+}
+
+
+void* arena_map(size_t bytes) {
+
+  assert(bytes % ARENA_ALIGN == 0);
+  void* p = map_aligned(bytes);
+  advise_huge_pages(p, bytes);
+  return p;
+}
+
+
+void* arena_grow(void* p, size_t old_bytes, size_t new_bytes) {
+
+  assert(new_bytes % ARENA_ALIGN == 0 && new_bytes >= old_bytes);
+  void* q = arena_map(new_bytes);
+#ifdef MREMAP_FIXED
+  //move the pages of p to the start of q; the rest of q stays
+  if (mremap(p, old_bytes, old_bytes, MREMAP_MAYMOVE | MREMAP_FIXED, q) == q) {
+    advise_huge_pages(q, new_bytes);
+    return q;
+  }
+#endif
+  memcpy(q, p, old_bytes);
+  arena_unmap(p, old_bytes);
+  return q;
+}
+
+
+void arena_unmap(void* p, size_t bytes) {
+  munmap(p, bytes);
+}
@@ -0,0 +1,123 @@
+#ifndef __ARENA_HPP
+#define __ARENA_HPP
+
+#include <assert.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <type_traits>
+#include <utility>
+
+
+
+/* memory for large arrays of points, mapped directly from the OS in
+   multiples of ARENA_ALIGN bytes, aligned to ARENA_ALIGN, and marked
+   for transparent huge pages (MADV_HUGEPAGE), so that a cloud of 100M
+   points takes ~1500 TLB entries instead of ~700000. Pages are only
+   backed by memory when they are first written. */
+const size_t ARENA_ALIGN = 2 << 20;
+
+//maps a zeroed region of bytes (a multiple of ARENA_ALIGN); exits if
+//there is no memory
+void* arena_map(size_t bytes);
+
+/* grows the region p of old_bytes to new_bytes and returns its new
+   address. On Linux the pages are moved with mremap, not copied;
+   elsewhere they are copied. The new bytes are zero. */
+void* arena_grow(void* p, size_t old_bytes, size_t new_bytes);
+
+void arena_unmap(void* p, size_t bytes);
+
+
+/* a growable array of points (or any trivially copyable T) in an
+   arena region: the subset of vector that the clouds use. Growing it
+   never copies the points, and the pages of a cloud are huge pages.
+
+   It can't be copied, only moved or swapped, so that a cloud is never
+   copied by accident (e.g. passed by value); copies are explicit,
+   with assign(). */
+template<class T> class point_buffer {
+
+  static_assert(std::is_trivially_copyable<T>::value, "point_buffer holds plain structs");
+
+  T* p;
+  size_t n, cap;
+  //the elements at and after this were never written: they are zero
+  size_t clean;
+
+  void grow(size_t want) {
+    if (want <= cap) return;
+    size_t bytes = cap * sizeof(T);
+    size_t new_bytes = (bytes < ARENA_ALIGN) ? ARENA_ALIGN: bytes;
+    while (new_bytes < want * sizeof(T)) new_bytes *= 2;
+    new_bytes = (new_bytes + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+    p = (T*)(p ? arena_grow(p, bytes, new_bytes): arena_map(new_bytes));
+    cap = new_bytes / sizeof(T);
+  }
+
+public:
+  point_buffer(): p(NULL), n(0), cap(0), clean(0) {}
+  ~point_buffer() { if (p) arena_unmap(p, cap * sizeof(T)); }
+
+  point_buffer(const point_buffer &) = delete;
+  point_buffer & operator=(const point_buffer &) = delete;
+  point_buffer(point_buffer && o): p(NULL), n(0), cap(0), clean(0) { swap(o); }
+  point_buffer & operator=(point_buffer && o) { swap(o); return *this; }
+
+  void swap(point_buffer & o) {
+    std::swap(p, o.p);
+    std::swap(n, o.n);
+    std::swap(cap, o.cap);
+    std::swap(clean, o.clean);
+  }
+
+  size_t size() const { return n; }
+  size_t capacity() const { return cap; }
+  bool empty() const { return n == 0; }
+
+  T & operator[](size_t i) { return p[i]; }
+  const T & operator[](size_t i) const { return p[i]; }
+  T* data() { return p; }
+  const T* data() const { return p; }
+  T* begin() { return p; }
+  T* end() { return p + n; }
+  const T* begin() const { return p; }
+  const T* end() const { return p + n; }
+
+  void reserve(size_t k) { grow(k); }
+
+  void push_back(const T & v) {
+    if (n == cap) grow(n + 1);
+    p[n++] = v;
+    if (n > clean) clean = n;
+  }
+
+  //appends the k elements at first
+  void append(const T* first, size_t k) {
+    if (k == 0) return;
+    grow(n + k);
+    memcpy(p + n, first, k * sizeof(T));
+    n += k;
+    if (n > clean) clean = n;
+  }
+
+  //the new elements are zero, like the T() of a plain struct
+  void resize(size_t k) {
+    grow(k);
+    if (k > n && clean > n) memset(p + n, 0, ((k < clean) ? k - n: clean - n) * sizeof(T));
+    n = k;
+    if (n > clean) clean = n;
+  }
+
+  //keeps the memory, like vector
+  void clear() { n = 0; }
+
+  //makes this a copy of o
+  void assign(const point_buffer & o) {
+    clear();
+    append(o.data(), o.size());
+  }
+};
+
+
+#endif
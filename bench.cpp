@@ -0,0 +1,497 @@
+#include "bench.hpp"
+#include "compare.hpp"
+#include "reorder.hpp"
+#include "stats.hpp"
+#include "voxel.hpp"
+#include "parallel.hpp"
+#include "timer.hpp"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <dirent.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <vector>
+using namespace std;
+
+
+
+/* a counter of the event type/config of thread tid (0 for this
+   thread) in user space, or -1 if there is none (not Linux, no PMU,
+   or perf_event_paranoid) */
+static int open_counter(int type, unsigned long long config, int tid) {
+#ifdef __linux__
+  struct perf_event_attr a;
+  memset(&a, 0, sizeof(a));
+  a.type = type;
+  a.size = sizeof(a);
+  a.config = config;
+  a.disabled = 1;
+  a.exclude_kernel = 1;
+  a.exclude_hv = 1;
+  return syscall(__NR_perf_event_open, &a, tid, -1, -1, 0);
+#else
+  return -1;
+#endif
+}
+
+
+/* counters of the last level cache load misses of every thread of the
+   process, since the stages run on the thread pool; a counter only
+   counts its own thread. Empty if there are none. */
+static vector<int> open_llc_counters() {
+
+  vector<int> fd;
+#ifdef __linux__
+  DIR* d = opendir("/proc/self/task");
+  if (!d) return fd;
+  struct dirent* e;
+  while ((e = readdir(d))) {
+    int tid = atoi(e->d_name);
+    if (tid <= 0) continue;
+    int c = open_counter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL |
+			 (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16), tid);
+    //not every PMU has the LL cache event: the generic cache misses
+    //are the last level ones too
+    if (c < 0) c = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, tid);
+    if (c < 0) {
+      for (size_t k = 0; k < fd.size(); k++) close(fd[k]);
+      fd.clear();
+      break;
+    }
+    fd.push_back(c);
+  }
+  closedir(d);
+#endif
+  return fd;
+}
+
+
+static void close_counters(const vector<int> & fd) {
+#ifdef __linux__
+  for (size_t k = 0; k < fd.size(); k++) close(fd[k]);
+#endif
+}
+
+
+static void start_counters(const vector<int> & fd) {
+#ifdef __linux__
+  for (size_t k = 0; k < fd.size(); k++) {
+    ioctl(fd[k], PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd[k], PERF_EVENT_IOC_ENABLE, 0);
+  }
+#endif
+}
+
+
+//stops the counters fd and returns their sum, -1 if there are none
+static long long stop_counters(const vector<int> & fd) {
+  if (fd.empty()) return -1;
+  long long sum = 0;
+#ifdef __linux__
+  for (size_t k = 0; k < fd.size(); k++) {
+    ioctl(fd[k], PERF_EVENT_IOC_DISABLE, 0);
+    long long v;
+    if (read(fd[k], &v, sizeof(v)) == sizeof(v)) sum += v;
+  }
+#endif
+  return sum;
+}
+
+
+
+/* the work done on the points by the downstream stages, for one
+   order of the points */
+typedef struct _stage_times {
+  double classify, index, scan, stats;
+  //the last level cache misses of each stage, -1 if not counted
+  long long classify_misses, index_misses, scan_misses, stats_misses;
+  //mean distance in memory (in points) between a point and the
+  //other points in its voxel
+  double neighbor_distance;
+  //mean xy area of the bounding box of the chunks
+  double chunk_area;
+} stage_times;
+
+
+/* for every point, the mean z of the points in its voxel: the access
+   pattern of neighborhood queries. Also measures how far apart the
+   neighbors are in memory. */
+static double neighborhood_scan(const lidar_point_cloud & points, const voxel_index & vi,
+				double* neighbor_distance) {
+
+  long n = points.data.size();
+  int nchunks = nb_threads();
+  vector<double> sum(nchunks, 0), dist(nchunks, 0);
+  vector<long> pairs(nchunks, 0);
+  parallel_for_chunks(n, nchunks, [&](int c, long b, long e) {
+      for (long i = b; i < e; i++) {
+	const lidar_point & p = points.data[i];
+	int x = (int)((p.x - vi.minx) / vi.size);
+	int y = (int)((p.y - vi.miny) / vi.size);
+	int z = (int)((p.z - vi.minz) / vi.size);
+	long v = voxel_id(vi, x, y, z);
+	double zsum = 0;
+	for (int s = vi.start[v]; s < vi.start[v+1]; s++) {
+	  long j = vi.points[s];
+	  zsum += points.data[j].z;
+	  dist[c] += (j > i) ? j - i: i - j;
+	}
+	pairs[c] += vi.start[v+1] - vi.start[v];
+	sum[c] += zsum / (vi.start[v+1] - vi.start[v]);
+      }
+    });
+
+  double total = 0, total_dist = 0;
+  long total_pairs = 0;
+  for (int c = 0; c < nchunks; c++) {
+    total += sum[c];
+    total_dist += dist[c];
+    total_pairs += pairs[c];
+  }
+  *neighbor_distance = total_pairs ? total_dist / total_pairs: 0;
+  return total;
+}
+
+
+/* runs the stages on points, which is modified by classify(), and
+   counts their cache misses with the counters llc, if any */
+static stage_times time_stages(lidar_point_cloud & points, const vector<int> & llc) {
+
+  stage_times st;
+  start_counters(llc);
+  double t = get_time();
+  classify(points);
+  st.classify = get_time() - t;
+  st.classify_misses = stop_counters(llc);
+
+  voxel_index vi;
+  start_counters(llc);
+  t = get_time();
+  voxel_index_build(points, 0, &vi);
+  st.index = get_time() - t;
+  st.index_misses = stop_counters(llc);
+
+  start_counters(llc);
+  t = get_time();
+  double check = neighborhood_scan(points, vi, &st.neighbor_distance);
+  st.scan = get_time() - t;
+  st.scan_misses = stop_counters(llc);
+  if (check == 0) printf("\t(mean z is 0)\n");
+
+  lidar_stats s;
+  start_counters(llc);
+  t = get_time();
+  compute_stats(points, &s);
+  st.stats = get_time() - t;
+  st.stats_misses = stop_counters(llc);
+
+  if (points.chunks.empty()) compute_chunks(points, CHUNK_SIZE);
+  double area = 0;
+  for (size_t c = 0; c < points.chunks.size(); c++) {
+    const lidar_chunk & ch = points.chunks[c];
+    area += (double)(ch.maxx - ch.minx) * (ch.maxy - ch.miny);
+  }
+  st.chunk_area = points.chunks.empty() ? 0: area / points.chunks.size();
+  return st;
+}
+
+
+//a row of counts of the two runs, and their ratio
+static void print_cost_row(const char* name, long long a, long long b) {
+  if (a < 0 || b < 0) printf("%-24s%14s%14s\n", name, "n/a", "n/a");
+  else if (b == 0) printf("%-24s%14lld%14lld\n", name, a, b);
+  else printf("%-24s%14lld%14lld%9.2fx\n", name, a, b, (double)a / b);
+}
+
+
+static void bench_reorder(const lidar_point_cloud & points) {
+
+  printf("bench reorder: %ld points, %d threads\n", (long)points.data.size(), nb_threads());
+  //the pool starts its threads on its first call: start them, so that
+  //they have counters
+  parallel_for_chunks(nb_threads(), nb_threads(), [](int, long, long) {});
+  vector<int> llc = open_llc_counters();
+  if (llc.empty()) printf("\tno cache miss counter (perf_event_open not allowed): times only\n");
+
+  lidar_point_cloud file_order;
+  copy_cloud(points, &file_order);
+  stage_times a = time_stages(file_order, llc);
+
+  lidar_point_cloud morton_order;
+  copy_cloud(points, &morton_order);
+  double t = get_time();
+  reorder_points(morton_order);
+  double t_reorder = get_time() - t;
+  stage_times b = time_stages(morton_order, llc);
+  close_counters(llc);
+
+  printf("%-24s%14s%14s%10s\n", "", "file order", "Morton order", "speedup");
+  printf("%-24s%11.1f ms%11.1f ms%9.2fx\n", "classify", 1000*a.classify, 1000*b.classify, a.classify/b.classify);
+  printf("%-24s%11.1f ms%11.1f ms%9.2fx\n", "voxel index", 1000*a.index, 1000*b.index, a.index/b.index);
+  printf("%-24s%11.1f ms%11.1f ms%9.2fx\n", "neighborhood scan", 1000*a.scan, 1000*b.scan, a.scan/b.scan);
+  printf("%-24s%11.1f ms%11.1f ms%9.2fx\n", "statistics", 1000*a.stats, 1000*b.stats, a.stats/b.stats);
+  double ta = a.classify + a.index + a.scan + a.stats, tb = b.classify + b.index + b.scan + b.stats;
+  printf("%-24s%11.1f ms%11.1f ms%9.2fx\n", "total", 1000*ta, 1000*tb, ta/tb);
+  if (!llc.empty()) {
+    print_cost_row("LLC misses classify", a.classify_misses, b.classify_misses);
+    print_cost_row("LLC misses voxel index", a.index_misses, b.index_misses);
+    print_cost_row("LLC misses scan", a.scan_misses, b.scan_misses);
+    print_cost_row("LLC misses statistics", a.stats_misses, b.stats_misses);
+  }
+  printf("%-24s%14.0f%14.0f\n", "neighbor distance", a.neighbor_distance, b.neighbor_distance);
+  printf("%-24s%14.1f%14.1f\n", "chunk xy area", a.chunk_area, b.chunk_area);
+  printf("reordering took %.1f ms\n", 1000*t_reorder);
+}
+
+
+
+//the best of a few runs of the stages with the current number of
+//threads, as in time_stages(); bbox is the bounding box
+static stage_times best_of_stages(const lidar_point_cloud & points, double* bbox) {
+
+  stage_times best;
+  *bbox = 0;
+  for (int run = 0; run < 3; run++) {
+    lidar_point_cloud copy;
+    copy_cloud(points, &copy);
+    double t = get_time();
+    compute_bbox(copy);
+    double tb = get_time() - t;
+    stage_times st = time_stages(copy, vector<int>());
+    if (run == 0 || tb < *bbox) *bbox = tb;
+    if (run == 0 || st.classify < best.classify) best.classify = st.classify;
+    if (run == 0 || st.index < best.index) best.index = st.index;
+    if (run == 0 || st.scan < best.scan) best.scan = st.scan;
+    if (run == 0 || st.stats < best.stats) best.stats = st.stats;
+  }
+  return best;
+}
+
+
+static void bench_scaling(const lidar_point_cloud & points) {
+
+  int max_threads = nb_threads();
+  printf("bench scaling: %ld points, 1 to %d threads\n", (long)points.data.size(), max_threads);
+  printf("%8s%12s%12s%12s%12s%12s%12s%10s\n", "threads", "bbox", "classify", "voxel index",
+	 "scan", "statistics", "total", "speedup");
+
+  double total1 = 0;
+  for (int nt = 1; ; nt = (2*nt < max_threads) ? 2*nt: max_threads) {
+    set_nb_threads(nt);
+    double bbox;
+    stage_times st = best_of_stages(points, &bbox);
+    double total = bbox + st.classify + st.index + st.scan + st.stats;
+    if (nt == 1) total1 = total;
+    printf("%8d%9.1f ms%9.1f ms%9.1f ms%9.1f ms%9.1f ms%9.1f ms%9.2fx\n", nt, 1000*bbox,
+	   1000*st.classify, 1000*st.index, 1000*st.scan, 1000*st.stats, 1000*total, total1/total);
+    if (nt == max_threads) break;
+  }
+  set_nb_threads(max_threads);
+}
+
+
+
+/* the cost of a stage of bench memory: its time, the page faults and
+   the dTLB load misses (-1 if the system doesn't count them) */
+typedef struct _memory_cost {
+  double ms;
+  long faults;
+  long long tlb_misses;
+} memory_cost;
+
+
+/* a counter of the dTLB load misses of this thread in user space, or
+   -1 if there is none (not Linux, no PMU, or perf_event_paranoid) */
+static int open_tlb_counter() {
+#ifdef __linux__
+  return open_counter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+		      (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16), 0);
+#else
+  return -1;
+#endif
+}
+
+
+static long minor_faults() {
+  struct rusage u;
+  getrusage(RUSAGE_SELF, &u);
+  return u.ru_minflt;
+}
+
+
+//runs f() on this thread and measures it with the counter tlb
+template<class F> static memory_cost measure(int tlb, F f) {
+
+  memory_cost c;
+#ifdef __linux__
+  if (tlb >= 0) {
+    ioctl(tlb, PERF_EVENT_IOC_RESET, 0);
+    ioctl(tlb, PERF_EVENT_IOC_ENABLE, 0);
+  }
+#endif
+  long faults = minor_faults();
+  double t = get_time();
+  f();
+  c.ms = 1000 * (get_time() - t);
+  c.faults = minor_faults() - faults;
+  c.tlb_misses = -1;
+#ifdef __linux__
+  if (tlb >= 0) {
+    ioctl(tlb, PERF_EVENT_IOC_DISABLE, 0);
+    long long v;
+    if (read(tlb, &v, sizeof(v)) == sizeof(v)) c.tlb_misses = v;
+  }
+#endif
+  return c;
+}
+
+
+//the memory in transparent huge pages of the process, in MB; -1 if unknown
+static double huge_pages_mb() {
+  FILE* f = fopen("/proc/self/smaps_rollup", "r");
+  if (!f) return -1;
+  char line[256];
+  double kb = -1;
+  while (fgets(line, sizeof(line), f))
+    if (sscanf(line, "AnonHugePages: %lf kB", &kb) == 1) break;
+  fclose(f);
+  return kb < 0 ? -1: kb / 1024;
+}
+
+
+static long gcd(long a, long b) {
+  while (b != 0) {
+    long r = a % b;
+    a = b;
+    b = r;
+  }
+  return a;
+}
+
+
+/* loads the points into a container C one by one, as the reader and
+   lidar_add_point do, then reads their z in file order and in a
+   scattered order, as neighborhood queries do */
+template<class C> static void memory_stages(const lidar_point_cloud & points, int tlb,
+					    memory_cost cost[3], double* huge_mb) {
+
+  long n = points.data.size();
+  //visit the points with a stride coprime with n: a scattered order
+  //that touches every point once
+  long stride = 2654435761L % n;
+  if (stride == 0) stride = 1;
+  while (gcd(stride, n) != 1) stride++;
+
+  C buf;
+  cost[0] = measure(tlb, [&]() {
+      for (long i = 0; i < n; i++) buf.push_back(points.data[i]);
+    });
+  *huge_mb = huge_pages_mb();
+  double sum = 0;
+  cost[1] = measure(tlb, [&]() {
+      for (long i = 0; i < n; i++) sum += buf[i].z;
+    });
+  cost[2] = measure(tlb, [&]() {
+      long j = 0;
+      for (long i = 0; i < n; i++) {
+	sum += buf[j].z;
+	j += stride;
+	if (j >= n) j -= n;
+      }
+    });
+  if (sum == 0) printf("\t(sum of z is 0)\n");
+}
+
+
+static void bench_memory(const lidar_point_cloud & points) {
+
+  long n = points.data.size();
+  if (n == 0) return;
+  printf("bench memory: %ld points (%.1f MB), on one thread\n", n,
+	 n * sizeof(lidar_point) / 1048576.0);
+  int tlb = open_tlb_counter();
+  if (tlb < 0) printf("\tno dTLB counter (perf_event_open not allowed): times and page faults only\n");
+
+  memory_cost v[3], a[3];
+  double huge_v, huge_a, base = huge_pages_mb();
+  memory_stages< vector<lidar_point> >(points, tlb, v, &huge_v);
+  memory_stages< point_buffer<lidar_point> >(points, tlb, a, &huge_a);
+#ifdef __linux__
+  if (tlb >= 0) close(tlb);
+#endif
+
+  const char* stage[3] = {"load", "file order scan", "scattered scan"};
+  printf("%-24s%14s%14s%10s\n", "", "vector", "point_buffer", "ratio");
+  for (int k = 0; k < 3; k++) {
+    printf("%-24s%11.1f ms%11.1f ms%9.2fx\n", stage[k], v[k].ms, a[k].ms, a[k].ms > 0 ? v[k].ms / a[k].ms: 0);
+    print_cost_row("  page faults", v[k].faults, a[k].faults);
+    print_cost_row("  dTLB load misses", v[k].tlb_misses, a[k].tlb_misses);
+  }
+  if (base >= 0)
+    printf("%-24s%11.1f MB%11.1f MB\n", "in huge pages", huge_v - base, huge_a - base);
+}
+
+
+
+//the radius and search distance of the self-comparison, and the
+//largest distance it accepts
+const double SELF_COMPARE_RADIUS = 2;
+const double SELF_COMPARE_MAX_DIST = 2;
+const double SELF_COMPARE_TOLERANCE = 1e-4;
+
+
+/* compares the points with themselves, by C2C and M3C2: every
+   distance must be about 0. Exits with status 1 if one isn't. */
+static void bench_compare(const lidar_point_cloud & points) {
+
+  printf("bench compare: %ld points compared with themselves\n", (long)points.data.size());
+  int failed = 0;
+  for (int method = COMPARE_C2C; method <= COMPARE_M3C2; method++) {
+    vector<float> dist;
+    compare_clouds(points, points, method, SELF_COMPARE_RADIUS, SELF_COMPARE_MAX_DIST, &dist);
+    print_compare(dist, 0.1);
+    long bad = 0;
+    for (size_t i = 0; i < dist.size(); i++)
+      if (dist[i] != COMPARE_NODATA && fabs(dist[i]) > SELF_COMPARE_TOLERANCE) bad++;
+    printf("\t%s: %ld points farther than %g from themselves\n",
+	   method == COMPARE_M3C2 ? "M3C2": "C2C", bad, SELF_COMPARE_TOLERANCE);
+    if (bad > 0) failed = 1;
+  }
+  if (failed) {
+    printf("bench compare: FAILED\n");
+    exit(1);
+  }
+  printf("bench compare: ok\n");
+}
+
+
+
+int run_benchmark(const char* name, const lidar_point_cloud & points) {
+
+  if (strcmp(name, "reorder") == 0) {
+    bench_reorder(points);
+    return 1;
+  }
+  if (strcmp(name, "scaling") == 0) {
+    bench_scaling(points);
+    return 1;
+  }
+  if (strcmp(name, "memory") == 0) {
+    bench_memory(points);
+    return 1;
+  }
+  if (strcmp(name, "compare") == 0) {
+    bench_compare(points);
+    return 1;
+  }
+  return 0;
+}
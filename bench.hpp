@@ -0,0 +1,36 @@
+#ifndef __BENCH_HPP
+#define __BENCH_HPP
+
+#include "lidar.hpp"
+
+
+
+/* runs benchmark name on points (freshly read, not classified) and
+   prints the results. Benchmarks:
+
+   reorder: runs the downstream stages (classify, voxel index,
+   neighborhood scan, statistics) on the points in file order and in
+   Morton order (see reorder.hpp), and compares their times, the
+   memory distance between neighbors and the size of the chunks, and
+   the last level cache misses of each stage, over all the threads
+   (where perf_event_open is allowed).
+
+   scaling: runs the bounding box and the downstream stages with 1, 2,
+   4, ... threads, up to the number of threads of the pool (--threads),
+   best of 3 runs each, and prints their times and the speedup.
+
+   memory: loads the points one by one into a vector and into a
+   point_buffer (see arena.hpp), then reads them in file order and in
+   a scattered order, on one thread, and prints the times, page faults
+   and dTLB load misses (where perf_event_open is allowed) of each.
+
+   compare: compares the points with themselves (see compare.hpp), by
+   C2C and by M3C2, and checks that every distance is about 0; exits
+   with status 1 if not.
+
+   Returns 0 if there is no benchmark with this name.
+*/
+int run_benchmark(const char* name, const lidar_point_cloud & points);
+
+
+#endif
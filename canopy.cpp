@@ -0,0 +1,315 @@
+#include "canopy.hpp"
+#include "parallel.hpp"
+#include "timer.hpp"
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <queue>
+#include <vector>
+using namespace std;
+
+
+//cells on the side of a tile of the watershed
+const int TREE_TILE = 256;
+
+//crowns are the cells above this fraction of the height of their tree
+const double CROWN_MIN_FRACTION = 0.5;
+
+//an empty cell of the CHM is filled if at least this many of its 8
+//neighbors have vegetation
+const int CHM_FILL_MIN_NEIGHBORS = 4;
+
+//number of trees printed by print_trees
+const int NB_PRINTED_TREES = 10;
+
+
+static inline void atomic_max(atomic<float> & a, float v) {
+  float old = a.load(memory_order_relaxed);
+  while (v > old && !a.compare_exchange_weak(old, v, memory_order_relaxed))
+    ;
+}
+
+
+//the points of the trees: medium and high vegetation
+static inline int is_tree_point(const lidar_point & p) {
+  return p.mycode == 4 || p.mycode == 5;
+}
+
+
+/* the radius of the window in which a treetop of height h is the
+   highest: half the crown width of a deciduous tree of that height,
+   3.09632 + 0.00895 h^2 (Popescu and Wynne 2004) */
+static double tree_window_radius(double h) {
+  return (3.09632 + 0.00895 * h * h) / 2;
+}
+
+
+//the cell of the grid g that (x,y) falls in
+static inline long grid_cell(const lidar_grid & g, double x, double y) {
+  int c = (int)((x - g.minx) / g.cellsize);
+  int r = (int)((y - g.miny) / g.cellsize);
+  if (c >= g.ncols) c = g.ncols - 1;
+  if (r >= g.nrows) r = g.nrows - 1;
+  return (long)r * g.ncols + c;
+}
+
+
+/* builds the canopy height model in chm: the highest hag of the tree
+   points in every cell, the mean of the neighbors in the empty cells
+   surrounded by vegetation, and 0 in the others */
+static void build_chm(const lidar_point_cloud & points, double cellsize, lidar_grid* chm) {
+
+  grid_init(points, cellsize, chm);
+  long ncells = chm->v.size();
+
+  //points from different threads fall in the same cells
+  vector< atomic<float> > high(ncells);
+  parallel_for(ncells, [&](long b, long e) {
+      for (long i = b; i < e; i++) high[i].store(GRID_NODATA, memory_order_relaxed);
+    });
+  parallel_for(points.data.size(), [&](long b, long e) {
+      for (long i = b; i < e; i++) {
+	const lidar_point & p = points.data[i];
+	if (!is_tree_point(p)) continue;
+	atomic_max(high[grid_cell(*chm, p.x, p.y)], points.hag[i]);
+      }
+    });
+
+  int nrows = chm->nrows, ncols = chm->ncols;
+  parallel_for(nrows, [&](long rbegin, long rend) {
+      for (long r = rbegin; r < rend; r++) {
+	for (int c = 0; c < ncols; c++) {
+	  float h = high[r*ncols + c].load(memory_order_relaxed);
+	  if (h != GRID_NODATA) {
+	    chm->v[r*ncols + c] = h;
+	    continue;
+	  }
+	  //a gap between the returns of a crown, or no vegetation
+	  double sum = 0;
+	  int k = 0;
+	  for (int i = r-1; i <= r+1; i++) {
+	    for (int j = c-1; j <= c+1; j++) {
+	      if (i < 0 || i >= nrows || j < 0 || j >= ncols) continue;
+	      float hn = high[(long)i*ncols + j].load(memory_order_relaxed);
+	      if (hn != GRID_NODATA) { sum += hn; k++; }
+	    }
+	  }
+	  chm->v[r*ncols + c] = (k >= CHM_FILL_MIN_NEIGHBORS) ? sum / k: 0;
+	}
+      }
+    });
+}
+
+
+/* returns the treetops of the chm, in row major order: the cells
+   above min_height higher than all the cells within their
+   window. Of cells of the same height, the first in row major order
+   wins, so a flat top gives one treetop. */
+static vector<long> find_treetops(const lidar_grid & chm, float min_height) {
+
+  int nrows = chm.nrows, ncols = chm.ncols;
+  vector<char> top(chm.v.size(), 0);
+  parallel_for(nrows, [&](long rbegin, long rend) {
+      for (long r = rbegin; r < rend; r++) {
+	for (int c = 0; c < ncols; c++) {
+	  long cell = r*ncols + c;
+	  float h = chm.v[cell];
+	  if (h <= min_height) continue;
+	  double w = tree_window_radius(h) / chm.cellsize;
+	  int k = (int)w;
+	  int is_top = 1;
+	  for (int i = r-k; i <= r+k && is_top; i++) {
+	    for (int j = c-k; j <= c+k; j++) {
+	      if (i < 0 || i >= nrows || j < 0 || j >= ncols) continue;
+	      if ((i-r)*(i-r) + (j-c)*(j-c) > w*w) continue;
+	      long other = (long)i*ncols + j;
+	      float ho = chm.v[other];
+	      if (ho > h || (ho == h && other < cell)) {
+		is_top = 0;
+		break;
+	      }
+	    }
+	  }
+	  top[cell] = is_top;
+	}
+      }
+    });
+
+  vector<long> tops;
+  for (size_t i = 0; i < top.size(); i++)
+    if (top[i]) tops.push_back(i);
+  return tops;
+}
+
+
+/* the seeded watershed of the tile (tr, tc) of the chm, from the tops
+   in the tile and its halo, down to min_height at most; sets the
+   crowns of the cells of the tile */
+static void watershed_tile(const lidar_grid & chm, const vector<long> & tops, int tr, int tc,
+			   int halo, float min_height, vector<int> & crown) {
+
+  int nrows = chm.nrows, ncols = chm.ncols;
+  int r0 = max(0, tr*TREE_TILE - halo), r1 = min(nrows, (tr+1)*TREE_TILE + halo);
+  int c0 = max(0, tc*TREE_TILE - halo), c1 = min(ncols, (tc+1)*TREE_TILE + halo);
+  int w = c1 - c0;
+  vector<int> label((long)(r1 - r0) * w, -1);
+
+  //the queue holds (height, -cell): highest first, then by row major
+  //order, so that the result doesn't depend on the tiles
+  priority_queue< pair<float, long> > queue;
+
+  //the tops in rows [r0, r1) are consecutive
+  long first = lower_bound(tops.begin(), tops.end(), (long)r0 * ncols) - tops.begin();
+  long last = lower_bound(tops.begin(), tops.end(), (long)r1 * ncols) - tops.begin();
+  for (long t = first; t < last; t++) {
+    int c = tops[t] % ncols;
+    if (c < c0 || c >= c1) continue;
+    int r = tops[t] / ncols;
+    label[(long)(r - r0) * w + (c - c0)] = t;
+    queue.push(make_pair(chm.v[tops[t]], -tops[t]));
+  }
+
+  double max_r2 = TREE_MAX_CROWN_RADIUS * TREE_MAX_CROWN_RADIUS / (chm.cellsize * chm.cellsize);
+  while (!queue.empty()) {
+    long cell = -queue.top().second;
+    queue.pop();
+    int r = cell / ncols, c = cell % ncols;
+    int t = label[(long)(r - r0) * w + (c - c0)];
+    int top_r = tops[t] / ncols, top_c = tops[t] % ncols;
+    float lowest = CROWN_MIN_FRACTION * chm.v[tops[t]];
+    if (lowest < min_height) lowest = min_height;
+
+    for (int i = r-1; i <= r+1; i++) {
+      for (int j = c-1; j <= c+1; j++) {
+	if (i < r0 || i >= r1 || j < c0 || j >= c1) continue;
+	int & l = label[(long)(i - r0) * w + (j - c0)];
+	if (l >= 0) continue;
+	long other = (long)i*ncols + j;
+	if (chm.v[other] < lowest) continue;
+	if ((i-top_r)*(i-top_r) + (j-top_c)*(j-top_c) > max_r2) continue;
+	l = t;
+	queue.push(make_pair(chm.v[other], -other));
+      }
+    }
+  }
+
+  //keep the cells of the tile; the halo belongs to other tiles
+  int rend = min(nrows, (tr+1)*TREE_TILE), cend = min(ncols, (tc+1)*TREE_TILE);
+  for (int r = tr*TREE_TILE; r < rend; r++)
+    for (int c = tc*TREE_TILE; c < cend; c++)
+      crown[(long)r*ncols + c] = label[(long)(r - r0) * w + (c - c0)];
+}
+
+
+
+void detect_trees(const lidar_point_cloud & points, const classify_params & cp, double cellsize,
+		  lidar_trees* result) {
+
+  assert(result && cellsize > 0);
+  assert(points.hag.size() == points.data.size());
+  double t = get_time();
+
+  lidar_grid & chm = result->chm;
+  build_chm(points, cellsize, &chm);
+  double t_chm = get_time() - t;
+
+  //the trees are the medium and high vegetation
+  float min_height = cp.low_veg_max_hag;
+  vector<long> tops = find_treetops(chm, min_height);
+
+  //the watershed, a tile per task
+  int halo = (int)ceil(2 * TREE_MAX_CROWN_RADIUS / cellsize);
+  int tiles_r = (chm.nrows + TREE_TILE - 1) / TREE_TILE;
+  int tiles_c = (chm.ncols + TREE_TILE - 1) / TREE_TILE;
+  result->crown.assign(chm.v.size(), -1);
+  parallel_for((long)tiles_r * tiles_c, [&](long b, long e) {
+      for (long k = b; k < e; k++)
+	watershed_tile(chm, tops, k / tiles_c, k % tiles_c, halo, min_height, result->crown);
+    });
+
+  //the trees, and the tree of every point
+  long ntrees = tops.size();
+  vector<long> ncells(ntrees, 0);
+  for (size_t i = 0; i < result->crown.size(); i++)
+    if (result->crown[i] >= 0) ncells[result->crown[i]]++;
+
+  long n = points.data.size();
+  result->id.resize(n);
+  vector< atomic<long> > npoints(ntrees);
+  for (long k = 0; k < ntrees; k++) npoints[k].store(0, memory_order_relaxed);
+  parallel_for(n, [&](long b, long e) {
+      for (long i = b; i < e; i++) {
+	const lidar_point & p = points.data[i];
+	int k = is_tree_point(p) ? result->crown[grid_cell(chm, p.x, p.y)]: -1;
+	result->id[i] = k;
+	if (k >= 0) npoints[k].fetch_add(1, memory_order_relaxed);
+      }
+    });
+
+  result->trees.resize(ntrees);
+  for (long k = 0; k < ntrees; k++) {
+    lidar_tree & tree = result->trees[k];
+    tree.x = chm.minx + (tops[k] % chm.ncols + 0.5) * cellsize;
+    tree.y = chm.miny + (tops[k] / chm.ncols + 0.5) * cellsize;
+    tree.height = chm.v[tops[k]];
+    tree.crown_area = ncells[k] * cellsize * cellsize;
+    tree.crown_diameter = 2 * sqrt(tree.crown_area / M_PI);
+    tree.nb_points = npoints[k].load(memory_order_relaxed);
+  }
+
+  printf("detect_trees: %ld trees in %.1f ms (CHM %d x %d cells of %.2f in %.1f ms, %d x %d tiles)\n",
+	 ntrees, 1000 * (get_time() - t), chm.ncols, chm.nrows, cellsize, 1000 * t_chm,
+	 tiles_c, tiles_r);
+}
+
+
+
+void print_trees(const lidar_trees & t) {
+
+  long ntrees = t.trees.size(), npoints = 0;
+  double height = 0, area = 0;
+  for (long k = 0; k < ntrees; k++) {
+    npoints += t.trees[k].nb_points;
+    height += t.trees[k].height;
+    area += t.trees[k].crown_area;
+  }
+  printf("trees: %ld, with %ld points, mean height %.1f, crown area %.1f (mean %.1f)\n",
+	 ntrees, npoints, ntrees ? height / ntrees: 0, area, ntrees ? area / ntrees: 0);
+
+  //the tallest
+  vector<int> order(ntrees);
+  for (long k = 0; k < ntrees; k++) order[k] = k;
+  sort(order.begin(), order.end(), [&](int a, int b) {
+      return t.trees[a].height > t.trees[b].height;
+    });
+  for (int i = 0; i < (int)ntrees && i < NB_PRINTED_TREES; i++) {
+    const lidar_tree & tree = t.trees[order[i]];
+    printf("\ttree %d: x=%.2f y=%.2f, height %.1f, crown %.1f (diameter %.1f), %ld points\n",
+	   order[i], tree.x, tree.y, tree.height, tree.crown_area, tree.crown_diameter,
+	   tree.nb_points);
+  }
+}
+
+
+
+void write_trees_csv(const lidar_trees & t, const char* fname) {
+
+  FILE* f = fopen(fname, "w");
+  if (!f) {
+    printf("write_trees_csv: cannot open file %s\n", fname);
+    exit(1);
+  }
+  fprintf(f, "id,x,y,height,crown_area,crown_diameter,points\n");
+  for (size_t k = 0; k < t.trees.size(); k++) {
+    const lidar_tree & tree = t.trees[k];
+    fprintf(f, "%ld,%.2f,%.2f,%.2f,%.2f,%.2f,%ld\n", (long)k, tree.x, tree.y, tree.height,
+	    tree.crown_area, tree.crown_diameter, tree.nb_points);
+  }
+  fclose(f);
+  printf("write_trees_csv: wrote %ld trees to %s\n", (long)t.trees.size(), fname);
+}
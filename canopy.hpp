@@ -0,0 +1,85 @@
+#ifndef __CANOPY_HPP
+#define __CANOPY_HPP
+
+#include "lidar.hpp"
+#include "hag.hpp"
+
+#include <vector>
+using namespace std;
+
+
+
+//the cell size of the canopy height model, in the units of the points
+const double CANOPY_CELLSIZE = 0.5;
+
+//crowns are at most this far from their treetop
+const double TREE_MAX_CROWN_RADIUS = 10;
+
+
+//a tree: its top, height and crown
+typedef struct _lidar_tree {
+  float x, y;  //the center of the cell of the treetop
+  float height;  //height above ground of the treetop
+  float crown_area;
+  float crown_diameter;  //of the circle with the area of the crown
+  long nb_points;  //vegetation points in the crown
+} lidar_tree;
+
+
+typedef struct _lidar_trees {
+
+  //the canopy height model: the highest height above ground of the
+  //vegetation in every cell, 0 where there is none
+  lidar_grid chm;
+
+  //the crown of every cell of chm, -1 for none
+  vector<int> crown;
+
+  //the trees, in the order of their treetops by row
+  vector<lidar_tree> trees;
+
+  //the tree of each point, in the same order as the points; -1 if
+  //the point is not in a crown
+  vector<int> id;
+
+} lidar_trees;
+
+
+/* individual tree detection on the vegetation (mycode 4 and 5, above
+   cp.low_veg_max_hag) of points, which must have been classified with
+   the parameters cp:
+
+   1. the canopy height model (CHM) is the highest points.hag in every
+   cell of side cellsize; empty cells surrounded by vegetation are
+   filled with the mean of their neighbors.
+
+   2. treetops are the cells of the CHM above cp.low_veg_max_hag that
+   are the highest within a window that grows with their height, as
+   the crowns of taller trees are wider (crown width from the height
+   of deciduous trees, Popescu and Wynne 2004).
+
+   3. crowns are grown from the treetops by a seeded watershed: the
+   cells are visited from the highest down, and a cell joins the
+   crown of its neighbor visited first, if it is above half the
+   height of that tree and cp.low_veg_max_hag, and within
+   TREE_MAX_CROWN_RADIUS of its top.
+
+   The watershed runs in parallel on tiles of the CHM, each with a
+   halo of twice TREE_MAX_CROWN_RADIUS around it, and keeps the
+   crowns of the cells of the tile; the crowns can only differ from
+   those of the whole CHM where crowns compete across the halo.
+*/
+void detect_trees(const lidar_point_cloud & points, const classify_params & cp, double cellsize,
+		  lidar_trees* result);
+
+
+//prints the number of trees and the tallest ones
+void print_trees(const lidar_trees & t);
+
+
+/* writes the trees to a CSV file, one line per tree: id, x, y,
+   height, crown_area, crown_diameter, points */
+void write_trees_csv(const lidar_trees & t, const char* fname);
+
+
+#endif
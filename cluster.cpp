@@ -0,0 +1,222 @@
+#include "cluster.hpp"
+#include "reorder.hpp"
+#include "parallel.hpp"
+#include "timer.hpp"
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+using namespace std;
+
+
+//bits per coordinate in a voxel key
+const int VOXEL_BITS = 21;
+const unsigned long long VOXEL_MASK = (1ULL << VOXEL_BITS) - 1;
+
+//number of clusters printed by print_clusters
+const int NB_PRINTED_CLUSTERS = 10;
+
+
+static inline unsigned long long voxel_coord(double v, double size) {
+  if (v < 0) return 0;
+  unsigned long long q = (unsigned long long)(v / size);
+  return (q < VOXEL_MASK) ? q: VOXEL_MASK;
+}
+
+
+/* returns the root of x. Halves the path on the way up: x is linked
+   to its grandparent. Losing that race to another thread is harmless,
+   since any ancestor is a valid parent. Parents always have smaller
+   indices than their children. */
+static int find_root(vector< atomic<int> > & parent, int x) {
+  while (1) {
+    int p = parent[x].load(memory_order_relaxed);
+    if (p == x) return x;
+    int gp = parent[p].load(memory_order_relaxed);
+    if (gp != p) parent[x].compare_exchange_weak(p, gp, memory_order_relaxed);
+    x = gp;
+  }
+}
+
+
+/* merges the sets of a and b: links the root with the larger index
+   under the other one. The link is a CAS that fails if the root got
+   a parent in the meantime, in which case we start over. */
+static void unite(vector< atomic<int> > & parent, int a, int b) {
+  while (1) {
+    a = find_root(parent, a);
+    b = find_root(parent, b);
+    if (a == b) return;
+    if (a < b) swap(a, b);
+    int expected = a;
+    if (parent[a].compare_exchange_strong(expected, b, memory_order_relaxed)) return;
+  }
+}
+
+
+static inline void atomic_min(atomic<float> & a, float v) {
+  float old = a.load(memory_order_relaxed);
+  while (v < old && !a.compare_exchange_weak(old, v, memory_order_relaxed))
+    ;
+}
+
+static inline void atomic_max(atomic<float> & a, float v) {
+  float old = a.load(memory_order_relaxed);
+  while (v > old && !a.compare_exchange_weak(old, v, memory_order_relaxed))
+    ;
+}
+
+
+
+void cluster_points(const lidar_point_cloud & points, unsigned int codemask,
+		    double radius, long min_size, lidar_clusters* result) {
+
+  double t = get_time();
+  long n = points.data.size();
+  result->id.assign(n, -1);
+  result->clusters.clear();
+  if (radius <= 0) radius = 1;
+
+  //the selected points, with the key of their voxel: x, y and z of
+  //the voxel in 21 bits each, z in the high bits
+  int nchunks = 4 * nb_threads();
+  vector<long> count(nchunks + 1, 0);
+  auto selected = [&](const lidar_point & p) {
+    return p.mycode >= 0 && p.mycode < 32 && (codemask >> p.mycode & 1);
+  };
+  parallel_for_chunks(n, nchunks, [&](int c, long b, long e) {
+      for (long i = b; i < e; i++)
+	if (selected(points.data[i])) count[c+1]++;
+    });
+  for (int c = 0; c < nchunks; c++) count[c+1] += count[c];
+  long m = count[nchunks];
+
+  vector<unsigned long long> key(m);
+  vector<int> sel(m);
+  parallel_for_chunks(n, nchunks, [&](int c, long b, long e) {
+      long k = count[c];
+      for (long i = b; i < e; i++) {
+	const lidar_point & p = points.data[i];
+	if (!selected(p)) continue;
+	key[k] = voxel_coord(p.x - points.minx, radius)
+	  | voxel_coord(p.y - points.miny, radius) << VOXEL_BITS
+	  | voxel_coord(p.z - points.minz, radius) << (2 * VOXEL_BITS);
+	sel[k++] = i;
+      }
+    });
+  radix_sort(key, sel);
+
+  //the occupied voxels: the points of voxel v are sel[vstart[v]] to
+  //sel[vstart[v+1]-1]
+  vector<unsigned long long> vkey;
+  vector<long> vstart;
+  for (long s = 0; s < m; s++) {
+    if (s == 0 || key[s] != key[s-1]) {
+      vkey.push_back(key[s]);
+      vstart.push_back(s);
+    }
+  }
+  vstart.push_back(m);
+  int nv = vkey.size();
+
+  //connect every voxel to its occupied neighbors. Each pair is seen
+  //once, from the voxel with the smaller key, so only the 13
+  //neighbors with larger keys are looked up
+  vector< atomic<int> > parent(nv);
+  parallel_for(nv, [&](long b, long e) {
+      for (long v = b; v < e; v++) parent[v].store(v, memory_order_relaxed);
+    });
+  parallel_for(nv, [&](long b, long e) {
+      for (long v = b; v < e; v++) {
+	long x = vkey[v] & VOXEL_MASK;
+	long y = vkey[v] >> VOXEL_BITS & VOXEL_MASK;
+	long z = vkey[v] >> (2 * VOXEL_BITS);
+	for (int dz = 0; dz <= 1; dz++)
+	  for (int dy = -1; dy <= 1; dy++)
+	    for (int dx = -1; dx <= 1; dx++) {
+	      if (dz == 0 && (dy < 0 || (dy == 0 && dx <= 0))) continue;
+	      long nx = x + dx, ny = y + dy, nz = z + dz;
+	      if (nx < 0 || ny < 0 || nx > (long)VOXEL_MASK || ny > (long)VOXEL_MASK ||
+		  nz > (long)VOXEL_MASK) continue;
+	      unsigned long long k = nx | ny << VOXEL_BITS | nz << (2 * VOXEL_BITS);
+	      vector<unsigned long long>::iterator it =
+		lower_bound(vkey.begin() + v + 1, vkey.end(), k);
+	      if (it != vkey.end() && *it == k) unite(parent, v, it - vkey.begin());
+	    }
+      }
+    });
+
+  //the size of each component, at its root
+  vector<int> root(nv);
+  vector< atomic<long> > size(nv);
+  parallel_for(nv, [&](long b, long e) {
+      for (long v = b; v < e; v++) size[v].store(0, memory_order_relaxed);
+    });
+  parallel_for(nv, [&](long b, long e) {
+      for (long v = b; v < e; v++) {
+	root[v] = find_root(parent, v);
+	size[root[v]].fetch_add(vstart[v+1] - vstart[v], memory_order_relaxed);
+      }
+    });
+
+  //number the components that are large enough, largest first
+  vector< pair<long, int> > order;
+  for (int v = 0; v < nv; v++) {
+    long s = size[v].load(memory_order_relaxed);
+    if (root[v] == v && s >= min_size) order.push_back(make_pair(-s, v));
+  }
+  sort(order.begin(), order.end());
+  vector<int> label(nv, -1);
+  int nc = order.size();
+  for (int c = 0; c < nc; c++) label[order[c].second] = c;
+
+  //label the points and compute the bounding boxes
+  vector< atomic<float> > box(6 * (long)nc);
+  for (int c = 0; c < nc; c++) {
+    box[6*c].store(points.maxx);   box[6*c+1].store(points.minx);
+    box[6*c+2].store(points.maxy); box[6*c+3].store(points.miny);
+    box[6*c+4].store(points.maxz); box[6*c+5].store(points.minz);
+  }
+  parallel_for(nv, [&](long b, long e) {
+      for (long v = b; v < e; v++) {
+	int c = label[root[v]];
+	if (c < 0) continue;
+	for (long s = vstart[v]; s < vstart[v+1]; s++) {
+	  const lidar_point & p = points.data[sel[s]];
+	  result->id[sel[s]] = c;
+	  atomic_min(box[6*c], p.x);   atomic_max(box[6*c+1], p.x);
+	  atomic_min(box[6*c+2], p.y); atomic_max(box[6*c+3], p.y);
+	  atomic_min(box[6*c+4], p.z); atomic_max(box[6*c+5], p.z);
+	}
+      }
+    });
+
+  result->clusters.resize(nc);
+  for (int c = 0; c < nc; c++) {
+    lidar_cluster & cl = result->clusters[c];
+    cl.size = -order[c].first;
+    cl.minx = box[6*c];   cl.maxx = box[6*c+1];
+    cl.miny = box[6*c+2]; cl.maxy = box[6*c+3];
+    cl.minz = box[6*c+4]; cl.maxz = box[6*c+5];
+  }
+
+  printf("cluster_points: %ld points in %d voxels of side %.2f, %d clusters of at least %ld points in %.1f ms\n",
+	 m, nv, radius, nc, min_size, 1000 * (get_time() - t));
+}
+
+
+
+void print_clusters(const lidar_clusters & c) {
+
+  long n = 0;
+  for (size_t i = 0; i < c.clusters.size(); i++) n += c.clusters[i].size;
+  printf("clusters: %ld, with %ld points\n", (long)c.clusters.size(), n);
+  for (int i = 0; i < (int)c.clusters.size() && i < NB_PRINTED_CLUSTERS; i++) {
+    const lidar_cluster & cl = c.clusters[i];
+    printf("\tcluster %d: %ld points, %.1f x %.1f x %.1f, x=[%.2f,%.2f] y=[%.2f,%.2f] z=[%.2f,%.2f]\n",
+	   i, cl.size, cl.maxx - cl.minx, cl.maxy - cl.miny, cl.maxz - cl.minz,
+	   cl.minx, cl.maxx, cl.miny, cl.maxy, cl.minz, cl.maxz);
+  }
+}
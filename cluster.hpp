@@ -0,0 +1,48 @@
+#ifndef __CLUSTER_HPP
+#define __CLUSTER_HPP
+
+#include "lidar.hpp"
+
+#include <vector>
+using namespace std;
+
+
+
+//a cluster of points: its number of points and bounding box
+typedef struct _lidar_cluster {
+  long size;
+  float  minx, maxx, miny, maxy, minz, maxz;
+} lidar_cluster;
+
+
+typedef struct _lidar_clusters {
+
+  //the cluster of each point, in the same order as the points; -1
+  //if the point is not in any cluster
+  vector<int> id;
+
+  //the clusters, largest first
+  vector<lidar_cluster> clusters;
+
+} lidar_clusters;
+
+
+/* Euclidean clustering of the points whose mycode is in codemask
+   (bit c set for mycode c). The selected points are put in voxels of
+   side radius, and two voxels are connected if they touch (face, edge
+   or corner); a cluster is a connected component of voxels, so points
+   closer than radius are always in the same cluster. Clusters with
+   less than min_size points are dropped.
+
+   The components are found in parallel with a lock-free union-find
+   over the occupied voxels.
+*/
+void cluster_points(const lidar_point_cloud & points, unsigned int codemask,
+		    double radius, long min_size, lidar_clusters* result);
+
+
+//prints the number of clusters and the largest ones
+void print_clusters(const lidar_clusters & c);
+
+
+#endif
@@ -0,0 +1,266 @@
+#include "compare.hpp"
+#include "voxel.hpp"
+#include "parallel.hpp"
+#include "timer.hpp"
+
+#include <math.h>
+#include <stdio.h>
+
+#include <vector>
+using namespace std;
+
+
+//fewest reference points to fit a plane to, for M3C2
+const int M3C2_MIN_POINTS = 3;
+
+
+//the voxels [lo, hi] of the index within d of (x,y,z) on every axis,
+//clamped to the index; returns 0 if there are none
+static int voxel_range(const voxel_index & vi, double x, double y, double z, double d,
+		       int lo[3], int hi[3]) {
+  double c[3] = {(x - vi.minx) / vi.size, (y - vi.miny) / vi.size, (z - vi.minz) / vi.size};
+  int n[3] = {vi.nx, vi.ny, vi.nz};
+  for (int a = 0; a < 3; a++) {
+    double l = floor(c[a] - d / vi.size), h = floor(c[a] + d / vi.size);
+    if (h < 0 || l >= n[a]) return 0;
+    lo[a] = (l < 0) ? 0: (int)l;
+    hi[a] = (h >= n[a]) ? n[a] - 1: (int)h;
+  }
+  return 1;
+}
+
+
+/* the nearest point of ref to p within max_dist, and its squared
+   distance in d2; -1 if there is none. Searches cubes of voxels of
+   growing size around p and stops when no voxel outside the cube can
+   be closer than the best found. */
+static long nearest_point(const voxel_index & vi, const lidar_point_cloud & ref,
+			  const lidar_point & p, double max_dist, double* d2) {
+
+  long best = -1;
+  double best_d2 = max_dist * max_dist;
+  int prev_lo[3] = {0, 0, 0}, prev_hi[3] = {-1, -1, -1};
+  for (int r = 0; ; r++) {
+    //the cube of half side (r+0.5) voxels around p
+    double d = (r + 0.5) * vi.size;
+    int lo[3], hi[3];
+    if (!voxel_range(vi, p.x, p.y, p.z, d, lo, hi)) {
+      if (d > max_dist) break;
+      continue;
+    }
+    for (int k = lo[2]; k <= hi[2]; k++) {
+      for (int j = lo[1]; j <= hi[1]; j++) {
+	for (int i = lo[0]; i <= hi[0]; i++) {
+	  //the inner voxels were searched before
+	  if (i >= prev_lo[0] && i <= prev_hi[0] && j >= prev_lo[1] && j <= prev_hi[1] &&
+	      k >= prev_lo[2] && k <= prev_hi[2]) continue;
+	  long v = voxel_id(vi, i, j, k);
+	  for (int s = vi.start[v]; s < vi.start[v+1]; s++) {
+	    const lidar_point & q = ref.data[vi.points[s]];
+	    double dx = q.x - p.x, dy = q.y - p.y, dz = q.z - p.z;
+	    double dd = dx*dx + dy*dy + dz*dz;
+	    if (dd < best_d2) {
+	      best_d2 = dd;
+	      best = vi.points[s];
+	    }
+	  }
+	}
+      }
+    }
+    for (int a = 0; a < 3; a++) {
+      prev_lo[a] = lo[a];
+      prev_hi[a] = hi[a];
+    }
+    //the points outside the cube are farther than d
+    if (d * d >= best_d2 || d > max_dist) break;
+    if (lo[0] == 0 && lo[1] == 0 && lo[2] == 0 &&
+	hi[0] == vi.nx - 1 && hi[1] == vi.ny - 1 && hi[2] == vi.nz - 1) break;
+  }
+  *d2 = best_d2;
+  return best;
+}
+
+
+/* the eigenvector of the smallest eigenvalue of the symmetric matrix
+   a, with Jacobi rotations; a is destroyed */
+static void smallest_eigenvector(double a[3][3], double n[3]) {
+
+  double v[3][3] = {{1, 0, 0}, {0, 1, 0}, {0, 0, 1}};
+  for (int sweep = 0; sweep < 32; sweep++) {
+    double off = a[0][1]*a[0][1] + a[0][2]*a[0][2] + a[1][2]*a[1][2];
+    double diag = a[0][0]*a[0][0] + a[1][1]*a[1][1] + a[2][2]*a[2][2];
+    if (off <= 1e-24 * diag || off == 0) break;
+    for (int p = 0; p < 2; p++) {
+      for (int q = p + 1; q < 3; q++) {
+	if (a[p][q] == 0) continue;
+	//the rotation in the (p,q) plane that zeroes a[p][q]
+	double theta = (a[q][q] - a[p][p]) / (2 * a[p][q]);
+	double t = ((theta >= 0) ? 1: -1) / (fabs(theta) + sqrt(theta*theta + 1));
+	double c = 1 / sqrt(t*t + 1), s = t * c;
+	for (int k = 0; k < 3; k++) {
+	  double akp = a[k][p], akq = a[k][q];
+	  a[k][p] = c*akp - s*akq;
+	  a[k][q] = s*akp + c*akq;
+	}
+	for (int k = 0; k < 3; k++) {
+	  double apk = a[p][k], aqk = a[q][k];
+	  a[p][k] = c*apk - s*aqk;
+	  a[q][k] = s*apk + c*aqk;
+	}
+	for (int k = 0; k < 3; k++) {
+	  double vkp = v[k][p], vkq = v[k][q];
+	  v[k][p] = c*vkp - s*vkq;
+	  v[k][q] = s*vkp + c*vkq;
+	}
+      }
+    }
+  }
+  int m = 0;
+  for (int k = 1; k < 3; k++)
+    if (a[k][k] < a[m][m]) m = k;
+  for (int k = 0; k < 3; k++) n[k] = v[k][m];
+}
+
+
+/* the mean position along n, relative to p, of the points of cloud
+   (indexed by vi) in the cylinder of the radius around the line
+   through p along n, up to max_dist away; returns the number of
+   points in the cylinder, and their mean in t */
+static long cylinder_mean(const voxel_index & vi, const lidar_point_cloud & cloud,
+			  const lidar_point & p, const double n[3], double radius,
+			  double max_dist, double* t) {
+
+  int lo[3], hi[3];
+  if (!voxel_range(vi, p.x, p.y, p.z, max_dist + radius, lo, hi)) return 0;
+  double tsum = 0;
+  long tcount = 0;
+  for (int k = lo[2]; k <= hi[2]; k++) {
+    for (int j = lo[1]; j <= hi[1]; j++) {
+      for (int i = lo[0]; i <= hi[0]; i++) {
+	long v = voxel_id(vi, i, j, k);
+	for (int s = vi.start[v]; s < vi.start[v+1]; s++) {
+	  const lidar_point & q = cloud.data[vi.points[s]];
+	  double d[3] = {q.x - p.x, q.y - p.y, q.z - p.z};
+	  double dt = d[0]*n[0] + d[1]*n[1] + d[2]*n[2];
+	  if (fabs(dt) > max_dist) continue;
+	  double r2 = d[0]*d[0] + d[1]*d[1] + d[2]*d[2] - dt*dt;
+	  if (r2 > radius * radius) continue;
+	  tsum += dt;
+	  tcount++;
+	}
+      }
+    }
+  }
+  if (tcount > 0) *t = tsum / tcount;
+  return tcount;
+}
+
+
+/* the M3C2-style distance at point p of points to ref (see
+   compare.hpp), or COMPARE_NODATA; vi indexes points and vref ref */
+static float m3c2_distance(const voxel_index & vi, const lidar_point_cloud & points,
+			   const voxel_index & vref, const lidar_point_cloud & ref,
+			   const lidar_point & p, double radius, double max_dist) {
+
+  //the plane fit to the reference points within radius of p
+  int lo[3], hi[3];
+  if (!voxel_range(vref, p.x, p.y, p.z, radius, lo, hi)) return COMPARE_NODATA;
+  double sum[3] = {0, 0, 0}, prod[3][3] = {{0, 0, 0}, {0, 0, 0}, {0, 0, 0}};
+  long count = 0;
+  for (int k = lo[2]; k <= hi[2]; k++) {
+    for (int j = lo[1]; j <= hi[1]; j++) {
+      for (int i = lo[0]; i <= hi[0]; i++) {
+	long v = voxel_id(vref, i, j, k);
+	for (int s = vref.start[v]; s < vref.start[v+1]; s++) {
+	  const lidar_point & q = ref.data[vref.points[s]];
+	  //relative to p, to keep the precision
+	  double d[3] = {q.x - p.x, q.y - p.y, q.z - p.z};
+	  if (d[0]*d[0] + d[1]*d[1] + d[2]*d[2] > radius * radius) continue;
+	  for (int a = 0; a < 3; a++) {
+	    sum[a] += d[a];
+	    for (int b = 0; b < 3; b++) prod[a][b] += d[a] * d[b];
+	  }
+	  count++;
+	}
+      }
+    }
+  }
+  if (count < M3C2_MIN_POINTS) return COMPARE_NODATA;
+  double cov[3][3];
+  for (int a = 0; a < 3; a++)
+    for (int b = 0; b < 3; b++)
+      cov[a][b] = prod[a][b] / count - (sum[a] / count) * (sum[b] / count);
+  double n[3];
+  smallest_eigenvector(cov, n);
+  if (n[2] < 0)
+    for (int a = 0; a < 3; a++) n[a] = -n[a];
+
+  //the distance between the means of the two clouds in the same
+  //cylinder, so that the roughness of the surface averages out; p is
+  //always in its own cylinder
+  double tref, tpoints;
+  if (cylinder_mean(vref, ref, p, n, radius, max_dist, &tref) == 0) return COMPARE_NODATA;
+  if (cylinder_mean(vi, points, p, n, radius, max_dist, &tpoints) == 0) return COMPARE_NODATA;
+  return tpoints - tref;
+}
+
+
+
+void compare_clouds(const lidar_point_cloud & points, const lidar_point_cloud & ref,
+		    int method, double radius, double max_dist, vector<float>* dist) {
+
+  double t = get_time();
+  voxel_index vref;
+  voxel_index_build(ref, 0, &vref);
+  //M3C2 also averages the points compared, in the same cylinders
+  voxel_index vi;
+  if (method == COMPARE_M3C2) voxel_index_build(points, 0, &vi);
+  double t_index = get_time() - t;
+
+  long n = points.data.size();
+  dist->resize(n);
+  parallel_for(n, [&](long b, long e) {
+      for (long i = b; i < e; i++) {
+	const lidar_point & p = points.data[i];
+	if (method == COMPARE_M3C2) {
+	  (*dist)[i] = m3c2_distance(vi, points, vref, ref, p, radius, max_dist);
+	  continue;
+	}
+	double d2;
+	long q = nearest_point(vref, ref, p, max_dist, &d2);
+	if (q < 0) (*dist)[i] = COMPARE_NODATA;
+	else (*dist)[i] = (p.z >= ref.data[q].z) ? sqrt(d2): -sqrt(d2);
+      }
+    });
+
+  double s = get_time() - t;
+  printf("compare_clouds: %s distances of %ld points to %ld reference points in %.1f ms "
+	 "(index %.1f ms, %.0f points/s)\n", method == COMPARE_M3C2 ? "M3C2": "C2C",
+	 n, (long)ref.data.size(), 1000 * s, 1000 * t_index, s > 0 ? n / s: 0);
+}
+
+
+
+void print_compare(const vector<float> & dist, double threshold) {
+
+  long n = 0, nodata = 0, up = 0, down = 0;
+  double sum = 0, sum2 = 0;
+  for (size_t i = 0; i < dist.size(); i++) {
+    if (dist[i] == COMPARE_NODATA) {
+      nodata++;
+      continue;
+    }
+    n++;
+    sum += dist[i];
+    sum2 += dist[i] * dist[i];
+    if (dist[i] > threshold) up++;
+    if (dist[i] < -threshold) down++;
+  }
+  double mean = n ? sum / n: 0;
+  double var = n ? sum2 / n - mean * mean: 0;
+  printf("change: %ld points compared, mean distance %.3f, standard deviation %.3f\n",
+	 n, mean, sqrt(var > 0 ? var: 0));
+  printf("\tmoved up more than %.2f: %ld (%.1f%%), down: %ld (%.1f%%)\n", threshold,
+	 up, n ? 100.0 * up / n: 0, down, n ? 100.0 * down / n: 0);
+  printf("\tno reference nearby (new): %ld\n", nodata);
+}
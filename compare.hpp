@@ -0,0 +1,49 @@
+#ifndef __COMPARE_HPP
+#define __COMPARE_HPP
+
+#include "lidar.hpp"
+
+#include <vector>
+using namespace std;
+
+
+
+//how distances to the reference are measured
+const int COMPARE_C2C = 0;
+const int COMPARE_M3C2 = 1;
+
+//the distance of a point with no reference points near it
+const float COMPARE_NODATA = -9999;
+
+
+/* computes, for every point of points, its signed distance to the
+   reference cloud ref (e.g. the previous survey of the same area), in
+   parallel, with a voxel index of ref. Positive distances are above
+   the reference, negative below.
+
+   COMPARE_C2C: the distance to the nearest reference point, signed by
+   which of the two is higher.
+
+   COMPARE_M3C2: in the style of M3C2, the distance along the normal
+   of the reference surface: the normal is that of the plane fit (PCA)
+   to the reference points within radius of the point, and the
+   distance is between the means of the points and of the reference
+   points in the cylinder of that radius along the normal through the
+   point, so that the roughness of the surfaces averages out (a cloud
+   compared with itself gives 0).
+
+   Points with no reference point within max_dist (C2C), or with too
+   few reference points to fit a normal or none in the cylinder up to
+   max_dist (M3C2), get COMPARE_NODATA: they are new, e.g. in an area
+   the reference doesn't cover.
+*/
+void compare_clouds(const lidar_point_cloud & points, const lidar_point_cloud & ref,
+		    int method, double radius, double max_dist, vector<float>* dist);
+
+
+/* prints a summary of the distances: mean, standard deviation, and
+   how many points moved more than threshold up or down */
+void print_compare(const vector<float> & dist, double threshold);
+
+
+#endif
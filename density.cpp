@@ -0,0 +1,89 @@
+#include "density.hpp"
+#include "parallel.hpp"
+
+#include <math.h>
+
+#include <atomic>
+#include <vector>
+using namespace std;
+
+
+
+static inline void atomic_max(atomic<float> & a, float v) {
+  float old = a.load(memory_order_relaxed);
+  while (v > old && !a.compare_exchange_weak(old, v, memory_order_relaxed))
+    ;
+}
+
+
+
+void density_build(const lidar_point_cloud & points, const unsigned int* index, long n,
+		   int use_mycode, density_grid* g) {
+
+  double dx = points.maxx - points.minx, dy = points.maxy - points.miny;
+  double side = (dx > dy) ? dx: dy;
+  g->minx = points.minx;
+  g->miny = points.miny;
+  g->cellsize = (side > 0) ? side / DENSITY_MAX_SIDE: 1;
+  g->ncols = (int)ceil(dx / g->cellsize);
+  g->nrows = (int)ceil(dy / g->cellsize);
+  if (g->ncols < 1) g->ncols = 1;
+  if (g->nrows < 1) g->nrows = 1;
+  long ncells = (long)g->nrows * g->ncols;
+
+  //points from different threads fall in the same cells, so the
+  //counts and max are atomic
+  vector< atomic<int> > count(ncells);
+  vector< atomic<float> > maxz(ncells);
+  vector< atomic<float> > maxhag(ncells);
+  bool has_hag = (points.hag.size() == points.data.size());
+  vector< atomic<int> > by_class(ncells * DENSITY_NB_CLASSES);
+  parallel_for(ncells, [&](long b, long e) {
+      for (long i = b; i < e; i++) {
+	count[i].store(0, memory_order_relaxed);
+	maxz[i].store(-HUGE_VALF, memory_order_relaxed);
+	maxhag[i].store(has_hag ? -HUGE_VALF: 0, memory_order_relaxed);
+	for (int k = 0; k < DENSITY_NB_CLASSES; k++)
+	  by_class[i*DENSITY_NB_CLASSES + k].store(0, memory_order_relaxed);
+      }
+    });
+
+  parallel_for(n, [&](long b, long e) {
+      for (long k = b; k < e; k++) {
+	const lidar_point & p = points.data[index[k]];
+	int c = (int)((p.x - g->minx) / g->cellsize);
+	int r = (int)((p.y - g->miny) / g->cellsize);
+	if (c >= g->ncols) c = g->ncols - 1;
+	if (r >= g->nrows) r = g->nrows - 1;
+	long cell = (long)r * g->ncols + c;
+	count[cell].fetch_add(1, memory_order_relaxed);
+	atomic_max(maxz[cell], p.z);
+	if (has_hag) atomic_max(maxhag[cell], points.hag[index[k]]);
+	int code = use_mycode ? p.mycode: p.code;
+	if (code >= 0 && code < DENSITY_NB_CLASSES)
+	  by_class[cell*DENSITY_NB_CLASSES + code].fetch_add(1, memory_order_relaxed);
+      }
+    });
+
+  g->count.resize(ncells);
+  g->maxz.resize(ncells);
+  g->maxhag.resize(ncells);
+  g->dominant.resize(ncells);
+  g->max_count = parallel_reduce(ncells, 0, [&](long b, long e, int & m) {
+      for (long i = b; i < e; i++) {
+	g->count[i] = count[i].load(memory_order_relaxed);
+	g->maxz[i] = maxz[i].load(memory_order_relaxed);
+	g->maxhag[i] = maxhag[i].load(memory_order_relaxed);
+	int best = 1, best_count = 0;
+	for (int k = 0; k < DENSITY_NB_CLASSES; k++) {
+	  int nk = by_class[i*DENSITY_NB_CLASSES + k].load(memory_order_relaxed);
+	  if (nk > best_count) {
+	    best = k;
+	    best_count = nk;
+	  }
+	}
+	g->dominant[i] = best;
+	if (g->count[i] > m) m = g->count[i];
+      }
+    }, [](int a, int b) { return (a > b) ? a: b; });
+}
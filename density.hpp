@@ -0,0 +1,52 @@
+#ifndef __DENSITY_HPP
+#define __DENSITY_HPP
+
+#include "lidar.hpp"
+
+#include <vector>
+using namespace std;
+
+
+
+//cells on the longer side of the grid
+const int DENSITY_MAX_SIDE = 256;
+
+//classes counted for the dominant class; codes above are not counted
+const int DENSITY_NB_CLASSES = 19;
+
+
+/* the points aggregated in a 2D grid over the xy bounding box of the
+   cloud: what is drawn instead of the points when they are too dense
+   to be seen one by one */
+typedef struct _density_grid {
+
+  //cell (r,c) is x=[minx + c*cellsize, minx + (c+1)*cellsize),
+  //y=[miny + r*cellsize, ...); its values are at r*ncols+c
+  double minx, miny, cellsize;
+  int nrows, ncols;
+
+  //the number of points in every cell, and the largest
+  vector<int> count;
+  int max_count;
+
+  //the highest z in every cell (undefined if count is 0)
+  vector<float> maxz;
+
+  //the largest height above ground in every cell (undefined if count
+  //is 0, and 0 if the points have no height above ground)
+  vector<float> maxhag;
+
+  //the most frequent class in every cell
+  vector<unsigned char> dominant;
+
+} density_grid;
+
+
+/* bins the points index[0..n) of points in g, in parallel, with
+   atomic counts and max; the class of a point is its mycode if
+   use_mycode, its code otherwise */
+void density_build(const lidar_point_cloud & points, const unsigned int* index, long n,
+		   int use_mycode, density_grid* g);
+
+
+#endif
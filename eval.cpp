@@ -0,0 +1,151 @@
+#include "eval.hpp"
+#include "reader.hpp"
+#include "parallel.hpp"
+#include "timer.hpp"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+using namespace std;
+
+
+
+static inline int clamp_code(int c) {
+  if (c < 0) return 0;
+  return (c < EVAL_NB_CODES) ? c: EVAL_NB_CODES - 1;
+}
+
+
+void eval_init(lidar_eval* e) {
+  assert(e);
+  memset(e, 0, sizeof(lidar_eval));
+}
+
+
+
+//the confusion matrix of one chunk of points
+typedef struct _eval_acc {
+  long confusion[EVAL_NB_CODES][EVAL_NB_CODES];
+} eval_acc;
+
+
+void eval_add(const lidar_point_cloud & points, lidar_eval* e) {
+
+  assert(e);
+  int nchunks = nb_threads();
+  vector<eval_acc> acc(nchunks);
+  memset(&acc[0], 0, nchunks * sizeof(eval_acc));
+
+  parallel_for_chunks(points.data.size(), nchunks, [&](int c, long b, long end) {
+      for (long i = b; i < end; i++) {
+	const lidar_point & p = points.data[i];
+	acc[c].confusion[clamp_code(p.code)][clamp_code(p.mycode)]++;
+      }
+    });
+
+  for (int c = 0; c < nchunks; c++)
+    for (int i = 0; i < EVAL_NB_CODES; i++)
+      for (int j = 0; j < EVAL_NB_CODES; j++)
+	e->confusion[i][j] += acc[c].confusion[i][j];
+  e->n += points.data.size();
+}
+
+
+
+void eval_tiles(int ntiles, char** fnames, lidar_eval* e) {
+
+  assert(e);
+  double t0 = get_time();
+
+  /* the tiles are done one at a time, each stage on all the threads:
+     classify() then has the pool to itself, and its time doesn't
+     depend on the number of tiles or on what else runs, which
+     running tiles concurrently did (a thread waiting for its loop
+     helps with the loops of the other tiles) */
+  for (int tile = 0; tile < ntiles; tile++) {
+    lidar_point_cloud points;
+    read_lidar_from_file(fnames[tile], &points);
+
+    double t = get_time();
+    classify(points);
+    t = get_time() - t;
+
+    lidar_eval tile_eval;
+    eval_init(&tile_eval);
+    eval_add(points, &tile_eval);
+    printf("eval: %s: %ld points, accuracy %.2f%%, classified in %.1f ms\n",
+	   fnames[tile], tile_eval.n, 100 * eval_accuracy(tile_eval), 1000 * t);
+
+    for (int i = 0; i < EVAL_NB_CODES; i++)
+      for (int j = 0; j < EVAL_NB_CODES; j++)
+	e->confusion[i][j] += tile_eval.confusion[i][j];
+    e->n += tile_eval.n;
+    e->classify_time += t;
+    e->ntiles++;
+  }
+
+  e->wall_time += get_time() - t0;
+}
+
+
+
+double eval_accuracy(const lidar_eval & e) {
+  if (e.n == 0) return 0;
+  long correct = 0;
+  for (int i = 0; i < EVAL_NB_CODES; i++) correct += e.confusion[i][i];
+  return (double)correct / e.n;
+}
+
+
+double eval_throughput(const lidar_eval & e) {
+  return (e.classify_time > 0) ? e.n / e.classify_time: 0;
+}
+
+
+
+void print_eval(const lidar_eval & e) {
+
+  //the codes that appear in either classification
+  long ref[EVAL_NB_CODES] = {0}, mine[EVAL_NB_CODES] = {0};
+  for (int i = 0; i < EVAL_NB_CODES; i++)
+    for (int j = 0; j < EVAL_NB_CODES; j++) {
+      ref[i] += e.confusion[i][j];
+      mine[j] += e.confusion[i][j];
+    }
+  vector<int> codes;
+  for (int k = 0; k < EVAL_NB_CODES; k++)
+    if (ref[k] > 0 || mine[k] > 0) codes.push_back(k);
+
+  printf("evaluation of mycode against code: %d tiles, %ld points\n", e.ntiles, e.n);
+  printf("confusion matrix (rows: code, columns: mycode):\n");
+  printf("%8s", "");
+  for (size_t j = 0; j < codes.size(); j++) printf("%10d", codes[j]);
+  printf("\n");
+  for (size_t i = 0; i < codes.size(); i++) {
+    printf("%8d", codes[i]);
+    for (size_t j = 0; j < codes.size(); j++) printf("%10ld", e.confusion[codes[i]][codes[j]]);
+    printf("\n");
+  }
+
+  printf("%8s%10s%10s%10s\n", "code", "precision", "recall", "IoU");
+  double sum_iou = 0;
+  int nref = 0;
+  for (size_t k = 0; k < codes.size(); k++) {
+    int c = codes[k];
+    long tp = e.confusion[c][c];
+    double precision = mine[c] ? (double)tp / mine[c]: 0;
+    double recall = ref[c] ? (double)tp / ref[c]: 0;
+    double iou = (ref[c] + mine[c] - tp) ? (double)tp / (ref[c] + mine[c] - tp): 0;
+    printf("%8d%9.1f%%%9.1f%%%9.1f%%\n", c, 100*precision, 100*recall, 100*iou);
+    if (ref[c] > 0) { sum_iou += iou; nref++; }
+  }
+
+  printf("accuracy: %.2f%%, mean IoU over the reference codes: %.2f%%\n",
+	 100 * eval_accuracy(e), nref ? 100 * sum_iou / nref: 0);
+  printf("throughput: classify %.0f points/s (%.1f ms in classify), "
+	 "%.0f points/s including reading (%.1f ms wall)\n",
+	 eval_throughput(e), 1000 * e.classify_time,
+	 e.wall_time > 0 ? e.n / e.wall_time: 0, 1000 * e.wall_time);
+}
@@ -0,0 +1,56 @@
+#ifndef __EVAL_HPP
+#define __EVAL_HPP
+
+#include "lidar.hpp"
+
+
+
+//codes >= EVAL_NB_CODES are counted with EVAL_NB_CODES-1
+const int EVAL_NB_CODES = 32;
+
+
+/* evaluation of the classification (mycode) against the reference
+   classification read from file (code) */
+typedef struct _lidar_eval {
+
+  //confusion[c][m] is the number of points with code c and mycode m
+  long confusion[EVAL_NB_CODES][EVAL_NB_CODES];
+  long n;
+
+  int ntiles;
+
+  //time spent in classify(), summed over all tiles, and wall time of
+  //the whole evaluation, in seconds
+  double classify_time, wall_time;
+
+} lidar_eval;
+
+
+//sets e to an empty evaluation
+void eval_init(lidar_eval* e);
+
+
+/* adds the points of the cloud to the confusion matrix of e; the
+   points are counted in parallel */
+void eval_add(const lidar_point_cloud & points, lidar_eval* e);
+
+
+/* reads, classifies and evaluates the ntiles files fnames[], one
+   tile at a time with every stage in parallel, so that the time of
+   classify() is that of the tile alone; accumulates the results in e */
+void eval_tiles(int ntiles, char** fnames, lidar_eval* e);
+
+
+/* prints the confusion matrix, per-class precision, recall and IoU,
+   overall accuracy and the classification throughput */
+void print_eval(const lidar_eval & e);
+
+
+//the fraction of points with mycode == code
+double eval_accuracy(const lidar_eval & e);
+
+//points classified per second of classify()
+double eval_throughput(const lidar_eval & e);
+
+
+#endif
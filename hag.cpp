@@ -0,0 +1,183 @@
+#include "hag.hpp"
+#include "parallel.hpp"
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <vector>
+using namespace std;
+
+
+//largest number of cells on either side of an automatic grid
+const int MAX_GRID_SIDE = 8192;
+
+
+void grid_init(const lidar_point_cloud & points, double cellsize, lidar_grid* g) {
+
+  assert(g && cellsize > 0);
+
+  g->minx = points.minx;
+  g->miny = points.miny;
+  g->cellsize = cellsize;
+  g->ncols = (int)((points.maxx - points.minx) / cellsize) + 1;
+  g->nrows = (int)((points.maxy - points.miny) / cellsize) + 1;
+  g->v.assign((long)g->nrows * g->ncols, GRID_NODATA);
+}
+
+
+
+/* coarse-to-fine fill: build the grid at half the resolution, fill
+   it recursively, and interpolate the empty cells from it. Every
+   level is processed in independent blocks of rows, in parallel.
+*/
+void grid_fill_nodata(lidar_grid* g) {
+
+  assert(g);
+
+  //count the empty cells
+  long nempty = 0;
+  for (size_t i=0; i < g->v.size(); i++)
+    if (g->v[i] == GRID_NODATA) nempty++;
+  if (nempty == 0 || nempty == (long)g->v.size()) return;
+
+  //the next coarser level: each cell is the mean of the cells with
+  //data among its (up to) 4 children
+  lidar_grid coarse;
+  coarse.minx = g->minx;
+  coarse.miny = g->miny;
+  coarse.cellsize = 2 * g->cellsize;
+  coarse.nrows = (g->nrows + 1) / 2;
+  coarse.ncols = (g->ncols + 1) / 2;
+  coarse.v.assign((long)coarse.nrows * coarse.ncols, GRID_NODATA);
+
+  parallel_for(coarse.nrows, [&](long rbegin, long rend) {
+      for (long r = rbegin; r < rend; r++) {
+	for (int c = 0; c < coarse.ncols; c++) {
+	  double sum = 0;
+	  int k = 0;
+	  for (int i = 2*r; i < 2*r+2 && i < g->nrows; i++) {
+	    for (int j = 2*c; j < 2*c+2 && j < g->ncols; j++) {
+	      float h = grid_get(*g, i, j);
+	      if (h != GRID_NODATA) { sum += h; k++; }
+	    }
+	  }
+	  if (k > 0) coarse.v[r*coarse.ncols + c] = sum / k;
+	}
+      }
+    });
+
+  grid_fill_nodata(&coarse);
+
+  //interpolate the empty cells at their center
+  parallel_for(g->nrows, [&](long rbegin, long rend) {
+      for (long r = rbegin; r < rend; r++) {
+	for (int c = 0; c < g->ncols; c++) {
+	  if (g->v[r*g->ncols + c] != GRID_NODATA) continue;
+	  g->v[r*g->ncols + c] = grid_interpolate(coarse,
+						  g->minx + (c + 0.5) * g->cellsize,
+						  g->miny + (r + 0.5) * g->cellsize);
+	}
+      }
+    });
+}
+
+
+
+float grid_interpolate(const lidar_grid & g, double x, double y) {
+
+  //position relative to the cell centers
+  double fc = (x - g.minx) / g.cellsize - 0.5;
+  double fr = (y - g.miny) / g.cellsize - 0.5;
+  if (fc < 0) fc = 0;
+  if (fr < 0) fr = 0;
+  if (fc > g.ncols - 1) fc = g.ncols - 1;
+  if (fr > g.nrows - 1) fr = g.nrows - 1;
+
+  int c0 = (int)fc, r0 = (int)fr;
+  int c1 = (c0 + 1 < g.ncols) ? c0 + 1: c0;
+  int r1 = (r0 + 1 < g.nrows) ? r0 + 1: r0;
+  double dc = fc - c0, dr = fr - r0;
+
+  double bottom = (1-dc) * grid_get(g, r0, c0) + dc * grid_get(g, r0, c1);
+  double top = (1-dc) * grid_get(g, r1, c0) + dc * grid_get(g, r1, c1);
+  return (1-dr) * bottom + dr * top;
+}
+
+
+
+long build_ground_grid(const lidar_point_cloud & points, double cellsize, lidar_grid* g) {
+
+  assert(g);
+  long n = points.data.size();
+
+  //count the ground points
+  vector<long> chunk_count(nb_threads(), 0);
+  parallel_for_chunks(n, chunk_count.size(), [&](int chunk, long b, long e) {
+      for (long i = b; i < e; i++)
+	if (points.data[i].mycode == 2) chunk_count[chunk]++;
+    });
+  long nground = 0;
+  for (size_t i=0; i < chunk_count.size(); i++) nground += chunk_count[i];
+
+  //choose the cell size so that there are ~4 ground points per cell
+  double dx = points.maxx - points.minx, dy = points.maxy - points.miny;
+  if (cellsize <= 0) {
+    cellsize = (nground > 0) ? 2 * sqrt(dx * dy / nground): 1;
+    if (cellsize * MAX_GRID_SIDE < dx) cellsize = dx / MAX_GRID_SIDE;
+    if (cellsize * MAX_GRID_SIDE < dy) cellsize = dy / MAX_GRID_SIDE;
+    if (cellsize <= 0) cellsize = 1;
+  }
+  grid_init(points, cellsize, g);
+  if (nground == 0) return 0;
+
+  //lowest ground point in each cell. Points from different threads
+  //can fall in the same cell, so the minimum is taken atomically
+  vector< atomic<float> > low(g->v.size());
+  parallel_for(low.size(), [&](long b, long e) {
+      for (long i = b; i < e; i++) low[i].store(GRID_NODATA, memory_order_relaxed);
+    });
+  parallel_for(n, [&](long b, long e) {
+      for (long i = b; i < e; i++) {
+	const lidar_point & p = points.data[i];
+	if (p.mycode != 2) continue;
+	int c = (int)((p.x - g->minx) / g->cellsize);
+	int r = (int)((p.y - g->miny) / g->cellsize);
+	atomic<float> & cell = low[(long)r*g->ncols + c];
+	float old = cell.load(memory_order_relaxed);
+	while ((old == GRID_NODATA || p.z < old) &&
+	       !cell.compare_exchange_weak(old, p.z, memory_order_relaxed))
+	  ;
+      }
+    });
+  parallel_for(low.size(), [&](long b, long e) {
+      for (long i = b; i < e; i++) g->v[i] = low[i].load(memory_order_relaxed);
+    });
+
+  grid_fill_nodata(g);
+  return nground;
+}
+
+
+
+double compute_hag(lidar_point_cloud & points, double cellsize) {
+
+  long n = points.data.size();
+  points.hag.resize(n);
+
+  lidar_grid ground;
+  long nground = build_ground_grid(points, cellsize, &ground);
+  printf("compute_hag: %ld ground points, grid %d x %d, cellsize=%.2f\n",
+	 nground, ground.nrows, ground.ncols, ground.cellsize);
+
+  float minz = points.minz;
+  parallel_for(n, [&](long b, long e) {
+      for (long i = b; i < e; i++) {
+	const lidar_point & p = points.data[i];
+	float h = (nground > 0) ? p.z - grid_interpolate(ground, p.x, p.y): p.z - minz;
+	points.hag[i] = h;
+      }
+    });
+  return ground.cellsize;
+}
@@ -0,0 +1,68 @@
+#ifndef __HAG_HPP
+#define __HAG_HPP
+
+#include "lidar.hpp"
+
+#include <vector>
+using namespace std;
+
+
+
+//value of the grid cells that have no data
+const float GRID_NODATA = -9999;
+
+
+/* a regular grid over the xy extent of a point cloud. Cell (r,c)
+   covers x=[minx + c*cellsize, minx + (c+1)*cellsize) and y=[miny +
+   r*cellsize, miny + (r+1)*cellsize). Values are stored row by row.
+*/
+typedef struct _lidar_grid {
+
+  int nrows, ncols;
+  double minx, miny;
+  double cellsize;
+
+  vector<float> v;
+
+} lidar_grid;
+
+
+//returns the value of cell (r,c)
+static inline float grid_get(const lidar_grid & g, int r, int c) {
+  return g.v[(long)r*g.ncols + c];
+}
+
+
+/* sets up g to cover the xy bounding box of points with cells of the
+   given size; all cells are GRID_NODATA */
+void grid_init(const lidar_point_cloud & points, double cellsize, lidar_grid* g);
+
+
+/* fills the GRID_NODATA cells of g from the cells that have data,
+   using a coarse-to-fine pyramid: every empty cell is interpolated
+   from the next coarser level, which is filled recursively. Does
+   nothing if g has no data at all. */
+void grid_fill_nodata(lidar_grid* g);
+
+
+/* bilinear interpolation of g at (x,y), between cell centers. Points
+   outside the grid get the value of the nearest border cell. */
+float grid_interpolate(const lidar_grid & g, double x, double y);
+
+
+/* builds a grid with the lowest z of the ground points (mycode == 2)
+   in each cell, and fills the cells without ground points. If
+   cellsize <= 0, it is chosen based on the density of the ground
+   points. Returns the number of ground points. */
+long build_ground_grid(const lidar_point_cloud & points, double cellsize, lidar_grid* g);
+
+
+/* computes points.hag, the height above ground of every point,
+   interpolated from the ground points (mycode == 2). If there are no
+   ground points, the height is measured from the lowest point. The
+   ground grid has cells of side cellsize, chosen as in
+   build_ground_grid() if cellsize <= 0; returns the cell size used. */
+double compute_hag(lidar_point_cloud & points, double cellsize = 0);
+
+
+#endif
@@ -0,0 +1,127 @@
+#include "jobs.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+using namespace std;
+
+
+
+//a job or a task waiting to run
+typedef struct _queued_job {
+  function<void(long)> f;
+  long generation;
+  //jobs are dropped by the next job posted, tasks never are
+  int is_task;
+} queued_job;
+
+
+//the state shared by post_job(), post_task() and the worker
+typedef struct _job_state {
+
+  //the generation of the last job posted
+  atomic<long> latest;
+
+  //the jobs and tasks waiting to run, in the order they were posted,
+  //and whether the worker is busy
+  deque<queued_job> pending;
+  int running;
+
+  mutex m;
+  condition_variable job_posted, job_done;
+
+} job_state;
+
+
+/* the worker thread is detached and can be blocked on job_posted
+   when the program exits, so the state is never destroyed (glibc
+   waits for the waiters when destroying a condition variable) */
+static job_state & state() {
+  static job_state* js = NULL;
+  static once_flag created;
+  call_once(created, [] {
+      js = new job_state;
+      js->latest = 0;
+      js->running = 0;
+    });
+  return *js;
+}
+
+
+//runs the jobs and tasks, in order, forever
+static void worker_loop() {
+
+  job_state & js = state();
+  unique_lock<mutex> lock(js.m);
+  while (1) {
+    js.job_posted.wait(lock, [&] { return !js.pending.empty(); });
+    queued_job j = js.pending.front();
+    js.pending.pop_front();
+    js.running = 1;
+
+    lock.unlock();
+    j.f(j.generation);
+    lock.lock();
+
+    js.running = 0;
+    js.job_done.notify_all();
+  }
+}
+
+
+//adds j to the queue; called with the lock held
+static void enqueue(job_state & js, const queued_job & j) {
+  static int started = 0;
+  if (!started) {
+    thread(worker_loop).detach();
+    started = 1;
+  }
+  js.pending.push_back(j);
+  js.job_posted.notify_one();
+}
+
+
+
+long post_job(function<void(long)> f) {
+
+  job_state & js = state();
+  lock_guard<mutex> lock(js.m);
+  //the jobs that are still pending are dropped, i.e. cancelled
+  deque<queued_job> kept;
+  for (size_t i = 0; i < js.pending.size(); i++)
+    if (js.pending[i].is_task) kept.push_back(js.pending[i]);
+  js.pending.swap(kept);
+
+  queued_job j;
+  j.f = f;
+  j.generation = ++js.latest;
+  j.is_task = 0;
+  enqueue(js, j);
+  return j.generation;
+}
+
+
+void post_task(function<void()> f) {
+
+  job_state & js = state();
+  lock_guard<mutex> lock(js.m);
+  queued_job j;
+  j.f = [f](long) { f(); };
+  j.generation = 0;
+  j.is_task = 1;
+  enqueue(js, j);
+}
+
+
+int job_cancelled(long generation) {
+  return state().latest.load() != generation;
+}
+
+
+void wait_jobs() {
+  job_state & js = state();
+  unique_lock<mutex> lock(js.m);
+  js.job_done.wait(lock, [&] { return js.pending.empty() && !js.running; });
+}
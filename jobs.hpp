@@ -0,0 +1,41 @@
+#ifndef __JOBS_HPP
+#define __JOBS_HPP
+
+#include <functional>
+using namespace std;
+
+
+
+/* A background worker that runs recomputation jobs off the GLUT
+   thread, so that the window stays responsive while they run.
+
+   Every job gets a generation number, and posting a job supersedes
+   all the jobs posted before it: a job that has not started yet is
+   dropped, and a running job is expected to check job_cancelled()
+   now and then and return early when it is. Jobs run one at a time;
+   they can use the parallel_* helpers to run on all cores.
+*/
+
+
+/* posts job f, which will be called as f(generation) on the worker
+   thread. Returns the generation of the job. */
+long post_job(function<void(long)> f);
+
+
+/* posts task f, which will run on the worker after the jobs and tasks
+   posted before it. Unlike a job, a task is never dropped and doesn't
+   cancel the jobs: it is for work that must be done once, e.g.
+   building the ground mesh or writing a file. */
+void post_task(function<void()> f);
+
+
+//returns 1 if a job newer than generation has been posted
+int job_cancelled(long generation);
+
+
+//waits until the worker has finished all the jobs and tasks posted
+//so far
+void wait_jobs();
+
+
+#endif
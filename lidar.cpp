@@ -1,6 +1,11 @@
 
 #include "lidar.hpp"
+#include "hag.hpp"
+#include "parallel.hpp"
 #include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
 
 #include <vector>
 using namespace std; 
@@ -9,7 +14,7 @@ using namespace std;
 
 
 //adds point p  to  lp 
-void lidar_add_point(lidar_point_cloud* lp, lidar_point p) {
+void lidar_add_point(lidar_point_cloud* lp, const lidar_point & p) {
 
   //make sure its a valid pointer 
   assert(lp);
@@ -18,7 +23,7 @@ void lidar_add_point(lidar_point_cloud* lp, lidar_point p) {
   lp->data.push_back(p);
   
   //update bounding box
-  if (size(*lp) == 1) {
+  if (lp->data.size() == 1) {
     lp->minx = lp->maxx = p.x; 
     lp->miny = lp->maxy = p.y; 
     lp->minz =lp-> maxz = p.z; 
@@ -34,73 +39,139 @@ void lidar_add_point(lidar_point_cloud* lp, lidar_point p) {
 
 
 
-/*
-  reads lidar points from file and  populates points
-  
-  NOTE: file.txt must be obtained from file.las with 'pdal translate'
-  reads the points from file in global array points
-*/
-void read_lidar_from_file(char* fname, lidar_point_cloud* points) {
+void copy_cloud(const lidar_point_cloud & from, lidar_point_cloud* to) {
 
-  
-  FILE* file = fopen(fname, "r"); 
-  if (!file) {
-    printf("read_lidar:from_file: cannot open file %s\n",  fname);
-    exit(1); 
+  assert(to); 
+  to->data.assign(from.data); 
+  to->hag = from.hag; 
+  to->intensity = from.intensity; 
+  to->gps_time = from.gps_time; 
+  to->point_source_id = from.point_source_id; 
+  to->minx = from.minx; to->maxx = from.maxx; 
+  to->miny = from.miny; to->maxy = from.maxy; 
+  to->minz = from.minz; to->maxz = from.maxz; 
+  to->chunks = from.chunks; 
+}
+
+
+
+//a small deterministic random generator for the synthetic cloud,
+//returns a value in [0,1)
+static double synthetic_random(unsigned long long* state) {
+  *state = *state * 6364136223846793005ULL + 1442695040888963407ULL; 
+  return (*state >> 11) * (1.0 / 9007199254740992.0); 
+}
+
+
+
+//a bounding box, for parallel_reduce 
+typedef struct _bbox {
+  float minx, maxx, miny, maxy, minz, maxz; 
+} bbox; 
+
+void compute_bbox(lidar_point_cloud & points) {
+
+  long n = points.data.size(); 
+  if (n == 0) {
+    points.minx = points.maxx = points.miny = points.maxy = points.minz = points.maxz = 0; 
+    return; 
   }
+  const lidar_point & p0 = points.data[0]; 
+  bbox first = {p0.x, p0.x, p0.y, p0.y, p0.z, p0.z}; 
+  bbox box = parallel_reduce(n, first, [&](long b, long e, bbox & bb) {
+      for (long i = b; i < e; i++) {
+	const lidar_point & p = points.data[i]; 
+	if (bb.minx > p.x) bb.minx = p.x; 
+	if (bb.maxx < p.x) bb.maxx = p.x; 
+	if (bb.miny > p.y) bb.miny = p.y; 
+	if (bb.maxy < p.y) bb.maxy = p.y; 
+	if (bb.minz > p.z) bb.minz = p.z; 
+	if (bb.maxz < p.z) bb.maxz = p.z; 
+      }
+    }, [](bbox a, const bbox & b) {
+      if (a.minx > b.minx) a.minx = b.minx; 
+      if (a.maxx < b.maxx) a.maxx = b.maxx; 
+      if (a.miny > b.miny) a.miny = b.miny; 
+      if (a.maxy < b.maxy) a.maxy = b.maxy; 
+      if (a.minz > b.minz) a.minz = b.minz; 
+      if (a.maxz < b.maxz) a.maxz = b.maxz; 
+      return a; 
+    }); 
+  points.minx = box.minx; points.maxx = box.maxx; 
+  points.miny = box.miny; points.maxy = box.maxy; 
+  points.minz = box.minz; points.maxz = box.maxz; 
+}
 
-  //read first line
-  //"X","Y","Z","Intensity","ReturnNumber","NumberOfReturns",
-  //"ScanDirectionFlag","EdgeOfFlightLine","Classification","ScanAngleRank",
-  //"UserData","PointSourceId","GpsTime"
-  char line[1000];
-  if (fgets(line,sizeof line,file)!= NULL) /* read a line from a file */ {
-    printf("%s",line); //print the file contents on stdout.
-  } else {
-    printf("read_lidar_fom_file: cannot read from file\n");
-    exit(1); 
-  } 
-  
-  lidar_point p;
-  float retnb, nbret, classif; //dir, edge, angle, user, pid, gps;
-  while (1) {
-    /*
-      if (fscanf(file, "%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f",
-	       &p.x, &p.y, &p.z,
-	       &p.intensity, &retnb, &nbret,
-	       &dir, &edge, &classif,
-	       &angle, &user, &pid,
-	       &gps
-	       ) < 13)
-    */
-    if (fscanf(file, "%f,%f,%f,%f,%f,%f", &p.x, &p.y, &p.z,&retnb, &nbret, &classif) < 6)    { 
-      //either an error or all done 
-      break; 
+//returns a value in [0,1) that depends only on cell (i,j)
+static double synthetic_hash(long i, long j) {
+  unsigned long long state = (unsigned long long)(i * 73856093) ^ (unsigned long long)(j * 19349663); 
+  synthetic_random(&state); 
+  return synthetic_random(&state); 
+}
+
+//the synthetic terrain 
+static float synthetic_ground(double x, double y) {
+  return 100 + 10 * sin(x / 50) * cos(y / 70) + 0.02 * x; 
+}
+
+
+void generate_synthetic_cloud(long n, lidar_point_cloud* lp) {
+
+  assert(lp); 
+  //10 points per square unit 
+  double side = sqrt(n / 10.0); 
+  unsigned long long state = 1; 
+  lp->data.reserve(n); 
+
+  lidar_point p; 
+  p.mycode = 0; 
+  while ((long)lp->data.size() < n) {
+    double x = side * synthetic_random(&state); 
+    double y = side * synthetic_random(&state); 
+    float ground = synthetic_ground(x, y); 
+    p.x = x; 
+    p.y = y; 
+
+    //a building in the middle of some of the 60x60 blocks 
+    double bx = fmod(x, 60), by = fmod(y, 60); 
+    if (synthetic_hash((long)(x/60), (long)(y/60)) < 0.3 && bx > 20 && bx < 40 && by > 20 && by < 40) {
+      p.z = synthetic_ground(x - bx + 30, y - by + 30) + 8; 
+      p.return_number = p.nb_of_returns = 1; 
+      p.code = 6; 
+      lidar_add_point(lp, p); 
+      continue; 
     }
-    //we got another point
-    p.return_number = (int) retnb;
-    p.nb_of_returns = (int)nbret;
-    p.code=(int)classif;
-    p.mycode=0; //everything unclassified
-    
-    //printf("point: x=%f, y=%f, z=%f, intensity=%f return_nb=%d nb_returns=%d classif=%d\n",
-    //  p.x, p.y, p.z, p.intensity, p.return_number, p.nb_of_returns, p.code); 
-	
-    //insert the point 
-    lidar_add_point(points, p); 
-    
-  } //while 
-
-  //done reading points 
-  fclose(file); 
-  
-  //print info about the points that were read 
-  printf("read total %d points\n", (int)size(*points)); 
-  printf("\tbounding box:  x=[%.2f, %.2f], y=[%.2f,%.2f], z=[%.2f,%f.2]\n",
-	 points->minx, points->maxx, points->miny, points->maxy, points->minz, points->maxz); 
 
-  
-  return; 
+    //trees in some of the 10x10 cells: the pulse has a few returns
+    //in the canopy and the last one on the ground 
+    if (synthetic_hash((long)(x/10) + 1000000, (long)(y/10)) < 0.35) {
+      int nret = 2 + (int)(3 * synthetic_random(&state)); 
+      float top = 5 + 15 * synthetic_hash((long)(x/10), (long)(y/10) + 1000000); 
+      for (int r = 1; r <= nret && (long)lp->data.size() < n; r++) {
+	p.return_number = r; 
+	p.nb_of_returns = nret; 
+	if (r < nret) {
+	  p.z = ground + top * (1 - 0.8 * synthetic_random(&state)); 
+	  p.code = 5; 
+	} else {
+	  p.z = ground; 
+	  p.code = 2; 
+	}
+	lidar_add_point(lp, p); 
+      }
+      continue; 
+    }
+
+    //bare ground 
+    p.z = ground; 
+    p.return_number = p.nb_of_returns = 1; 
+    p.code = 2; 
+    lidar_add_point(lp, p); 
+  }
+
+  printf("generated %ld synthetic points\n", (long)lp->data.size()); 
+  printf("\tbounding box:  x=[%.2f, %.2f], y=[%.2f,%.2f], z=[%.2f,%.2f]\n",
+	 lp->minx, lp->maxx, lp->miny, lp->maxy, lp->minz, lp->maxz); 
 }
 
 
@@ -130,28 +201,60 @@ lidar classification codes
 19-255 reserved for asprs definition
 */
 
+void classify_params_init(classify_params* cp) {
+  cp->low_veg_max_hag = LOW_VEG_MAX_HAG; 
+  cp->medium_veg_max_hag = MEDIUM_VEG_MAX_HAG; 
+  cp->ground_cellsize = 0; 
+}
+
+
+
 /* for every point p, it sets p.mycode to one of the codes above */
-void classify(lidar_point_cloud & points) {
+double classify(lidar_point_cloud & points, const classify_params & cp) {
 
   //float minheight, max_height; 
-  for (int i=0; i< size(points); i++) {
+  parallel_for(points.data.size(), [&](long b, long e) {
+      for (long i = b; i < e; i++) {
 
-    lidar_point p = points.data[i];
+	lidar_point & p = points.data[i];
 
-    //vegetation: points with > 1 return, and not last return  
-    if ((p.nb_of_returns>1) && (p.return_number != p.nb_of_returns)) {
-      points.data[i].mycode = 4; 
-    }
+	//under the vegetation is ground
+	if((p.nb_of_returns > 1) && (p.return_number == p.nb_of_returns)) {
+	  p.mycode = 2; 
+	}
+      }
+    }); 
 
-    //under the vegetation is ground
-    if((p.nb_of_returns > 1) && (p.return_number == p.nb_of_returns)) {
-      points.data[i].mycode = 2; 
-    }
-    
-  } 
-  
+  //height above the ground points found above 
+  double cellsize = compute_hag(points, cp.ground_cellsize); 
+
+  classify_vegetation(points, cp); 
+  return cellsize; 
 } 
 
 
+double classify(lidar_point_cloud & points) {
+  classify_params cp; 
+  classify_params_init(&cp); 
+  return classify(points, cp); 
+}
+
+
+void classify_vegetation(lidar_point_cloud & points, const classify_params & cp) {
+
+  parallel_for(points.data.size(), [&](long b, long e) {
+      for (long i = b; i < e; i++) {
+
+	lidar_point & p = points.data[i];
+
+	//vegetation: points with > 1 return, and not last return; low,
+	//medium or high based on their height above ground
+	if (is_vegetation_return(p)) 
+	  p.mycode = vegetation_code(cp, points.hag[i]); 
+      }
+    }); 
+  
+} 
+
 
 
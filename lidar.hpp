@@ -1,6 +1,8 @@
 #ifndef __CLASSIFY_HPP
 #define  __CLASSIFY_HPP
 
+#include "arena.hpp"
+
 #include <vector>
 using namespace std; 
 
@@ -9,7 +11,6 @@ using namespace std;
 
 typedef struct _lidar_point {
   float x,y,z; 
-  float intensity;
 
   int return_number; //the number of this return
   int nb_of_returns; //how many returns this pulse has
@@ -19,37 +20,69 @@ typedef struct _lidar_point {
   int mycode; //classification code that we'll assign to this point
 
   //there's more info available for a point (such as
-  //scanDirectionF;ag, EdgeOfFlightLine, etc) but we don't store it
+  //scanDirectionF;ag, EdgeOfFlightLine, etc) but we don't store it;
+  //intensity, gps time and point source id can be read into the side
+  //columns of the cloud (see reader.hpp)
 
 } lidar_point;
 
 
+/* a range of consecutive points [begin, end) and their bounding
+   box. After the points are sorted spatially (see reorder.hpp) the
+   boxes are tight, and can be used to skip whole ranges of points */
+typedef struct _lidar_chunk {
+  long begin, end; 
+  float  minx, maxx, miny, maxy, minz, maxz; 
+} lidar_chunk; 
+
+
 typedef struct _lidar_data {
 
-  vector<lidar_point> data; 
+  //in huge pages, and never copied implicitly (see arena.hpp) 
+  point_buffer<lidar_point> data; 
+
+  //height above ground of each point, in the same order as data;
+  //empty until compute_hag() is called
+  vector<float> hag; 
+
+  //optional attributes of each point, in the same order as data;
+  //empty unless requested when reading the file
+  vector<float> intensity; 
+  vector<double> gps_time; 
+  vector<int> point_source_id; 
 
   //bounding box
   float  minx, maxx, miny, maxy, minz, maxz; 
+
+  //the points split in consecutive chunks; empty until
+  //compute_chunks() is called
+  vector<lidar_chunk> chunks; 
   
 } lidar_point_cloud; 
 
 
 
-/*
-  reads lidar points from file and  populates points
-  
-  NOTE: file.txt must be obtained from file.las with 'pdal translate'
-  reads the points from file in global array points
+/* generates a synthetic cloud of n points over a square terrain:
+   ground with single returns, trees with multiple returns and flat
+   roofs of buildings, with their codes set. The cloud depends only on
+   n, so it can be used to compare runs.
 */
-void read_lidar_from_file(char* fname, lidar_point_cloud* lp); 
+void generate_synthetic_cloud(long n, lidar_point_cloud* lp); 
 
 
 //adds point p  to  points
-void lidar_add_point(lidar_point_cloud* lp, lidar_point p); 
+void lidar_add_point(lidar_point_cloud* lp, const lidar_point & p); 
+
+/* makes to a copy of from, points, columns, bounding box and chunks;
+   clouds are only copied this way */
+void copy_cloud(const lidar_point_cloud & from, lidar_point_cloud* to); 
+
+//sets the bounding box of points to that of its points, in parallel
+void compute_bbox(lidar_point_cloud & points); 
 
 
 //returns size (= nb points) 
-static inline int size(lidar_point_cloud points) {
+static inline long size(const lidar_point_cloud & points) {
   return points.data.size();
 }
 
@@ -80,8 +113,52 @@ lidar classification codes
 19-255 reserved for asprs definition
 */
 
-/* for every point p, it sets p.mycode to one of the codes above */
-void classify(lidar_point_cloud & points);
+/* vegetation (points with >1 returns which are not the last return)
+   is classified as low/medium/high by its height above ground; these
+   are the default heights */
+const float LOW_VEG_MAX_HAG = 2.0;
+const float MEDIUM_VEG_MAX_HAG = 5.0;
+
+
+//the parameters of classify(), which can be changed while viewing 
+typedef struct _classify_params {
+  //the highest low and medium vegetation 
+  float low_veg_max_hag, medium_veg_max_hag; 
+
+  //the cell size of the ground grid the height above ground is
+  //interpolated from; 0 chooses it from the density of the ground
+  double ground_cellsize; 
+} classify_params; 
+
+//sets cp to the defaults above, with the cell size chosen automatically 
+void classify_params_init(classify_params* cp); 
+
+
+//returns 1 if p is a vegetation return: not the last of many 
+static inline int is_vegetation_return(const lidar_point & p) {
+  return (p.nb_of_returns > 1) && (p.return_number != p.nb_of_returns); 
+}
+
+//returns the mycode of a vegetation return at height above ground hag
+static inline int vegetation_code(const classify_params & cp, float hag) {
+  if (hag < cp.low_veg_max_hag) return 3; 
+  if (hag < cp.medium_veg_max_hag) return 4; 
+  return 5; 
+}
+
+
+/* for every point p, it sets p.mycode to one of the codes above, and
+   computes the height above ground points.hag. Returns the cell size
+   of the ground grid used. */
+double classify(lidar_point_cloud & points, const classify_params & cp);
+
+//classify() with the default parameters 
+double classify(lidar_point_cloud & points);
+
+/* sets the mycode of the vegetation points to low/medium/high
+   vegetation based on points.hag; called by classify(), and again
+   when the height above ground changes */
+void classify_vegetation(lidar_point_cloud & points, const classify_params & cp);
 
 
 #endif 
@@ -18,23 +18,63 @@
    l/r/u/d/f/bx/X,y/Y,z/Z: translate and rotate
    w: toggle wire/filled polygons
    v,g,h,o: toggle veg, ground, buildings,other on/off
-   c: cycle through colormaps (one color, based on code, based on your code)
+   c: cycle through colormaps (one color, based on code, based on your
+   code, based on height above ground, by cluster, by change, by
+   tree)
    t: cycle through filter  options: first-return, last return, many-returns, all-returns
+   m: toggle the ground mesh (TIN) on/off
+   [/]: with the change colormap, lower/raise the threshold under
+   which points are hidden
+   D: cycle the density view: automatic, always, never
+   k/K, j/J: lower/raise the highest low and medium vegetation
+   n/N: smaller/larger cells of the ground grid
+   L: reload the classification parameters from the --config file
+   e/E: write the points drawn, with mycode as classification, to
+   export.las/export.txt
+
+   mouse: 
+
+   left click: pick the point under the mouse and print it; every
+   click also prints the distance to the previous pick
 
    OpenGL 1.x
    Laura Toma
 */
 
 #include "lidar.hpp"
+#include "reader.hpp"
+#include "voxel.hpp"
+#include "cluster.hpp"
+#include "canopy.hpp"
+#include "reclassify.hpp"
+#include "compare.hpp"
+#include "density.hpp"
+#include "tin.hpp"
+#include "stats.hpp"
+#include "eval.hpp"
+#include "jobs.hpp"
+#include "replay.hpp"
+#include "reorder.hpp"
+#include "bench.hpp"
+#include "writer.hpp"
+#include "parallel.hpp"
+#include "timer.hpp"
 
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
+#include <string.h>
 #include <assert.h>
+#include <ctype.h>
+#include <limits.h>
 
 #include <GLUT/glut.h>
 
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
 #include <vector>
 using namespace std; 
 
@@ -62,6 +102,71 @@ GLint fillmode = 0;
 
 
 
+/* ************************************************************ */
+/* DENSITY VIEW 
+
+   Zoomed out, many points fall in every pixel and drawing them all
+   is wasted work. Instead, the render jobs bin the points drawn in a
+   2D grid (see density.hpp), and display() draws the grid as one
+   textured quad at the bottom of the bounding box when there are
+   more than DENSITY_POINTS_PER_PIXEL points per pixel; zooming in
+   switches back to the points. The cells are colored by the dominant
+   class with the colormaps by code, by the highest point above
+   ground with the colormap by height, and by the number of points
+   (log scale, blue to red) otherwise; brighter cells have more
+   points.
+
+   Key 'D' cycles between switching automatically, always drawing the
+   grid, and never drawing it. Replays don't switch automatically: the
+   grid would depend on the window size, and they draw the points
+   unless the path sets the grid with 'D'.
+*/
+const int DENSITY_AUTO = 0; 
+const int DENSITY_ALWAYS = 1; 
+const int DENSITY_NEVER = 2; 
+int density_mode = DENSITY_AUTO; 
+
+const double DENSITY_POINTS_PER_PIXEL = 4; 
+
+//whether the last frame drew the grid 
+int drawing_density = 0; 
+
+//the texture of the grid, and the colors last loaded into it 
+GLuint density_texture = 0; 
+shared_ptr< vector<GLubyte> > density_loaded; 
+
+
+
+/* ************************************************************ */
+/* GROUND MESH 
+
+   Key 'm' draws the Delaunay triangulation (TIN) of the ground
+   points, built the first time it is needed, in wire or filled mode
+   (key 'w'). The mesh is built by a task on the worker thread (see
+   jobs.hpp), so the window stays responsive, and is drawn once
+   tin_built is set. The vertices are stored centered at the origin
+   and at unit scale, so zooming and vertical exaggeration are done by
+   the modelview transformation and the arrays never need to be
+   rebuilt.
+*/
+lidar_tin ltin; 
+atomic<int> tin_built(0); 
+int DRAW_TIN = 0; 
+
+//set when the task that builds the mesh is posted, and when the mesh
+//built has been drawn (GLUT thread only)
+int tin_posted = 0, tin_drawn = 0; 
+
+//--tin-code: triangulate the points with code 2, not mycode 2 
+int tin_code = 0; 
+//--tin-tolerance: simplify the ground first (see tin.hpp) 
+double tin_tolerance = 0; 
+
+//the vertex arrays of the mesh 
+vector<GLfloat> tin_xyz, tin_rgb; 
+
+
+
 /* ************************************************************ */
 /* FILTERING POINTS BY THEIR RETURN */
 /* A LiDAR point has a return number and a number of returns (for its
@@ -108,19 +213,144 @@ int RENDER_OTHER = 1;
    If COLORMAP == MYCODE_COLOR: draw points with a color based on
    p.mycode (computed by us)
 
+   If COLORMAP == HAG_COLOR: draw points with a color based on their
+   height above ground (computed by classify), from blue (ground) to
+   red (highest point)
+
+   If COLORMAP == CLUSTER_COLOR: draw every cluster (see cluster.hpp)
+   with its own color, and the points in no cluster in dark gray
+
+   If COLORMAP == CHANGE_COLOR (only with --compare): draw the points
+   by their distance to the reference cloud, from blue (below) through
+   white to red (above); the points with no reference near them in
+   magenta. Only the points that moved more than change_threshold are
+   drawn.
+
+   If COLORMAP == TREE_COLOR (only with --trees): draw every tree (see
+   canopy.hpp) with its own color, and the points in no crown in dark
+   gray
+
    COLORMAP starts by default as ONE_COLOR and cycles through all
    options via keypress 'c'.
 */
 const int ONE_COLOR = 0;   
 const int CODE_COLOR = 1; 
 const int MYCODE_COLOR =2;
-const int NB_COLORMAP_CHOICES =3;
+const int HAG_COLOR = 3; 
+const int CLUSTER_COLOR = 4; 
+const int CHANGE_COLOR = 5; 
+const int TREE_COLOR = 6; 
+const int NB_COLORMAP_CHOICES =7;
 
 //COLORMAP cycles through all choices  via keypress 'c'
 int COLORMAP = ONE_COLOR; 
 
 
 
+/* ************************************************************ */
+/* RENDER BUFFERS 
+
+   The points are drawn from vertex arrays: xyz and rgb hold the
+   screen coordinates and the color of every point, and index holds
+   the points that pass the filters. They depend on the options set
+   through keypresses, which are captured in a render_params.
+
+   Rebuilding the arrays of a large cloud is slow, so keypress()
+   doesn't do it. It posts a job (see jobs.hpp) that builds a new
+   render_buffer on a background thread, reusing the arrays that are
+   not affected by the options that changed. When the job is done its
+   buffer becomes ready_buffer, and display() swaps it in as
+   front_buffer. A job superseded by a newer keypress stops early and
+   its work is thrown away.
+*/
+typedef struct _render_params {
+  int which_return; 
+  int render_ground, render_veg, render_building, render_other; 
+  int colormap; 
+  double change_threshold; 
+  double scale, z_exagerration; 
+
+  //the classification parameters, and their version (see
+  //RECLASSIFICATION) 
+  classify_params classify; 
+  long classification; 
+} render_params; 
+
+typedef struct _render_buffer {
+  render_params params; 
+  shared_ptr< vector<GLfloat> > xyz, rgb; 
+  shared_ptr< vector<GLuint> > index; 
+
+  //index is sorted by drawing bin (see PROGRESSIVE DRAWING): the
+  //points of bin b are index[bin_start[b]..bin_start[b+1])
+  shared_ptr< vector<long> > bin_start; 
+
+  //the points of index binned in a grid, and the RGBA colors of its
+  //cells (see DENSITY VIEW)
+  shared_ptr<density_grid> density; 
+  shared_ptr< vector<GLubyte> > density_rgba; 
+} render_buffer; 
+
+//the buffer drawn by display()
+render_buffer front_buffer; 
+
+//the last buffer built by a job, if buffer_ready 
+render_buffer ready_buffer; 
+int buffer_ready = 0; 
+
+//protects ready_buffer, buffer_ready and the swap into front_buffer
+mutex buffer_mutex; 
+
+//the options of the last job posted 
+render_params posted_params; 
+int posted = 0; 
+
+//how often the GLUT thread checks for a ready buffer, in ms
+const int BUFFER_POLL_MS = 10; 
+
+
+
+/* ************************************************************ */
+/* PROGRESSIVE DRAWING 
+
+   Drawing all the points of a large cloud takes longer than a frame
+   should, and the window doesn't answer the keys meanwhile. Instead,
+   display() draws in the back buffer only as many points as it can
+   in frame_budget_ms, at the rate measured on the previous frames,
+   and swaps; while idle, refine_step() copies the frame shown back
+   into the back buffer, draws the next slice of points over it and
+   swaps again, until all are drawn. A new frame (any key, or a new
+   render buffer) starts over.
+
+   The order makes every slice useful: the index of the render buffer
+   is sorted in DRAW_LEVELS levels, point i going to the level of the
+   bits of i mod DRAW_LEVELS reversed, so that the first level holds
+   every DRAW_LEVELS-th point, the second the points halfway between
+   them, and so on: the first levels are a coarse uniform sample of
+   the cloud. Every level is split in DRAW_TILES x DRAW_TILES tiles
+   over xy, drawn nearest to the camera first.
+*/
+const int DRAW_LEVELS = 64; 
+const int DRAW_TILES = 8; 
+const int NB_DRAW_BINS = DRAW_LEVELS * DRAW_TILES * DRAW_TILES; 
+
+//the time budget of a frame, set with --frame-budget; 0 draws all
+//the points in every frame 
+double frame_budget_ms = 30; 
+
+//the points drawn per ms, measured; before the first measure, a
+//frame draws DRAW_FIRST_POINTS
+double draw_rate = 0; 
+const long DRAW_FIRST_POINTS = 100000; 
+
+//the bins of the front buffer in the order they are drawn for the
+//current view, and the next one to draw; the frame is complete when
+//draw_next is NB_DRAW_BINS 
+int draw_order[NB_DRAW_BINS]; 
+int draw_next = NB_DRAW_BINS; 
+
+
+
 //predefine some colors for convenience
 GLfloat red[3] = {1.0, 0.0, 0.0};
 GLfloat green[3] = {0.0, 1.0, 0.0};
@@ -151,25 +381,177 @@ double minx, maxx, miny, maxy, minz, maxz;
 //smallest.
 double scale = 1; 
 
+//largest height above ground, used by HAG_COLOR 
+double max_hag = 1; 
+
+//the clusters of the points, computed after classify 
+lidar_clusters lclusters; 
+
+//the classes clustered (bit c for mycode c), the side of the voxels
+//and the smallest cluster kept. Set with --cluster-codes and
+//--cluster-radius 
+unsigned int cluster_codes = (1 << 3) | (1 << 4) | (1 << 5); 
+double cluster_radius = 1; 
+const long CLUSTER_MIN_SIZE = 10; 
+
+//with --compare ref.txt: the signed distance of every point to the
+//reference cloud (see compare.hpp), the largest distance searched,
+//which is also the distance drawn in full red or blue, and the
+//radius of M3C2 (0 for cloud-to-cloud distances). Set with
+//--compare-max and --m3c2 
+vector<float> lchange; 
+double compare_max_dist = 2; 
+double m3c2_radius = 0; 
+
+//with --trees file.csv: the trees found in the vegetation, and the
+//cell size of their canopy height model, set with --tree-cell 
+lidar_trees ltrees; 
+double tree_cellsize = CANOPY_CELLSIZE; 
+
+//the points that moved less than this are hidden with CHANGE_COLOR;
+//changed with keys [ and ] 
+double change_threshold = 0.1; 
+
+/* ************************************************************ */
+/* RECLASSIFICATION 
+
+   The classification parameters can be changed while viewing, with
+   keys or by reloading the --config file. A key only records the new
+   parameters, in lparams, and bumps classification; the render job
+   posted next brings mycode and hag up to them with reclassify(),
+   which redoes only the tiles the change affects, and then rebuilds
+   the arrays that depend on the classification. The points are only
+   reclassified on the worker thread, so no render buffer is built
+   from points being reclassified; the GLUT thread calls
+   wait_classification() before it reads mycode or hag. The clusters
+   and the trees keep the classification they were computed from.
+*/
+classify_params lparams; 
+long classification = 0; 
+
+//the cache of the classification, only used by the jobs, and the
+//version of the parameters that mycode and hag are up to date with,
+//set by the jobs 
+classify_cache lcache; 
+atomic<long> classified(0); 
+
+//set with --config, reloaded with key L 
+const char* config_fname = NULL; 
+
+//the cell size of the ground grid of the first classification, and
+//the smallest one keys n/N go to, relative to it 
+double start_ground_cellsize = 1; 
+const double MIN_GROUND_CELL_FACTOR = 0.25; 
+
+//the steps of the keys k/K, j/J and n/N 
+const float VEG_HAG_STEP = 0.25; 
+const double GROUND_CELL_STEP = 1.25; 
+
+//with --hag-tin the height above ground is from the ground mesh, and
+//the ground cell size is not used 
+int hag_tin = 0; 
+
+//with --max-mem: the memory that is not per point (the read buffers,
+//the grids, GL and the libraries), see points_in_budget() 
+const double MEM_FIXED = 160 << 20; 
+
+//the files written by keys e and E 
+const char* EXPORT_LAS = "export.las"; 
+const char* EXPORT_TXT = "export.txt"; 
+
 //the heights can be vertically exagerated. Controlled by keypress >, <
 double  Z_EXAGERRATION  = 1; 
 
 
 
 
+
+
+/* ************************************************************ */
+/* PICKING POINTS WITH THE MOUSE
+
+   A left click casts a ray from the camera through the pixel under
+   the mouse, and picks the first rendered point along the ray that is
+   within PICK_TOLERANCE pixels of it. The ray is intersected with
+   pick_index, a voxel index of the points built on the first click,
+   so a pick only looks at the points near the ray.
+*/
+voxel_index pick_index; 
+int pick_index_built = 0; 
+
+//the last two points picked, most recent first; -1 if none 
+long picked[2] = {-1, -1}; 
+
+const int PICK_TOLERANCE = 3; 
+
+//the transformation of the last frame rendered, used to unproject
+//the mouse clicks 
+GLdouble modelview_matrix[16], projection_matrix[16]; 
+GLint viewport[4]; 
+
+
+
+/* ************************************************************ */
+/* REPLAY 
+
+   With --replay path.txt, the camera follows a scripted path (see
+   replay.hpp) instead of the keypresses, and display() is timed for
+   every frame. The frames are driven from the GLUT idle function;
+   at the end the frame times are printed and the program exits.
+*/
+vector<replay_frame> replay_frames; 
+int replaying = 0; 
+
+//number of frames to render; the path is repeated if it is shorter 
+long replay_nb_frames = 0; 
+long replay_next = 0; 
+
+//the time and number of points of each frame rendered 
+vector<double> replay_times; 
+vector<long> replay_points; 
+
+//the points drawn by the current frame, 0 for the density grid 
+long frame_points = 0; 
+
+
+
 /* forward declarations of functions */
 void display(void);
 void keypress(unsigned char key, int x, int y);
-
-void draw_points(); 
+void mouse(int button, int state, int x, int y);
+void replay_step(); 
+bool export_keep(long i); 
+void post_export(const char* fname); 
+
+int is_rendered(const render_params & rp, long i); 
+double change_filter(const render_params & rp); 
+void post_render_job(); 
+void update_classification(const render_params & rp); 
+void reclassify_later(); 
+void wait_classification(); 
+double compute_max_hag(); 
+void check_buffers(int value); 
+long draw_points(long max_points); 
+void draw_slice(); 
+void set_draw_order(); 
+int draw_bin(long i); 
+void refine_step(); 
+void copy_front_to_back(); 
+void draw_picked(); 
+void draw_tin(); 
+void draw_density(); 
+double points_per_pixel(); 
 void draw_xy_rect(GLfloat z, GLfloat* col); 
 void draw_xz_rect(GLfloat y, GLfloat* col); 
 void draw_yz_rect(GLfloat x, GLfloat* col); 
 void cube(GLfloat side); 
 void draw_axes(); 
-GLfloat xtoscreen(GLfloat x);
-GLfloat ytoscreen(GLfloat y);
-GLfloat ztoscreen(GLfloat z); 
+GLfloat xtoscreen(GLfloat x, double s);
+GLfloat ytoscreen(GLfloat y, double s);
+GLfloat ztoscreen(GLfloat z, double s, double zexag); 
+double screentox(GLdouble x, double s);
+double screentoy(GLdouble y, double s);
+double screentoz(GLdouble z, double s, double zexag); 
 void filledcube(GLfloat side); 
 
 
@@ -177,18 +559,306 @@ void filledcube(GLfloat side);
 
 
 /************************************************************/
-int main(int argc, char** argv) {
+void usage(char* prog) {
+  printf("usage: %s [options] file.txt\n", prog);
+  printf("       %s [options] --synthetic N\n", prog);
+  printf("       %s --eval [--min-accuracy A] [--min-throughput P] tile1.txt tile2.txt ...\n", prog);
+  printf("options:\n"); 
+  printf("\t--attrs a1,a2,..: also read these attributes: intensity, gps_time, point_source_id\n"); 
+  printf("\t--columns letters: the columns of a file without header, as in las2txt -parse (default xyzrnc)\n"); 
+  printf("\t--stats-json file.json: write the statistics of the points to file.json\n"); 
+  printf("\t--eval: classify the tiles, compare mycode with code and exit\n"); 
+  printf("\t--min-accuracy A: with --eval, fail if the accuracy is below A percent\n"); 
+  printf("\t--min-throughput P: with --eval, fail if classify() runs below P points/s\n"); 
+  printf("\t--synthetic N: instead of reading a file, generate a synthetic cloud of N points\n"); 
+  printf("\t--replay path.txt: render the frames of a camera path, print the frame times and exit\n"); 
+  printf("\t--frames N: with --replay, render N frames, repeating the path if needed\n"); 
+  printf("\t--reorder: sort the points in Morton order after loading them\n"); 
+  printf("\t--bench name: run benchmark name on the points and exit; benchmarks: reorder, scaling, memory, compare\n"); 
+  printf("\t--max-mem SIZE: keep the points within SIZE bytes (e.g. 4G), dropping a uniform sample of them\n"); 
+  printf("\t--frame-budget MS: draw the points for MS ms per frame, the rest while idle; 0 draws all (default 30)\n"); 
+  printf("\t--threads N: use N threads (default: the number of cores)\n"); 
+  printf("\t--pin: pin the threads to cores, spread over the NUMA nodes\n"); 
+  printf("\t--export file: write the points with mycode as classification to file (.las or text) and exit\n"); 
+  printf("\t--tin-code: build the ground mesh from the points with code 2, instead of mycode 2\n"); 
+  printf("\t--tin-tolerance T: simplify the ground mesh to one point per T x T cell\n"); 
+  printf("\t--hag-tin: compute the height above ground from the ground mesh, not a grid\n"); 
+  printf("\t--config file: read the classification parameters from file (name = value lines):\n"); 
+  printf("\t\tlow_veg_max_hag (default %.1f), medium_veg_max_hag (default %.1f), ground_cellsize (default 0: automatic)\n", 
+	 LOW_VEG_MAX_HAG, MEDIUM_VEG_MAX_HAG); 
+  printf("\t--compare ref.txt: color the points by their distance to the reference cloud ref.txt\n"); 
+  printf("\t--compare-max D: with --compare, search up to distance D (default 2)\n"); 
+  printf("\t--m3c2 R: with --compare, measure along the normals fit to the reference within R\n"); 
+  printf("\t--trees file.csv: detect the trees in the vegetation and write them to file.csv\n"); 
+  printf("\t--tree-cell S: with --trees, the cell size of the canopy height model (default %.1f)\n", CANOPY_CELLSIZE); 
+  printf("\t--cluster-codes c1,c2,..: cluster the points with these mycodes (default 3,4,5)\n"); 
+  printf("\t--cluster-radius R: cluster points closer than R (default 1)\n"); 
+  exit(1); 
+}
 
-  //read number of points from user
-  if (argc!=2) {
-    printf("usage: %s file.txt\n", argv[0]);
+
+/* evaluates classify() on the tiles; returns the exit status, which
+   is 1 if the accuracy or throughput are below the minimums given */
+int run_eval(int ntiles, char** fnames, double min_accuracy, double min_throughput) {
+
+  lidar_eval e; 
+  eval_init(&e); 
+  eval_tiles(ntiles, fnames, &e); 
+  print_eval(e); 
+
+  int status = 0; 
+  if (100 * eval_accuracy(e) < min_accuracy) {
+    printf("eval: FAILED, accuracy %.2f%% is below %.2f%%\n", 100 * eval_accuracy(e), min_accuracy); 
+    status = 1; 
+  }
+  if (eval_throughput(e) < min_throughput) {
+    printf("eval: FAILED, throughput %.0f points/s is below %.0f\n", eval_throughput(e), min_throughput); 
+    status = 1; 
+  }
+  return status; 
+}
+
+
+/* parses a size in bytes with an optional suffix K, M, G or T (powers
+   of 1024), e.g. 4G or 512M; returns 0 if it is not one */
+double parse_size(const char* str) {
+
+  char* end; 
+  double v = strtod(str, &end); 
+  switch (toupper(*end)) {
+  case 'T': v *= 1024; 
+  case 'G': v *= 1024; 
+  case 'M': v *= 1024; 
+  case 'K': v *= 1024; end++; 
+  }
+  if (toupper(*end) == 'B') end++; 
+  if (*end != '\0' || v <= 0) return 0; 
+  return v; 
+}
+
+
+/* the most points that fit in max_mem bytes. A point costs its record
+   and side columns, its height above ground, its cluster id, its
+   tree id with --trees, its distance and the reference point with
+   --compare, its place in the reclassification cache, and its
+   coordinates, color and index in two render buffers, the one drawn
+   and the one being built; the read buffers, the grids and the
+   libraries are budgeted as MEM_FIXED */
+long points_in_budget(double max_mem, int attrs, int trees, int compare) {
+
+  long bytes = sizeof(lidar_point) + sizeof(float) + sizeof(int); 
+  if (attrs & ATTR_INTENSITY) bytes += sizeof(float); 
+  if (attrs & ATTR_GPS_TIME) bytes += sizeof(double); 
+  if (attrs & ATTR_POINT_SOURCE_ID) bytes += sizeof(int); 
+  if (trees) bytes += sizeof(int); 
+  if (compare) bytes += sizeof(float) + sizeof(lidar_point) + sizeof(unsigned int); 
+  bytes += sizeof(unsigned int) + sizeof(float); 
+  bytes += 2 * (6 * sizeof(GLfloat) + sizeof(GLuint)); 
+
+  long n = (long)((max_mem - MEM_FIXED) / bytes); 
+  if (n < 1) {
+    printf("--max-mem %.0f MB is too small: %.0f MB go to buffers and libraries\n", 
+	   max_mem / (1 << 20), MEM_FIXED / (1 << 20)); 
     exit(1); 
   }
+  printf("memory budget %.0f MB: at most %ld points of %ld bytes\n", max_mem / (1 << 20), n, bytes); 
+  return n; 
+}
+
+
+/* called when the memory budget dropped points of fname, an epoch of
+   --compare: the epochs would be sampled independently, so the
+   nearest points and the points in the M3C2 cylinders would change
+   with the sample, and even a cloud compared with itself would show
+   change */
+void compare_dropped(const char* fname) {
+  printf("--compare: the memory budget dropped points of %s; the epochs would be sampled "
+	 "independently and their distances would be meaningless. Raise --max-mem, or compare "
+	 "without it\n", fname); 
+  exit(1); 
+}
+
+
+int main(int argc, char** argv) {
+
+  vector<char*> fnames; 
+  char* stats_json = NULL; 
+  int eval_mode = 0; 
+  double min_accuracy = 0, min_throughput = 0; 
+  long synthetic = 0; 
+  char* replay_path = NULL; 
+  int reorder = 0; 
+  char* bench = NULL; 
+  char* export_fname = NULL; 
+  int attrs = 0; 
+  char* columns = NULL; 
+  char* compare_fname = NULL; 
+  char* trees_fname = NULL; 
+  double max_mem = 0; 
+  for (int i=1; i < argc; i++) {
+    if (strcmp(argv[i], "--attrs") == 0 && i+1 < argc) {
+      attrs = parse_attrs(argv[++i]); 
+    } else if (strcmp(argv[i], "--columns") == 0 && i+1 < argc) {
+      columns = argv[++i]; 
+    } else if (strcmp(argv[i], "--stats-json") == 0 && i+1 < argc) {
+      stats_json = argv[++i]; 
+    } else if (strcmp(argv[i], "--eval") == 0) {
+      eval_mode = 1; 
+    } else if (strcmp(argv[i], "--min-accuracy") == 0 && i+1 < argc) {
+      min_accuracy = atof(argv[++i]); 
+    } else if (strcmp(argv[i], "--min-throughput") == 0 && i+1 < argc) {
+      min_throughput = atof(argv[++i]); 
+    } else if (strcmp(argv[i], "--synthetic") == 0 && i+1 < argc) {
+      synthetic = atol(argv[++i]); 
+    } else if (strcmp(argv[i], "--replay") == 0 && i+1 < argc) {
+      replay_path = argv[++i]; 
+    } else if (strcmp(argv[i], "--frames") == 0 && i+1 < argc) {
+      replay_nb_frames = atol(argv[++i]); 
+    } else if (strcmp(argv[i], "--max-mem") == 0 && i+1 < argc) {
+      max_mem = parse_size(argv[++i]); 
+      if (max_mem <= 0) usage(argv[0]); 
+    } else if (strcmp(argv[i], "--frame-budget") == 0 && i+1 < argc) {
+      frame_budget_ms = atof(argv[++i]); 
+      if (frame_budget_ms < 0) usage(argv[0]); 
+    } else if (strcmp(argv[i], "--threads") == 0 && i+1 < argc) {
+      int nt = atoi(argv[++i]); 
+      if (nt < 1) usage(argv[0]); 
+      set_nb_threads(nt); 
+    } else if (strcmp(argv[i], "--pin") == 0) {
+      set_thread_pinning(1); 
+    } else if (strcmp(argv[i], "--reorder") == 0) {
+      reorder = 1; 
+    } else if (strcmp(argv[i], "--bench") == 0 && i+1 < argc) {
+      bench = argv[++i]; 
+    } else if (strcmp(argv[i], "--export") == 0 && i+1 < argc) {
+      export_fname = argv[++i]; 
+    } else if (strcmp(argv[i], "--tin-code") == 0) {
+      tin_code = 1; 
+    } else if (strcmp(argv[i], "--tin-tolerance") == 0 && i+1 < argc) {
+      tin_tolerance = atof(argv[++i]); 
+    } else if (strcmp(argv[i], "--hag-tin") == 0) {
+      hag_tin = 1; 
+    } else if (strcmp(argv[i], "--config") == 0 && i+1 < argc) {
+      config_fname = argv[++i]; 
+    } else if (strcmp(argv[i], "--compare") == 0 && i+1 < argc) {
+      compare_fname = argv[++i]; 
+    } else if (strcmp(argv[i], "--compare-max") == 0 && i+1 < argc) {
+      compare_max_dist = atof(argv[++i]); 
+      if (compare_max_dist <= 0) usage(argv[0]); 
+    } else if (strcmp(argv[i], "--m3c2") == 0 && i+1 < argc) {
+      m3c2_radius = atof(argv[++i]); 
+      if (m3c2_radius <= 0) usage(argv[0]); 
+    } else if (strcmp(argv[i], "--trees") == 0 && i+1 < argc) {
+      trees_fname = argv[++i]; 
+    } else if (strcmp(argv[i], "--tree-cell") == 0 && i+1 < argc) {
+      tree_cellsize = atof(argv[++i]); 
+      if (tree_cellsize <= 0) usage(argv[0]); 
+    } else if (strcmp(argv[i], "--cluster-codes") == 0 && i+1 < argc) {
+      cluster_codes = 0; 
+      for (char* c = strtok(argv[++i], ","); c; c = strtok(NULL, ",")) {
+	int code = atoi(c); 
+	if (code < 0 || code > 31) usage(argv[0]); 
+	cluster_codes |= 1u << code; 
+      }
+    } else if (strcmp(argv[i], "--cluster-radius") == 0 && i+1 < argc) {
+      cluster_radius = atof(argv[++i]); 
+      if (cluster_radius <= 0) usage(argv[0]); 
+    } else if (argv[i][0] != '-') {
+      fnames.push_back(argv[i]); 
+    } else {
+      usage(argv[0]); 
+    }
+  }
+
+  if (eval_mode) {
+    if (fnames.empty()) usage(argv[0]); 
+    return run_eval(fnames.size(), &fnames[0], min_accuracy, min_throughput); 
+  }
+  if (fnames.size() != (synthetic > 0 ? 0: 1)) usage(argv[0]); 
+
+  classify_params_init(&lparams); 
+  if (config_fname && !read_classify_config(config_fname, &lparams)) exit(1); 
+  print_classify_params(lparams); 
+
+  long max_points = 0; 
+  if (max_mem > 0) max_points = points_in_budget(max_mem, attrs, trees_fname != NULL, 
+					       compare_fname != NULL); 
+  if (max_points > 0 && synthetic > max_points) {
+    printf("memory budget: generating %ld points instead of %ld\n", max_points, synthetic); 
+    synthetic = max_points; 
+  }
 
   //this populates the global that holds the points
-  read_lidar_from_file(argv[1], &lpoints); 
+  double t = get_time(); 
+  if (synthetic > 0) 
+    generate_synthetic_cloud(synthetic, &lpoints); 
+  else if (read_lidar_from_file(fnames[0], &lpoints, attrs, columns, max_points) > 0 && 
+	   compare_fname) 
+    compare_dropped(fnames[0]); 
+  double t_read = get_time() - t; 
+
+  if (bench) {
+    if (!run_benchmark(bench, lpoints)) {
+      printf("unknown benchmark %s\n", bench); 
+      exit(1); 
+    }
+    exit(0); 
+  }
+
+  //sort the points spatially, for locality
+  if (reorder) reorder_points(lpoints); 
+
+  t = get_time(); 
+  start_ground_cellsize = classify(lpoints, lparams);
+  if (hag_tin) {
+    //redo the height above ground, and the vegetation that depends on
+    //it, with the ground mesh 
+    tin_build(lpoints, tin_code, tin_tolerance, &ltin); 
+    tin_built = 1; 
+    compute_hag_from_tin(lpoints, ltin); 
+    classify_vegetation(lpoints, lparams); 
+  }
+  double t_classify = get_time() - t; 
+
+  //statistics for quality control 
+  t = get_time(); 
+  lidar_stats stats; 
+  compute_stats(lpoints, &stats); 
+  double t_stats = get_time() - t; 
+  print_stats(stats); 
+  printf("\ttimes: read %.1f ms, classify %.1f ms, statistics %.1f ms\n", 
+	 1000*t_read, 1000*t_classify, 1000*t_stats); 
+  if (stats_json) write_stats_json(stats, stats_json); 
+  if (export_fname) {
+    write_lidar_to_file(export_fname, lpoints, NULL); 
+    exit(0); 
+  }
+
+  //connected components of the classes selected 
+  cluster_points(lpoints, cluster_codes, cluster_radius, CLUSTER_MIN_SIZE, &lclusters); 
+  print_clusters(lclusters); 
 
-  classify(lpoints);
+  //individual trees, from the canopy height model 
+  if (trees_fname) {
+    detect_trees(lpoints, lparams, tree_cellsize, &ltrees); 
+    print_trees(ltrees); 
+    write_trees_csv(ltrees, trees_fname); 
+  }
+
+  //distances to the other epoch; the reference is only needed for them 
+  if (compare_fname) {
+    lidar_point_cloud ref; 
+    if (read_lidar_from_file(compare_fname, &ref, 0, columns, max_points) > 0) 
+      compare_dropped(compare_fname); 
+    compare_clouds(lpoints, ref, m3c2_radius > 0 ? COMPARE_M3C2: COMPARE_C2C, m3c2_radius, 
+		   compare_max_dist, &lchange); 
+    print_compare(lchange, change_threshold); 
+  }
+
+  max_hag = compute_max_hag(); 
+
+  //what reclassification reuses when the parameters change 
+  classify_cache_build(lpoints, lparams, start_ground_cellsize, &lcache); 
   
   //set the length, width and height of the datasetm to be used in graphics
   minx = lpoints.minx;
@@ -204,12 +874,16 @@ int main(int argc, char** argv) {
   scale = (dim_x > dim_y) ? 1.0/dim_x: 1.0/dim_y; 
   printf("\tdim_x = %.1f, dim_y = %.1f, dim_z=%.1f, scale=%f\n", dim_x, dim_y, dim_z, scale); 
 
+  //build the first render buffer 
+  post_render_job(); 
+  wait_jobs(); 
+
   
  
   /* OPEN GL STUFF */
   /* open a window and initialize GLUT stuff */
   glutInit(&argc, argv);
-  glutInitDisplayMode(GLUT_SINGLE | GLUT_RGB | GLUT_DEPTH);
+  glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);
   glutInitWindowSize(WINDOWSIZE, WINDOWSIZE);
   glutInitWindowPosition(100,100);
   glutCreateWindow(argv[0]);
@@ -217,6 +891,14 @@ int main(int argc, char** argv) {
   /* register callback functions */
   glutDisplayFunc(display); 
   glutKeyboardFunc(keypress);
+  glutMouseFunc(mouse); 
+  glutTimerFunc(BUFFER_POLL_MS, check_buffers, 0); 
+  if (replay_path) {
+    read_camera_path(replay_path, &replay_frames); 
+    if (replay_nb_frames <= 0) replay_nb_frames = replay_frames.size(); 
+    replaying = 1; 
+    glutIdleFunc(replay_step); 
+  }
   
   /* OpenGL init */
   /* set background color black*/
@@ -249,6 +931,16 @@ int main(int argc, char** argv) {
 /* this function is called whenever the window needs to be rendered */
 void display(void) {
 
+  //swap in the render buffer built in the background, if any 
+  {
+    lock_guard<mutex> lock(buffer_mutex); 
+    if (buffer_ready) {
+      front_buffer = ready_buffer; 
+      ready_buffer = render_buffer(); 
+      buffer_ready = 0; 
+    }
+  }
+
   //clear the screen
   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
@@ -282,9 +974,77 @@ void display(void) {
   /* We translated the local reference system where we want it to be;
      now we draw the objects in the local reference system.  */
   //the points are in [minx,maxx]x[miny,maxy]x[minz,maxz]
-  draw_points();  
+
+  //save the transformation, to unproject mouse clicks and to find
+  //how many points fall in a pixel 
+  glGetDoublev(GL_MODELVIEW_MATRIX, modelview_matrix); 
+  glGetDoublev(GL_PROJECTION_MATRIX, projection_matrix); 
+  glGetIntegerv(GL_VIEWPORT, viewport); 
+
+  int density = (density_mode == DENSITY_ALWAYS) || 
+    (density_mode == DENSITY_AUTO && !replaying && points_per_pixel() > DENSITY_POINTS_PER_PIXEL); 
+  if (density != drawing_density && !replaying) 
+    printf("%s\n", density ? "drawing the density grid": "drawing the points"); 
+  drawing_density = density; 
+
+  //start drawing the points over; what doesn't fit in the frame is
+  //drawn by refine_step() 
+  frame_points = 0; 
+  if (drawing_density) {
+    draw_density(); 
+    draw_next = NB_DRAW_BINS; 
+  } else {
+    set_draw_order(); 
+    draw_next = 0; 
+    draw_slice(); 
+  }
+  if (DRAW_TIN && tin_built) draw_tin(); 
+  draw_picked(); 
     
-  glFlush();
+  glutSwapBuffers();
+  if (!replaying) glutIdleFunc(draw_next < NB_DRAW_BINS ? refine_step: NULL); 
+}
+
+
+/* called when idle until the frame is complete: draws the next slice
+   of points over the frame shown, and swaps. The depth buffer is not
+   swapped, so it still has the depths of the frame shown. */
+void refine_step() {
+
+  if (draw_next >= NB_DRAW_BINS) {
+    glutIdleFunc(NULL); 
+    return; 
+  }
+  copy_front_to_back(); 
+  glMatrixMode(GL_PROJECTION); 
+  glLoadMatrixd(projection_matrix); 
+  glMatrixMode(GL_MODELVIEW); 
+  glLoadMatrixd(modelview_matrix); 
+
+  draw_slice(); 
+  draw_picked(); 
+  glutSwapBuffers(); 
+}
+
+
+/* copies the frame shown, in the front buffer, to the back buffer;
+   after a swap the back buffer holds an older frame, or nothing */
+void copy_front_to_back() {
+
+  glMatrixMode(GL_PROJECTION); 
+  glLoadIdentity(); 
+  glOrtho(0, viewport[2], 0, viewport[3], -1, 1); 
+  glMatrixMode(GL_MODELVIEW); 
+  glLoadIdentity(); 
+
+  //the copied pixels go through the depth test like any fragment 
+  glDisable(GL_DEPTH_TEST); 
+  glReadBuffer(GL_FRONT); 
+  glDrawBuffer(GL_BACK); 
+  glRasterPos2i(0, 0); 
+  glCopyPixels(viewport[0], viewport[1], viewport[2], viewport[3], GL_COLOR); 
+  glReadBuffer(GL_BACK); 
+  glEnable(GL_DEPTH_TEST); 
 }
 
 
@@ -310,6 +1070,15 @@ void print_options() {
 
   printf("\t9: reset to initial position\n");
   
+  if (!lchange.empty()) printf("\t[/]: lower/raise the change threshold\n");
+  printf("\tD: cycle the density view: automatic, always, never\n");
+  printf("\tk/K, j/J: lower/raise the highest low (%.2f) and medium (%.2f) vegetation\n", 
+	 lparams.low_veg_max_hag, lparams.medium_veg_max_hag);
+  if (!hag_tin) printf("\tn/N: smaller/larger cells of the ground grid\n");
+  if (config_fname) printf("\tL: reload the classification parameters from %s\n", config_fname);
+
+  printf("\tleft click: pick a point, and measure the distance to the previous one\n");
+
   printf("\tx/X,y/Y,z/Z: rotate\n");
   printf("\tf/b/u/d/l/r: forward/back/up/down/left/right\n");
 
@@ -355,6 +1124,10 @@ void keypress(unsigned char key, int x, int y) {
   case 'c': 
     //cycle through  the colormaps options 
     COLORMAP= (COLORMAP+1) % NB_COLORMAP_CHOICES; 
+    if (COLORMAP == CHANGE_COLOR && lchange.empty()) 
+      COLORMAP= (COLORMAP+1) % NB_COLORMAP_CHOICES; 
+    if (COLORMAP == TREE_COLOR && ltrees.id.empty()) 
+      COLORMAP= (COLORMAP+1) % NB_COLORMAP_CHOICES; 
 
     switch (COLORMAP) {
     case ONE_COLOR: 
@@ -376,6 +1149,21 @@ void keypress(unsigned char key, int x, int y) {
     case MYCODE_COLOR: 
       printf("colormap: by mycode\n"); 
       break; 
+    case HAG_COLOR: 
+      printf("colormap: by height above ground, blue=0 to red=%.1f\n", max_hag); 
+      break; 
+    case CLUSTER_COLOR: 
+      printf("colormap: by cluster, %ld clusters; not clustered: dark gray\n", 
+	     (long)lclusters.clusters.size()); 
+      break; 
+    case CHANGE_COLOR: 
+      printf("colormap: by change, blue=-%.2f to red=%.2f, new: magenta; moved less than %.2f: hidden\n", 
+	     compare_max_dist, compare_max_dist, change_threshold); 
+      break; 
+    case TREE_COLOR: 
+      printf("colormap: by tree, %ld trees; not in a crown: dark gray\n", 
+	     (long)ltrees.trees.size()); 
+      break; 
     default: 
       printf("colormap: unknown. oops, something went wrong.\n"); 
       exit(1); 
@@ -525,71 +1313,320 @@ void keypress(unsigned char key, int x, int y) {
     break;
 
   
+  case 'm': 
+    DRAW_TIN = !DRAW_TIN; 
+    if (DRAW_TIN && !tin_built && !tin_posted) {
+      //after the jobs posted before, which may be reclassifying the
+      //points 
+      post_task([] {
+	  tin_build(lpoints, tin_code, tin_tolerance, &ltin); 
+	  tin_built = 1; 
+	}); 
+      tin_posted = 1; 
+    }
+    printf("m: ground mesh %s%s\n", DRAW_TIN ? "on": "off", 
+	   DRAW_TIN && !tin_built ? " (building)": ""); 
+    glutPostRedisplay(); 
+    break; 
+  case 'w': 
+    fillmode = !fillmode; 
+    printf("w: %s polygons\n", fillmode ? "filled": "wire"); 
+    glutPostRedisplay(); 
+    break; 
+
+  case '[': 
+  case ']': 
+    if (lchange.empty()) break; 
+    if (key == ']') change_threshold = (change_threshold > 0) ? change_threshold * 1.25: 0.01; 
+    else change_threshold = (change_threshold > 0.01) ? change_threshold / 1.25: 0; 
+    printf("%c: hide the points that moved less than %.3f\n", key, change_threshold); 
+    glutPostRedisplay(); 
+    break; 
+
+  case 'D': 
+    density_mode = (density_mode + 1) % 3; 
+    printf("D: density view %s\n", density_mode == DENSITY_AUTO ? "automatic": 
+	   density_mode == DENSITY_ALWAYS ? "always": "never"); 
+    glutPostRedisplay(); 
+    break; 
+
+  case 'k': 
+  case 'K': 
+    lparams.low_veg_max_hag += (key == 'K') ? VEG_HAG_STEP: -VEG_HAG_STEP; 
+    if (lparams.low_veg_max_hag < 0) lparams.low_veg_max_hag = 0; 
+    reclassify_later(); 
+    break; 
+  case 'j': 
+  case 'J': 
+    lparams.medium_veg_max_hag += (key == 'J') ? VEG_HAG_STEP: -VEG_HAG_STEP; 
+    if (lparams.medium_veg_max_hag < 0) lparams.medium_veg_max_hag = 0; 
+    reclassify_later(); 
+    break; 
+  case 'n': 
+  case 'N': {
+    if (hag_tin) {
+      printf("%c: the height above ground is from the ground mesh (--hag-tin)\n", key); 
+      break; 
+    }
+    double cellsize = (lparams.ground_cellsize > 0) ? lparams.ground_cellsize: start_ground_cellsize; 
+    cellsize = (key == 'N') ? cellsize * GROUND_CELL_STEP: cellsize / GROUND_CELL_STEP; 
+    if (cellsize < MIN_GROUND_CELL_FACTOR * start_ground_cellsize) 
+      cellsize = MIN_GROUND_CELL_FACTOR * start_ground_cellsize; 
+    lparams.ground_cellsize = cellsize; 
+    reclassify_later(); 
+    break; 
+  }
+  case 'L': 
+    if (!config_fname) {
+      printf("L: no --config file to reload\n"); 
+      break; 
+    }
+    if (read_classify_config(config_fname, &lparams)) reclassify_later(); 
+    break; 
+
+  case 'e': 
+    post_export(EXPORT_LAS); 
+    break; 
+  case 'E': 
+    post_export(EXPORT_TXT); 
+    break; 
+
   case 'q':
+    //finish the exports 
+    wait_jobs(); 
     exit(0);
     break;
   }
-  print_options();
+
+  //rebuild the render buffer in the background, if the key changed
+  //anything other than the view 
+  post_render_job(); 
+  if (!replaying) print_options();
   
 }//keypress
 
 
 
-//this function is called to set the color of a point based on p.code
-void setColorByCode(lidar_point p) {
+//filter passed to the ray query: only rendered points can be picked 
+bool pick_accept(long i) {
+  return is_rendered(front_buffer.params, i); 
+}
+
+
+//the points written by keys e/E: the ones drawn when the key was
+//pressed, set by the export task
+render_params export_params; 
+
+bool export_keep(long i) {
+  return is_rendered(export_params, i); 
+}
+
+
+/* posts a task that writes the points drawn to fname, with the
+   classification at the time of the key: the task brings it up to
+   date first, as the render job that would have may be dropped */
+void post_export(const char* fname) {
+
+  render_params rp = front_buffer.params; 
+  rp.classify = lparams; 
+  rp.classification = classification; 
+  printf("writing %s in the background\n", fname); 
+  post_task([rp, fname] {
+      update_classification(rp); 
+      export_params = rp; 
+      write_lidar_to_file(fname, lpoints, export_keep); 
+    }); 
+}
+
+
+/* picks the first rendered point under pixel (x,y) of the window,
+   prints it, and the distance to the previous pick */
+void pick_point(int x, int y) {
+
+  //the pick reads mycode (through is_rendered) and hag 
+  wait_classification(); 
+  if (!pick_index_built) {
+    double t = get_time(); 
+    voxel_index_build(lpoints, 0, &pick_index); 
+    pick_index_built = 1; 
+    printf("pick: built %d x %d x %d voxel index in %.1f ms\n", 
+	   pick_index.nx, pick_index.ny, pick_index.nz, 1000*(get_time() - t)); 
+  }
+  double t = get_time(); 
+
+  //GLUT counts window rows from the top, OpenGL from the bottom 
+  GLdouble wx = x, wy = viewport[1] + viewport[3] - 1 - y; 
+
+  //the ray through the pixel, from the near to the far plane, in
+  //screen coordinates
+  GLdouble near[3], far[3]; 
+  gluUnProject(wx, wy, 0, modelview_matrix, projection_matrix, viewport, 
+	       &near[0], &near[1], &near[2]); 
+  gluUnProject(wx, wy, 1, modelview_matrix, projection_matrix, viewport, 
+	       &far[0], &far[1], &far[2]); 
+
+  //the points are drawn, and picked, at the scale of the front
+  //buffer, which lags behind the keys until the next one is ready 
+  double s = front_buffer.params.scale, zexag = front_buffer.params.z_exagerration; 
+
+  //PICK_TOLERANCE pixels at the depth of the center of the cloud 
+  GLdouble cx, cy, cz, a[3], b[3]; 
+  gluProject(xtoscreen((minx+maxx)/2, s), ytoscreen((miny+maxy)/2, s), 
+	     ztoscreen((minz+maxz)/2, s, zexag), 
+	     modelview_matrix, projection_matrix, viewport, &cx, &cy, &cz); 
+  gluUnProject(wx, wy, cz, modelview_matrix, projection_matrix, viewport, 
+	       &a[0], &a[1], &a[2]); 
+  gluUnProject(wx + PICK_TOLERANCE, wy, cz, modelview_matrix, projection_matrix, viewport, 
+	       &b[0], &b[1], &b[2]); 
+
+  //back to the coordinates of the points; ztoscreen() stretches z by
+  //zexag/2 relative to x and y 
+  double zscale = zexag / 2; 
+  double o[3] = {screentox(near[0], s), screentoy(near[1], s), screentoz(near[2], s, zexag)}; 
+  double d[3] = {screentox(far[0], s) - o[0], screentoy(far[1], s) - o[1], 
+		 screentoz(far[2], s, zexag) - o[2]}; 
+  double tx = screentox(b[0], s) - screentox(a[0], s); 
+  double ty = screentoy(b[1], s) - screentoy(a[1], s); 
+  double tz = (screentoz(b[2], s, zexag) - screentoz(a[2], s, zexag)) * zscale; 
+  double tol = sqrt(tx*tx + ty*ty + tz*tz); 
+
+  long i = voxel_ray_query(pick_index, lpoints, o, d, tol, zscale, pick_accept); 
+  double ms = 1000*(get_time() - t); 
+  if (i < 0) {
+    printf("pick: no point here (%.2f ms)\n", ms); 
+    return; 
+  }
+
+  picked[1] = picked[0]; 
+  picked[0] = i; 
+  lidar_point p = lpoints.data[i]; 
+  printf("pick: point %ld: x=%.2f, y=%.2f, z=%.2f, code=%d, mycode=%d, return %d of %d, hag=%.2f (%.2f ms)\n", 
+	 i, p.x, p.y, p.z, p.code, p.mycode, p.return_number, p.nb_of_returns, lpoints.hag[i], ms); 
+  if (!lchange.empty()) {
+    if (lchange[i] == COMPARE_NODATA) printf("\tchange: no reference point near it\n"); 
+    else printf("\tchange: %.3f\n", lchange[i]); 
+  }
+  int c = lclusters.id[i]; 
+  if (c >= 0) {
+    const lidar_cluster & cl = lclusters.clusters[c]; 
+    printf("\tcluster %d: %ld points, %.1f x %.1f x %.1f\n", c, cl.size, 
+	   cl.maxx - cl.minx, cl.maxy - cl.miny, cl.maxz - cl.minz); 
+  }
+  if (!ltrees.id.empty() && ltrees.id[i] >= 0) {
+    const lidar_tree & tree = ltrees.trees[ltrees.id[i]]; 
+    printf("\ttree %d: height %.1f, crown %.1f (diameter %.1f), %ld points\n", ltrees.id[i], 
+	   tree.height, tree.crown_area, tree.crown_diameter, tree.nb_points); 
+  }
+
+  if (picked[1] >= 0) {
+    lidar_point q = lpoints.data[picked[1]]; 
+    double dx = p.x - q.x, dy = p.y - q.y, dz = p.z - q.z; 
+    printf("\tdistance to point %ld: %.2f (horizontal %.2f, vertical %.2f)\n", 
+	   picked[1], sqrt(dx*dx + dy*dy + dz*dz), sqrt(dx*dx + dy*dy), dz); 
+  }
+  glutPostRedisplay(); 
+}
+
+
+/* renders the next frame of the replay, timing display(); prints the
+   frame times and exits after the last one */
+void replay_step() {
+
+  if (replay_next == replay_nb_frames) {
+    print_replay_report(replay_times, replay_points); 
+    exit(0); 
+  }
+  const replay_frame & f = replay_frames[replay_next % replay_frames.size()]; 
+  replay_next++; 
+
+  //the keys change the render buffer; build it before timing the frame 
+  if (f.keys[0]) {
+    for (int k = 0; f.keys[k]; k++) keypress(f.keys[k], 0, 0); 
+    wait_jobs(); 
+  }
+  for (int a = 0; a < 3; a++) {
+    pos[a] = f.pos[a]; 
+    theta[a] = f.theta[a]; 
+  }
+
+  double t = get_time(); 
+  display(); 
+  glFinish(); 
+  replay_times.push_back(get_time() - t); 
+  replay_points.push_back(frame_points); 
+}
+
+
+/* this function is called whenever a mouse button is pressed or released */
+void mouse(int button, int state, int x, int y) {
+
+  if (button == GLUT_LEFT_BUTTON && state == GLUT_DOWN) 
+    pick_point(x, y); 
+}
+
+
+
+//copies color c to rgb 
+static inline void set_rgb(GLfloat* rgb, const GLfloat* c) {
+  rgb[0] = c[0]; rgb[1] = c[1]; rgb[2] = c[2]; 
+}
+
+
+//this function is called to set the color rgb of a point based on p.code
+void setColorByCode(const lidar_point & p, GLfloat* rgb) {
   switch (p.code) {
   case 0: //never classified
-    glColor3fv(yellow); 
+    set_rgb(rgb, yellow); 
     break; 
   case 1: //unnasigned 
-    glColor3fv(Orange); 
+    set_rgb(rgb, Orange); 
     break; 
   case 2: //ground 
-    glColor3fv(Tan); 
+    set_rgb(rgb, Tan); 
     break; 
   case 3: //low vegetation 
-    glColor3fv(LimeGreen); 
+    set_rgb(rgb, LimeGreen); 
     break;
   case 4: //medium vegetation 
-    glColor3fv(MediumForestGreen); 
+    set_rgb(rgb, MediumForestGreen); 
     break;
   case 5: //high vegetation 
-    glColor3fv(ForestGreen); 
+    set_rgb(rgb, ForestGreen); 
     break;
   case 6: //building 
-    glColor3fv(red); 
+    set_rgb(rgb, red); 
     break;
   case 7: //noise
-    glColor3fv(magenta); 
+    set_rgb(rgb, magenta); 
     break;
   case 8: //reserved 
-    glColor3fv(white); 
+    set_rgb(rgb, white); 
     break;
   case 9: //water 
-    glColor3fv(blue); 
+    set_rgb(rgb, blue); 
     break;
   case 10: //rail 
-    glColor3fv(gray); 
+    set_rgb(rgb, gray); 
     break;
   case 11: //road surface 
-    glColor3fv(gray); 
+    set_rgb(rgb, gray); 
     break;
   case 12:  //reserved
-    glColor3fv(white); 
+    set_rgb(rgb, white); 
     break;
   case 13: 
   case 14: //wire
-    glColor3fv(gray); 
+    set_rgb(rgb, gray); 
     break;
   case 15: //transmission tower
-    glColor3fv(gray); 
+    set_rgb(rgb, gray); 
     break;
   case 16: //wire 
   case 17: //bridge deck 
-    glColor3fv(gray); 
+    set_rgb(rgb, gray); 
     break;
   case 18: //high noise
-    glColor3fv(magenta); 
+    set_rgb(rgb, magenta); 
     break;
   default: 
     printf("panic: encountered unknown code >18"); 
@@ -598,46 +1635,127 @@ void setColorByCode(lidar_point p) {
 
 
 
-//this function is called to set the color of a point p based on
+//this function is called to set the color rgb of a point p based on
 //p.myCode
-void setColorByMycode(lidar_point p) {
+void setColorByMycode(const lidar_point & p, GLfloat* rgb) {
 
   //fill in 
   switch (p.mycode) {
+  case 3: //low vegetation 
+    set_rgb(rgb, LimeGreen); 
+    break;
   case 4: //medium vegetation 
-    glColor3fv(LimeGreen); 
+    set_rgb(rgb, MediumForestGreen); 
+    break;
+  case 5: //high vegetation 
+    set_rgb(rgb, ForestGreen); 
     break;
   case 2: //ground 
-    glColor3fv(Tan); 
+    set_rgb(rgb, Tan); 
     break;
     
   default: 
-    glColor3fv(gray);
+    set_rgb(rgb, gray);
+  }
+}
+
+void setColorRamp(double t, GLfloat* rgb); 
+
+//this function is called to set the color rgb of a point based on
+//its height above ground h: blue at the ground, through cyan, green,
+//yellow, to red at max_hag
+void setColorByHag(float h, GLfloat* rgb) {
+  setColorRamp(h / max_hag, rgb); 
+}
+
+//sets rgb to the color of t in [0,1] on the ramp blue, cyan, green,
+//yellow, red
+void setColorRamp(double t, GLfloat* rgb) {
+
+  if (t < 0) t = 0; 
+  if (t > 1) t = 1; 
+
+  //4 linear segments between the 5 colors 
+  double s = 4*t; 
+  GLfloat c[3]; 
+  if (s < 1)      { c[0] = 0;   c[1] = s;   c[2] = 1; }
+  else if (s < 2) { c[0] = 0;   c[1] = 1;   c[2] = 2-s; }
+  else if (s < 3) { c[0] = s-2; c[1] = 1;   c[2] = 0; }
+  else            { c[0] = 1;   c[1] = 4-s; c[2] = 0; }
+  set_rgb(rgb, c); 
+}
+
+//this function is called to set the color rgb of a point in cluster
+//(or tree) c: a color hashed from c, so that neighboring clusters
+//likely get different colors
+void setColorByCluster(int c, GLfloat* rgb) {
+
+  if (c < 0) {
+    GLfloat darkgray[3] = {0.25, 0.25, 0.25}; 
+    set_rgb(rgb, darkgray); 
+    return; 
   }
+  unsigned int h = (unsigned int)c * 2654435761u; 
+  GLfloat col[3] = {(GLfloat)(0.3 + 0.7 * ((h >> 8) & 0xff) / 255.0), 
+		    (GLfloat)(0.3 + 0.7 * ((h >> 16) & 0xff) / 255.0), 
+		    (GLfloat)(0.3 + 0.7 * ((h >> 24) & 0xff) / 255.0)}; 
+  set_rgb(rgb, col); 
+}
+
+//this function is called to set the color rgb of a point that moved
+//by d: blue (down) through white (no change) to red (up), full at
+//compare_max_dist; magenta for COMPARE_NODATA (new)
+void setColorByChange(float d, GLfloat* rgb) {
+
+  if (d == COMPARE_NODATA) {
+    set_rgb(rgb, magenta); 
+    return; 
+  }
+  double t = d / compare_max_dist; 
+  if (t < -1) t = -1; 
+  if (t > 1) t = 1; 
+  GLfloat c[3]; 
+  if (t < 0) { c[0] = 1+t; c[1] = 1+t; c[2] = 1; }
+  else       { c[0] = 1;   c[1] = 1-t; c[2] = 1-t; }
+  set_rgb(rgb, c); 
 }
 
 //draw everything with one color 
-void  setColorOneColor(lidar_point p) {
+void  setColorOneColor(const lidar_point & p, GLfloat* rgb) {
 
-   glColor3fv(yellow); //yellow should be a constant
+   set_rgb(rgb, yellow); //yellow should be a constant
   return; 
 }
 
 
 
-//This function is called to set the color of a point p before it is
-//rendered
-void setColor(lidar_point p) { 
+//This function is called to set the color rgb of point i with the
+//colormap of rp
+void setColor(const render_params & rp, long i, GLfloat* rgb) { 
 
-  if (COLORMAP == ONE_COLOR) {
+  const lidar_point & p = lpoints.data[i]; 
+
+  if (rp.colormap == ONE_COLOR) {
     //draw all points with same color 
-    setColorOneColor(p); 
+    setColorOneColor(p, rgb); 
  
-  } else if (COLORMAP == CODE_COLOR) {
-    setColorByCode(p); 
+  } else if (rp.colormap == CODE_COLOR) {
+    setColorByCode(p, rgb); 
+  
+  } else if (rp.colormap == MYCODE_COLOR) {
+    setColorByMycode(p, rgb); 
   
-  } else if (COLORMAP == MYCODE_COLOR) {
-    setColorByMycode(p); 
+  } else if (rp.colormap == HAG_COLOR) {
+    setColorByHag(lpoints.hag[i], rgb); 
+  
+  } else if (rp.colormap == CLUSTER_COLOR) {
+    setColorByCluster(lclusters.id[i], rgb); 
+  
+  } else if (rp.colormap == CHANGE_COLOR) {
+    setColorByChange(lchange[i], rgb); 
+  
+  } else if (rp.colormap == TREE_COLOR) {
+    setColorByCluster(ltrees.id[i], rgb); 
   
   } else {
     printf("unkown colormap options.\n");
@@ -646,8 +1764,35 @@ void setColor(lidar_point p) {
 } //setColor()
 
 
-int get_code(lidar_point p) {
-  if (COLORMAP == MYCODE_COLOR)
+//sets rgba to the color of cell i of the density grid g with the
+//colormap of rp; empty cells are transparent 
+void setDensityColor(const render_params & rp, const density_grid & g, long i, GLubyte* rgba) {
+
+  if (g.count[i] == 0) {
+    rgba[0] = rgba[1] = rgba[2] = rgba[3] = 0; 
+    return; 
+  }
+  double t = log(1.0 + g.count[i]) / log(1.0 + g.max_count); 
+  GLfloat rgb[3]; 
+  double shade = 1; 
+  if (rp.colormap == CODE_COLOR || rp.colormap == MYCODE_COLOR) {
+    lidar_point p; 
+    p.code = p.mycode = g.dominant[i]; 
+    if (rp.colormap == CODE_COLOR) setColorByCode(p, rgb); 
+    else setColorByMycode(p, rgb); 
+    shade = 0.35 + 0.65 * t; 
+  } else if (rp.colormap == HAG_COLOR) {
+    setColorByHag(g.maxhag[i], rgb); 
+  } else {
+    setColorRamp(t, rgb); 
+  }
+  for (int k = 0; k < 3; k++) rgba[k] = (GLubyte)(255 * shade * rgb[k]); 
+  rgba[3] = 255; 
+}
+
+
+int get_code(const render_params & rp, const lidar_point & p) {
+  if (rp.colormap == MYCODE_COLOR)
     return p.mycode;
   else
     return p.code; 
@@ -656,92 +1801,552 @@ int get_code(lidar_point p) {
 
 
 /* ****************************** */
-/* Draw the points.  
+/* returns 1 if point i passes the filters of rp by return, by code
+   and by change, i.e. it needs to be rendered, and 0 otherwise */
+int is_rendered(const render_params & rp, long i) {
 
-   NOTE: The points are in the range x=[minx, maxx], y=[miny,
-   maxy], z=[minz, maxz] and they must be mapped into
-   x=[-1,1], y=[-1, 1], z=[-1,1]
-  */
-void draw_points(){
-  
-  //the actual points 
-  vector<lidar_point> data = lpoints.data;
-  
-  lidar_point p; 
-  glBegin(GL_POINTS); 
-  for (int i=0; i < data.size(); i++) {
+  const lidar_point & p = lpoints.data[i]; 
 
-    //current point; do we want to include it in the rendering? 
-    p = data[i]; 
-    
-    //FIRST FILTER BY RETURN
-    if (which_return == FIRST_RETURN) // we only want first returns
-      if (p.return_number!=1) continue;
+  //FIRST FILTER BY RETURN
+  if (rp.which_return == FIRST_RETURN) // we only want first returns
+    if (p.return_number!=1) return 0;
 
-    if (which_return == LAST_RETURN) // we only want last returns
-      if (p.return_number !=p.nb_of_returns) continue;
+  if (rp.which_return == LAST_RETURN) // we only want last returns
+    if (p.return_number !=p.nb_of_returns) return 0;
 
-    if (which_return == MORE_THAN_ONE_RETURN) //we only want pulses that have > 1 return 
-      if (p.nb_of_returns ==1) continue;
+  if (rp.which_return == MORE_THAN_ONE_RETURN) //we only want pulses that have > 1 return 
+    if (p.nb_of_returns ==1) return 0;
 
-    if (which_return == ONE_RETURN) //we only want pulses that have == 1 return 
-      if (p.nb_of_returns > 1) continue;
+  if (rp.which_return == ONE_RETURN) //we only want pulses that have == 1 return 
+    if (p.nb_of_returns > 1) return 0;
 
+  //if (which_return==ALL_RETURN)  // we want all points so keep going 
 
+
+  //if point made it here, it has the return we want
+
+  //NEXT FILTER BY CODE
+  //if this point is 2 and we dont want to render ground, skip it
+  int code = get_code(rp, p);
     
-    //if (which_return==ALL_RETURN)  // we want all points so keep going 
+  if ((code == 2) && !rp.render_ground)  return 0; 
 
+  //if this point is 3,4,5 and we don't want to draw the vegetation,skip it
+  if (((code == 3) || (code == 4) || (code == 5)) && !rp.render_veg)  return 0; 
 
-    //if point made it here, it has the return we want
+  //if this point if 6 and we don't want to draw teh buildings, skip it 
+  if ((code == 6) && !rp.render_building) return 0; 
 
-    //NEXT FILTER BY CODE
-    //if this point is 2 and we dont want to render ground, skip it
-    int code = get_code(p);
-    
-    if ((code == 2) && !RENDER_GROUND)  continue; 
+  //if this point is "other" and we don't want to draw "other" skip it 
+  if (((code == 0) || (code ==1) || (code >6)) && !rp.render_other) return 0; 
 
-    //if this point is 3,4,5 and we don't want to draw the vegetation,skip it
-    if (((code == 3) || (code == 4) || (code == 5)) && !RENDER_VEG)  continue; 
+  //FINALLY FILTER BY CHANGE 
+  double threshold = change_filter(rp); 
+  if (threshold > 0 && lchange[i] != COMPARE_NODATA && fabs(lchange[i]) < threshold) return 0; 
 
-    //if this point if 6 and we don't want to draw teh buildings, skip it 
-  if ((code == 6) && !RENDER_BUILDING) continue; 
+  return 1; 
+}
 
-    //if this point is "other" and we don't want to draw "other" skip it 
-  if (((code == 0) || (code ==1) || (code >6)) && !RENDER_OTHER) continue; 
-    
-    //if point made it here, it needs to be rendered 
-    
-    //set the color of this point
-    setColor(p);
-    
-    //tell openGL to render it
-    
-    
-      glVertex3f(xtoscreen(data[i].x),
-	       ytoscreen(data[i].y), 
-    	       ztoscreen(data[i].z));
-    
-    //glVertex3f(data[i].x, data[i].y, data[i].z);
-
-    /* 
-    //draw the point as a small cube 
-    //first save local coordinate system 
-    glPushMatrix(); 
-    //translate our local coordinate system to the point that we want to draw
-    glTranslatef(data[i].x, data[i].y, data[i].z);
-    //draw the cube 
-    filledcube(dim_x*.001); 
-    //go  back to where we were
-     glPopMatrix();
-    */
+
+
+//returns the options set by the user that the render buffer depends on
+render_params current_params() {
+  render_params rp; 
+  rp.which_return = which_return; 
+  rp.render_ground = RENDER_GROUND; 
+  rp.render_veg = RENDER_VEG; 
+  rp.render_building = RENDER_BUILDING; 
+  rp.render_other = RENDER_OTHER; 
+  rp.colormap = COLORMAP; 
+  rp.change_threshold = change_threshold; 
+  rp.scale = scale; 
+  rp.z_exagerration = Z_EXAGERRATION; 
+  rp.classify = lparams; 
+  rp.classification = classification; 
+  return rp; 
+}
+
+
+/* returns 1 if the colors of the colormap of rp depend on mycode or
+   hag, which reclassification changes. The filters by code don't:
+   reclassification only moves points between the vegetation codes,
+   which are shown and hidden together. */
+int colors_classified(const render_params & rp) {
+  return rp.colormap == MYCODE_COLOR || rp.colormap == HAG_COLOR; 
+}
+
+
+/* the threshold of the filter by change of rp: 0 (no filter) unless
+   the points are drawn by change */
+double change_filter(const render_params & rp) {
+  return (rp.colormap == CHANGE_COLOR) ? rp.change_threshold: 0; 
+}
+
+
+/* returns 1 if a and b filter the same points. The code filters look
+   at mycode or code depending on the colormap. */
+int same_filters(const render_params & a, const render_params & b) {
+  return a.which_return == b.which_return && 
+    a.render_ground == b.render_ground && a.render_veg == b.render_veg && 
+    a.render_building == b.render_building && a.render_other == b.render_other && 
+    (a.colormap == MYCODE_COLOR) == (b.colormap == MYCODE_COLOR) && 
+    change_filter(a) == change_filter(b); 
+}
+
+
+/* builds in rb the render buffer for options rp, in parallel. The
+   arrays of the latest buffer built that don't depend on the options
+   that changed are shared, not rebuilt. Returns 0 if the job with
+   this generation was cancelled before the buffer was complete. */
+int build_render_buffer(const render_params & rp, long generation, render_buffer* rb) {
+
+  render_buffer base; 
+  {
+    lock_guard<mutex> lock(buffer_mutex); 
+    base = buffer_ready ? ready_buffer: front_buffer; 
   }
-  
-  glEnd(); 
+  const render_params & bp = base.params; 
+  long n = lpoints.data.size(); 
+  rb->params = rp; 
+
+  /* NOTE: The points are in the range x=[minx, maxx], y=[miny,
+     maxy], z=[minz, maxz] and they must be mapped into
+     x=[-1,1], y=[-1, 1], z=[-1,1] */
+  if (base.xyz && bp.scale == rp.scale && bp.z_exagerration == rp.z_exagerration) {
+    rb->xyz = base.xyz; 
+  } else {
+    rb->xyz = make_shared< vector<GLfloat> >(3*n); 
+    GLfloat* xyz = &(*rb->xyz)[0]; 
+    parallel_for(n, [&](long b, long e) {
+	if (job_cancelled(generation)) return; 
+	for (long i = b; i < e; i++) {
+	  const lidar_point & p = lpoints.data[i]; 
+	  xyz[3*i] = xtoscreen(p.x, rp.scale); 
+	  xyz[3*i+1] = ytoscreen(p.y, rp.scale); 
+	  xyz[3*i+2] = ztoscreen(p.z, rp.scale, rp.z_exagerration); 
+	}
+      }); 
+    if (job_cancelled(generation)) return 0; 
+  }
+
+  //the colors depend only on the colormap, and the classification 
+  if (base.rgb && bp.colormap == rp.colormap && 
+      (bp.classification == rp.classification || !colors_classified(rp))) {
+    rb->rgb = base.rgb; 
+  } else {
+    rb->rgb = make_shared< vector<GLfloat> >(3*n); 
+    GLfloat* rgb = &(*rb->rgb)[0]; 
+    parallel_for(n, [&](long b, long e) {
+	if (job_cancelled(generation)) return; 
+	for (long i = b; i < e; i++) 
+	  setColor(rp, i, rgb + 3*i); 
+      }); 
+    if (job_cancelled(generation)) return 0; 
+  }
+
+  if (base.index && same_filters(bp, rp)) {
+    rb->index = base.index; 
+    rb->bin_start = base.bin_start; 
+  } else {
+    //count the points that pass in each chunk and drawing bin, then
+    //each chunk writes its points of a bin starting at the sum of the
+    //counts before it: of the bins before, and of the chunks before
+    //in the same bin 
+    int nchunks = 4*nb_threads(); 
+    vector<long> count((long)nchunks * NB_DRAW_BINS, 0); 
+    parallel_for_chunks(n, nchunks, [&](int c, long b, long e) {
+	if (job_cancelled(generation)) return; 
+	long* cc = &count[(long)c * NB_DRAW_BINS]; 
+	for (long i = b; i < e; i++) 
+	  if (is_rendered(rp, i)) cc[draw_bin(i)]++; 
+      }); 
+    if (job_cancelled(generation)) return 0; 
+    rb->bin_start = make_shared< vector<long> >(NB_DRAW_BINS + 1); 
+    vector<long> & start = *rb->bin_start; 
+    long total = 0; 
+    for (int bin = 0; bin < NB_DRAW_BINS; bin++) {
+      start[bin] = total; 
+      for (int c = 0; c < nchunks; c++) {
+	long k = count[(long)c * NB_DRAW_BINS + bin]; 
+	count[(long)c * NB_DRAW_BINS + bin] = total; 
+	total += k; 
+      }
+    }
+    start[NB_DRAW_BINS] = total; 
+
+    rb->index = make_shared< vector<GLuint> >(total); 
+    vector<GLuint> & index = *rb->index; 
+    parallel_for_chunks(n, nchunks, [&](int c, long b, long e) {
+	if (job_cancelled(generation)) return; 
+	long* cc = &count[(long)c * NB_DRAW_BINS]; 
+	for (long i = b; i < e; i++) 
+	  if (is_rendered(rp, i)) index[cc[draw_bin(i)]++] = i; 
+      }); 
+    if (job_cancelled(generation)) return 0; 
+  }
+
+  //the density grid depends on the points drawn and, by mycode and
+  //hag, on the classification; its colors also on the colormap 
+  if (base.density && rb->index == base.index && 
+      (bp.classification == rp.classification || 
+       (rp.colormap != MYCODE_COLOR && rp.colormap != HAG_COLOR))) {
+    rb->density = base.density; 
+  } else {
+    rb->density = make_shared<density_grid>(); 
+    const vector<GLuint> & index = *rb->index; 
+    density_build(lpoints, index.empty() ? NULL: &index[0], index.size(), 
+		  rp.colormap == MYCODE_COLOR, rb->density.get()); 
+    if (job_cancelled(generation)) return 0; 
+  }
+  if (base.density_rgba && rb->density == base.density && bp.colormap == rp.colormap) {
+    rb->density_rgba = base.density_rgba; 
+  } else {
+    const density_grid & g = *rb->density; 
+    long ncells = (long)g.nrows * g.ncols; 
+    rb->density_rgba = make_shared< vector<GLubyte> >(4*ncells); 
+    GLubyte* rgba = &(*rb->density_rgba)[0]; 
+    parallel_for(ncells, [&](long b, long e) {
+	for (long i = b; i < e; i++) 
+	  setDensityColor(rp, g, i, rgba + 4*i); 
+      }); 
+  }
+  return !job_cancelled(generation); 
+}
+
+
+/* posts a job that builds the render buffer for the current options,
+   if they changed since the last job posted */
+void post_render_job() {
+
+  render_params rp = current_params(); 
+  if (posted && same_filters(rp, posted_params) && rp.colormap == posted_params.colormap && 
+      rp.scale == posted_params.scale && rp.z_exagerration == posted_params.z_exagerration && 
+      rp.classification == posted_params.classification) 
+    return; 
+  posted_params = rp; 
+  posted = 1; 
+
+  post_job([rp](long generation) {
+      update_classification(rp); 
+      render_buffer rb; 
+      if (!build_render_buffer(rp, generation, &rb)) return; 
+      lock_guard<mutex> lock(buffer_mutex); 
+      ready_buffer = rb; 
+      buffer_ready = 1; 
+    }); 
+}
+
+
+/* brings mycode and hag up to the classification parameters of rp, if
+   they changed; called by the render jobs, on the worker thread */
+void update_classification(const render_params & rp) {
+
+  if (rp.classification == classified) return; 
+  int hag_changes = !hag_tin && rp.classify.ground_cellsize != lcache.params.ground_cellsize; 
+  reclassify(lpoints, rp.classify, hag_tin, &lcache); 
+  if (hag_changes) max_hag = compute_max_hag(); 
+  classified = rp.classification; 
+}
+
+
+/* called on the GLUT thread before reading mycode or hag: waits for
+   the jobs if they have not brought the points up to the last
+   parameters. Only the GLUT thread posts jobs, so none can start
+   reclassifying after this returns, until the next key. */
+void wait_classification() {
+  if (classified.load() != classification) wait_jobs(); 
+}
+
+
+/* called by the keys that change lparams: the next render job
+   reclassifies the points */
+void reclassify_later() {
+  classification++; 
+  print_classify_params(lparams); 
+  glutPostRedisplay(); 
+}
+
+
+//returns the largest height above ground, at least 1 
+double compute_max_hag() {
+  return parallel_reduce((long)lpoints.hag.size(), 1.0, [&](long b, long e, double & m) {
+      for (long i = b; i < e; i++) 
+	if (lpoints.hag[i] > m) m = lpoints.hag[i]; 
+    }, [](double a, double b) { return max(a, b); }); 
+}
+
+
+/* called on a timer on the GLUT thread: redisplays when a new render
+   buffer, or the ground mesh, is ready */
+void check_buffers(int value) {
+
+  int ready; 
+  {
+    lock_guard<mutex> lock(buffer_mutex); 
+    ready = buffer_ready; 
+  }
+  if (ready || (DRAW_TIN && tin_built && !tin_drawn)) glutPostRedisplay(); 
+  glutTimerFunc(BUFFER_POLL_MS, check_buffers, 0); 
+}
+
+
+
+/* ****************************** */
+/* Draw the points of the front render buffer that pass the filters:
+   the bins from draw_next on in draw_order, until at least
+   max_points are drawn. Returns the number of points drawn. */
+long draw_points(long max_points){
+
+  if (!front_buffer.index || front_buffer.index->empty()) {
+    draw_next = NB_DRAW_BINS; 
+    return 0; 
+  }
+  const vector<GLuint> & index = *front_buffer.index; 
+  const vector<long> & start = *front_buffer.bin_start; 
+
+  glEnableClientState(GL_VERTEX_ARRAY); 
+  glEnableClientState(GL_COLOR_ARRAY); 
+  glVertexPointer(3, GL_FLOAT, 0, &(*front_buffer.xyz)[0]); 
+  glColorPointer(3, GL_FLOAT, 0, &(*front_buffer.rgb)[0]); 
+  long drawn = 0; 
+  if (draw_next == 0 && (long)index.size() <= max_points) {
+    //all of them, in one call 
+    glDrawElements(GL_POINTS, index.size(), GL_UNSIGNED_INT, &index[0]); 
+    drawn = index.size(); 
+    draw_next = NB_DRAW_BINS; 
+  }
+  while (draw_next < NB_DRAW_BINS && drawn < max_points) {
+    int bin = draw_order[draw_next++]; 
+    long k = start[bin+1] - start[bin]; 
+    if (k == 0) continue; 
+    glDrawElements(GL_POINTS, k, GL_UNSIGNED_INT, &index[start[bin]]); 
+    drawn += k; 
+  }
+  glDisableClientState(GL_COLOR_ARRAY); 
+  glDisableClientState(GL_VERTEX_ARRAY); 
+  return drawn; 
 }//draw_points
 
 
+/* draws the next slice of points: as many as fit in frame_budget_ms
+   at the measured rate, or all of them without a budget and when
+   replaying. Measures the rate, and counts the points in
+   frame_points. */
+void draw_slice() {
+
+  int budget = (frame_budget_ms > 0 && !replaying); 
+  long max_points = LONG_MAX; 
+  if (budget) max_points = (draw_rate > 0) ? (long)(draw_rate * frame_budget_ms): DRAW_FIRST_POINTS; 
+  double t = get_time(); 
+  long drawn = draw_points(max_points); 
+  frame_points += drawn; 
+  if (!budget || drawn == 0) return; 
+
+  //GL draws asynchronously: wait for it to know how long it took 
+  glFinish(); 
+  double ms = 1000*(get_time() - t); 
+  double rate = drawn / (ms > 0.01 ? ms: 0.01); 
+  draw_rate = (draw_rate > 0) ? (draw_rate + rate) / 2: rate; 
+}
+
+
+/* the point drawing bin of point i: its level, from the bits of i
+   mod DRAW_LEVELS reversed, and its tile */
+int draw_bin(long i) {
+
+  int r = i % DRAW_LEVELS, level = 0; 
+  for (int b = 1; b < DRAW_LEVELS; b <<= 1) 
+    level = (level << 1) | ((r & b) ? 1: 0); 
+
+  const lidar_point & p = lpoints.data[i]; 
+  int tx = (dim_x > 0) ? (int)((p.x - minx) / dim_x * DRAW_TILES): 0; 
+  int ty = (dim_y > 0) ? (int)((p.y - miny) / dim_y * DRAW_TILES): 0; 
+  if (tx >= DRAW_TILES) tx = DRAW_TILES - 1; 
+  if (ty >= DRAW_TILES) ty = DRAW_TILES - 1; 
+  return (level * DRAW_TILES + ty) * DRAW_TILES + tx; 
+}
+
+
+/* sets draw_order for the current view: level by level, and in every
+   level the tiles nearest to the camera first */
+void set_draw_order() {
+
+  //the camera in the screen coordinates of the points: the inverse
+  //of the modelview transformation (a rotation and a translation)
+  //applied to the origin 
+  const GLdouble* m = modelview_matrix; 
+  double eye[3]; 
+  for (int c = 0; c < 3; c++) 
+    eye[c] = -(m[4*c] * m[12] + m[4*c+1] * m[13] + m[4*c+2] * m[14]); 
+
+  const render_params & fp = front_buffer.params; 
+  const int ntiles = DRAW_TILES * DRAW_TILES; 
+  int tiles[ntiles]; 
+  double dist[ntiles]; 
+  for (int t = 0; t < ntiles; t++) {
+    double x = minx + (t % DRAW_TILES + 0.5) * dim_x / DRAW_TILES; 
+    double y = miny + (t / DRAW_TILES + 0.5) * dim_y / DRAW_TILES; 
+    double dx = xtoscreen(x, fp.scale) - eye[0], dy = ytoscreen(y, fp.scale) - eye[1]; 
+    double dz = ztoscreen((minz + maxz) / 2, fp.scale, fp.z_exagerration) - eye[2]; 
+    dist[t] = dx*dx + dy*dy + dz*dz; 
+    tiles[t] = t; 
+  }
+  sort(tiles, tiles + ntiles, [&](int a, int b) { return dist[a] < dist[b]; }); 
+  for (int l = 0; l < DRAW_LEVELS; l++) 
+    for (int t = 0; t < ntiles; t++) 
+      draw_order[l * ntiles + t] = l * ntiles + tiles[t]; 
+}
+
+
+
+/* the number of points drawn per pixel, if they were spread evenly
+   over the xy bounding box at z=minz: the number of points over the
+   area, in pixels, of the bounding box projected on the window. 0
+   when the box is partly behind the camera, i.e. zoomed in. */
+double points_per_pixel() {
+
+  if (!front_buffer.index) return 0; 
+  double corner[4][2] = {{minx, miny}, {maxx, miny}, {maxx, maxy}, {minx, maxy}}; 
+  double win[4][3]; 
+  const render_params & fp = front_buffer.params; 
+  for (int k = 0; k < 4; k++) {
+    gluProject(xtoscreen(corner[k][0], fp.scale), ytoscreen(corner[k][1], fp.scale), 
+	       ztoscreen(minz, fp.scale, fp.z_exagerration), 
+	       modelview_matrix, projection_matrix, viewport, &win[k][0], &win[k][1], &win[k][2]); 
+    if (win[k][2] < 0 || win[k][2] > 1) return 0; 
+  }
+  //shoelace formula 
+  double area = 0; 
+  for (int k = 0; k < 4; k++) 
+    area += win[k][0] * win[(k+1)%4][1] - win[(k+1)%4][0] * win[k][1]; 
+  area = fabs(area) / 2; 
+  if (area < 1) area = 1; 
+  return front_buffer.index->size() / area; 
+}
+
+
+//the smallest power of 2 >= n 
+static int pow2_at_least(int n) {
+  int p = 1; 
+  while (p < n) p *= 2; 
+  return p; 
+}
+
+
+/* draws the density grid of the front render buffer as one quad at
+   z=minz, textured with the colors of its cells */
+void draw_density() {
+
+  if (!front_buffer.density_rgba) return; 
+  const density_grid & g = *front_buffer.density; 
+  int texw = pow2_at_least(g.ncols), texh = pow2_at_least(g.nrows); 
+
+  if (density_texture == 0) glGenTextures(1, &density_texture); 
+  glBindTexture(GL_TEXTURE_2D, density_texture); 
+  if (density_loaded != front_buffer.density_rgba) {
+    //OpenGL 1.x textures have power of 2 sides: the cells are in the
+    //lower left corner 
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST); 
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST); 
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1); 
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, texw, texh, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL); 
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, g.ncols, g.nrows, GL_RGBA, GL_UNSIGNED_BYTE, 
+		    &(*front_buffer.density_rgba)[0]); 
+    density_loaded = front_buffer.density_rgba; 
+  }
+
+  double s = front_buffer.params.scale; 
+  GLfloat x0 = xtoscreen(g.minx, s), x1 = xtoscreen(g.minx + g.ncols * g.cellsize, s); 
+  GLfloat y0 = ytoscreen(g.miny, s), y1 = ytoscreen(g.miny + g.nrows * g.cellsize, s); 
+  GLfloat s1 = (GLfloat)g.ncols / texw, t1 = (GLfloat)g.nrows / texh; 
+
+  glEnable(GL_TEXTURE_2D); 
+  glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE); 
+  //the empty cells are not drawn 
+  glEnable(GL_ALPHA_TEST); 
+  glAlphaFunc(GL_GREATER, 0); 
+  glBegin(GL_QUADS); 
+  glTexCoord2f(0, 0);   glVertex3f(x0, y0, 0); 
+  glTexCoord2f(s1, 0);  glVertex3f(x1, y0, 0); 
+  glTexCoord2f(s1, t1); glVertex3f(x1, y1, 0); 
+  glTexCoord2f(0, t1);  glVertex3f(x0, y1, 0); 
+  glEnd(); 
+  glDisable(GL_ALPHA_TEST); 
+  glDisable(GL_TEXTURE_2D); 
+}
+
 
 
+/* draws the ground mesh, colored by elevation, wire or filled
+   depending on fillmode */
+void draw_tin() {
+
+  tin_drawn = 1; 
+  if (ltin.tri.empty()) return; 
+  long nv = ltin.point.size(); 
+  if ((long)tin_xyz.size() != 3*nv) {
+    tin_xyz.resize(3*nv); 
+    tin_rgb.resize(3*nv); 
+    double range = (maxz > minz) ? maxz - minz: 1; 
+    parallel_for(nv, [&](long b, long e) {
+	for (long v = b; v < e; v++) {
+	  tin_xyz[3*v] = 2*(ltin.xyz[3*v] - minx) - dim_x; 
+	  tin_xyz[3*v+1] = 2*(ltin.xyz[3*v+1] - miny) - dim_y; 
+	  tin_xyz[3*v+2] = ltin.xyz[3*v+2] - minz; 
+	  setColorRamp((ltin.xyz[3*v+2] - minz) / range, &tin_rgb[3*v]); 
+	}
+      }); 
+  }
+
+  //the same mapping as xtoscreen(), ytoscreen() and ztoscreen(), at
+  //the scale of the points drawn 
+  const render_params & fp = front_buffer.params; 
+  glPushMatrix(); 
+  glScalef(fp.scale, fp.scale, fp.scale * fp.z_exagerration); 
+  glPolygonMode(GL_FRONT_AND_BACK, fillmode ? GL_FILL: GL_LINE); 
+  glEnableClientState(GL_VERTEX_ARRAY); 
+  glEnableClientState(GL_COLOR_ARRAY); 
+  glVertexPointer(3, GL_FLOAT, 0, &tin_xyz[0]); 
+  glColorPointer(3, GL_FLOAT, 0, &tin_rgb[0]); 
+  glDrawElements(GL_TRIANGLES, ltin.tri.size(), GL_UNSIGNED_INT, &ltin.tri[0]); 
+  glDisableClientState(GL_COLOR_ARRAY); 
+  glDisableClientState(GL_VERTEX_ARRAY); 
+  glPolygonMode(GL_FRONT_AND_BACK, GL_FILL); 
+  glPopMatrix(); 
+}
+
+
+
+//draw the picked points on top of everything, and the segment
+//between the last two
+void draw_picked() {
+
+  if (picked[0] < 0) return; 
+  double s = front_buffer.params.scale, zexag = front_buffer.params.z_exagerration; 
+
+  glDisable(GL_DEPTH_TEST); 
+  glColor3fv(white); 
+  glPointSize(8); 
+  glBegin(GL_POINTS); 
+  for (int k=0; k < 2; k++) {
+    if (picked[k] < 0) continue; 
+    lidar_point p = lpoints.data[picked[k]]; 
+    glVertex3f(xtoscreen(p.x, s), ytoscreen(p.y, s), ztoscreen(p.z, s, zexag)); 
+  }
+  glEnd(); 
+  glPointSize(1); 
+
+  if (picked[1] >= 0) {
+    glBegin(GL_LINES); 
+    for (int k=0; k < 2; k++) {
+      lidar_point p = lpoints.data[picked[k]]; 
+      glVertex3f(xtoscreen(p.x, s), ytoscreen(p.y, s), ztoscreen(p.z, s, zexag)); 
+    }
+    glEnd(); 
+  }
+  glEnable(GL_DEPTH_TEST); 
+}
+
 
 
 //draw a square x=[-side,side] x y=[-side,side] at depth z
@@ -825,40 +2430,56 @@ void cube(GLfloat side) {
   draw_xz_rect(0, side);
 }
 
-/* x is a value in [minx, maxx]; it is mapped to [-1,1] */
-GLfloat xtoscreen(GLfloat x) {
+/* x is a value in [minx, maxx]; it is mapped to [-1,1] at scale s.
+   The scale and the vertical exageration zexag are passed, not read
+   from the globals the user is changing: the render jobs map at the
+   ones of their buffer, and the drawing at the ones of the buffer
+   drawn (front_buffer.params) */
+GLfloat xtoscreen(GLfloat x, double s) {
   //map x to [-1, 1]
   //return (-1 + 2*(x-minx)/(maxx-minx)); 
 
   //map x keeping the aspect ratio of the dataset
-  double diff = 2 * (1.0 - dim_x*scale); 
-  double xnew =  -1 + diff/2 +  2*(x - minx)* scale; 
+  double diff = 2 * (1.0 - dim_x*s); 
+  double xnew =  -1 + diff/2 +  2*(x - minx)* s; 
   // printf("x=%.1f\n", xnew); 
   return xnew;
 }
 
-
-/* y is a value in [miny, maxy]; it is mapped to [-1,1] */
-GLfloat ytoscreen(GLfloat y) {
+GLfloat ytoscreen(GLfloat y, double s) {
   //map y to [-1, 1]
   //return (-1 + 2*(y-miny)/(maxy-miny)); 
   
   //map y keeping the aspect ratio of the dataset
-  double diff = 2 * (1.0 - dim_y*scale); 
-  double ynew =  -1 + diff/2 +  2*(y - miny)* scale; 
+  double diff = 2 * (1.0 - dim_y*s); 
+  double ynew =  -1 + diff/2 +  2*(y - miny)* s; 
   //printf("y=%.1f\n", ynew); 
   return ynew;
 }
 
-/* z is a value in [minz, maxz]; it is mapped so that [minz, maxz] map to [0,1] */
-GLfloat ztoscreen(GLfloat z) {
+GLfloat ztoscreen(GLfloat z, double s, double zexag) {
   //map z to [0, 1] 
   // return ((z-minz)/(maxz-minz)); 
 
   //map at the same scale as on xy
   // double zscale = 1/(maxz-minz);
   //zscale = zscale/Z_EXAGERRATION;
-  return (z-minz)* scale * Z_EXAGERRATION; 
+  return (z-minz)* s * zexag; 
 }
 
 
+/* the inverses of xtoscreen(), ytoscreen() and ztoscreen(): map
+   screen coordinates back to the coordinates of the points */
+double screentox(GLdouble x, double s) {
+  double diff = 2 * (1.0 - dim_x*s); 
+  return minx + (x + 1 - diff/2) / (2*s); 
+}
+
+double screentoy(GLdouble y, double s) {
+  double diff = 2 * (1.0 - dim_y*s); 
+  return miny + (y + 1 - diff/2) / (2*s); 
+}
+
+double screentoz(GLdouble z, double s, double zexag) {
+  return minz + z / (s * zexag); 
+}
@@ -0,0 +1,339 @@
+#include "parallel.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+using namespace std;
+
+
+
+//the chunks [lo, hi) of a parallel call that a thread has left to run
+typedef struct _pool_range {
+  mutex m;
+  int lo, hi;
+} pool_range;
+
+
+//a parallel call, on the stack of the calling thread
+typedef struct _pool_call {
+  void (*run)(void*, int);
+  void* ctx;
+  int nchunks;
+
+  //the range of every thread of the pool; a caller from outside the
+  //pool is thread 0
+  vector<pool_range> range;
+
+  //chunks handed out
+  atomic<int> taken;
+
+  //pool threads working on the call
+  int users;
+} pool_call;
+
+
+//the pool
+typedef struct _pool_state {
+
+  //the threads, when started; thread t (from 1) is threads[t-1], and
+  //thread 0 is the caller
+  vector<thread> threads;
+  int started;
+  int stopping;
+
+  //--threads and --pin
+  int nthreads;
+  int pin;
+
+  //the NUMA node of every thread, for stealing
+  vector<int> node;
+
+  //the calls with chunks left to hand out, oldest first
+  vector<pool_call*> calls;
+
+  mutex m;
+  condition_variable call_posted, call_left;
+
+} pool_state;
+
+
+/* the threads block on call_posted until the program exits, so the
+   state is never destroyed (see jobs.cpp) */
+static pool_state & pool() {
+  static pool_state* ps = NULL;
+  static once_flag created;
+  call_once(created, [] {
+      ps = new pool_state;
+      ps->started = 0;
+      ps->stopping = 0;
+      ps->nthreads = 0;
+      ps->pin = 0;
+    });
+  return *ps;
+}
+
+//the index of the current thread in the pool, or -1 if it is not one
+//of its threads
+static thread_local int pool_id = -1;
+
+
+
+int nb_threads() {
+  pool_state & ps = pool();
+  if (ps.nthreads > 0) return ps.nthreads;
+  int n = thread::hardware_concurrency();
+  return (n > 0) ? n: 1;
+}
+
+
+/* the cores of every NUMA node, from /sys/devices/system/node; a
+   single node with all the cores if there is no such information */
+static vector< vector<int> > numa_nodes() {
+
+  vector< vector<int> > nodes;
+  for (int k = 0; ; k++) {
+    char fname[128];
+    snprintf(fname, sizeof fname, "/sys/devices/system/node/node%d/cpulist", k);
+    FILE* f = fopen(fname, "r");
+    if (!f) break;
+    //a list like 0-3,8-11
+    vector<int> cpus;
+    char line[4096];
+    if (fgets(line, sizeof line, f)) {
+      for (char* s = strtok(line, ",\n"); s; s = strtok(NULL, ",\n")) {
+	int a, b;
+	int got = sscanf(s, "%d-%d", &a, &b);
+	if (got == 1) b = a;
+	if (got >= 1) for (int c = a; c <= b; c++) cpus.push_back(c);
+      }
+    }
+    fclose(f);
+    if (!cpus.empty()) nodes.push_back(cpus);
+  }
+  if (nodes.empty()) {
+    int n = thread::hardware_concurrency();
+    nodes.push_back(vector<int>());
+    for (int c = 0; c < (n > 0 ? n: 1); c++) nodes[0].push_back(c);
+  }
+  return nodes;
+}
+
+
+#ifdef __linux__
+static void pin_thread(pthread_t th, int cpu) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (pthread_setaffinity_np(th, sizeof set, &set) != 0)
+    printf("set_thread_pinning: cannot pin a thread to core %d\n", cpu);
+}
+#endif
+
+
+/* the next chunk for thread t of call, from its own range, or stolen
+   from the range of another thread: the second half of it, of which
+   thread t keeps the rest. Returns -1 when all the chunks are handed
+   out. */
+static int take_chunk(pool_state & ps, pool_call & call, int t) {
+
+  pool_range & mine = call.range[t];
+  {
+    lock_guard<mutex> lock(mine.m);
+    if (mine.lo < mine.hi) {
+      call.taken++;
+      return mine.lo++;
+    }
+  }
+  int nranges = call.range.size();
+  int my_node = (t < (int)ps.node.size()) ? ps.node[t]: 0;
+  //first the threads on the same node
+  for (int pass = 0; pass < 2; pass++) {
+    for (int k = 1; k < nranges; k++) {
+      int v = (t + k) % nranges;
+      int v_node = (v < (int)ps.node.size()) ? ps.node[v]: 0;
+      if ((pass == 0) != (v_node == my_node)) continue;
+      pool_range & victim = call.range[v];
+      int lo, hi;
+      {
+	lock_guard<mutex> lock(victim.m);
+	if (victim.lo >= victim.hi) continue;
+	hi = victim.hi;
+	lo = victim.hi - (victim.hi - victim.lo + 1) / 2;
+	victim.hi = lo;
+      }
+      if (lo + 1 < hi) {
+	lock_guard<mutex> lock(mine.m);
+	mine.lo = lo + 1;
+	mine.hi = hi;
+      }
+      call.taken++;
+      return lo;
+    }
+  }
+  return -1;
+}
+
+
+//runs the chunks of call that thread t can get
+static void work_on(pool_state & ps, pool_call & call, int t) {
+  int c;
+  while ((c = take_chunk(ps, call, t)) >= 0) {
+    call.run(call.ctx, c);
+  }
+}
+
+
+//thread t of the pool: works on the calls posted, oldest first
+static void pool_loop(int t) {
+
+  pool_state & ps = pool();
+  pool_id = t;
+  unique_lock<mutex> lock(ps.m);
+  while (1) {
+    pool_call* call = NULL;
+    ps.call_posted.wait(lock, [&] {
+	if (ps.stopping) return true;
+	for (size_t k = 0; k < ps.calls.size(); k++) {
+	  if (ps.calls[k]->taken < ps.calls[k]->nchunks) {
+	    call = ps.calls[k];
+	    return true;
+	  }
+	}
+	return false;
+      });
+    if (ps.stopping) return;
+    call->users++;
+
+    lock.unlock();
+    work_on(ps, *call, t);
+    lock.lock();
+
+    call->users--;
+    ps.call_left.notify_all();
+  }
+}
+
+
+//starts the threads, with ps.m locked
+static void start_pool(pool_state & ps) {
+
+  int n = nb_threads();
+  ps.node.assign(n, 0);
+  vector< vector<int> > nodes = numa_nodes();
+  for (int t = 0; t < n; t++) ps.node[t] = t % nodes.size();
+
+  ps.stopping = 0;
+  for (int t = 1; t < n; t++) ps.threads.push_back(thread(pool_loop, t));
+  ps.started = 1;
+
+#ifdef __linux__
+  if (ps.pin) {
+    for (int t = 0; t < n; t++) {
+      const vector<int> & cpus = nodes[ps.node[t]];
+      int cpu = cpus[(t / nodes.size()) % cpus.size()];
+      pin_thread(t == 0 ? pthread_self(): ps.threads[t-1].native_handle(), cpu);
+    }
+    printf("pool: %d threads pinned over %d NUMA nodes\n", n, (int)nodes.size());
+  }
+#endif
+}
+
+
+//stops the threads; they are started again by the next parallel call
+static void stop_pool(pool_state & ps) {
+
+  vector<thread> threads;
+  {
+    lock_guard<mutex> lock(ps.m);
+    if (!ps.started) return;
+    ps.stopping = 1;
+    ps.started = 0;
+    threads.swap(ps.threads);
+  }
+  ps.call_posted.notify_all();
+  for (size_t t = 0; t < threads.size(); t++) threads[t].join();
+}
+
+
+void set_nb_threads(int n) {
+  pool_state & ps = pool();
+  stop_pool(ps);
+  ps.nthreads = (n > 0) ? n: 0;
+}
+
+
+void set_thread_pinning(int pin) {
+  pool_state & ps = pool();
+  stop_pool(ps);
+  ps.pin = pin;
+}
+
+
+
+void pool_run(int nchunks, void (*run)(void*, int), void* ctx) {
+
+  pool_state & ps = pool();
+  int n = nb_threads();
+  if (nchunks <= 1 || n <= 1) {
+    for (int c = 0; c < nchunks; c++) run(ctx, c);
+    return;
+  }
+
+  int me = (pool_id >= 0) ? pool_id: 0;
+  pool_call call;
+  call.run = run;
+  call.ctx = ctx;
+  call.nchunks = nchunks;
+  call.taken = 0;
+  call.users = 0;
+  vector<pool_range> ranges(n);
+  call.range.swap(ranges);
+  for (int t = 0; t < n; t++) {
+    call.range[t].lo = (long)nchunks * t / n;
+    call.range[t].hi = (long)nchunks * (t + 1) / n;
+  }
+
+  {
+    lock_guard<mutex> lock(ps.m);
+    if (!ps.started) start_pool(ps);
+    ps.calls.push_back(&call);
+  }
+  ps.call_posted.notify_all();
+
+  work_on(ps, call, me);
+
+  //no thread can start on the call once it is removed. While the
+  //threads still working on it finish, help with the other calls.
+  unique_lock<mutex> lock(ps.m);
+  for (size_t k = 0; k < ps.calls.size(); k++) {
+    if (ps.calls[k] == &call) {
+      ps.calls.erase(ps.calls.begin() + k);
+      break;
+    }
+  }
+  while (call.users > 0) {
+    pool_call* other = NULL;
+    for (size_t k = 0; k < ps.calls.size() && !other; k++)
+      if (ps.calls[k]->taken < ps.calls[k]->nchunks) other = ps.calls[k];
+    if (!other) {
+      ps.call_left.wait(lock);
+      continue;
+    }
+    other->users++;
+    lock.unlock();
+    work_on(ps, *other, me);
+    lock.lock();
+    other->users--;
+    ps.call_left.notify_all();
+  }
+}
@@ -0,0 +1,91 @@
+#ifndef __PARALLEL_HPP
+#define __PARALLEL_HPP
+
+#include <vector>
+using namespace std;
+
+
+/*
+   The parallel helpers below run on one pool of threads, shared by
+   every stage (loading, classification, rendering prep, ...) and
+   started on first use, so a stage doesn't spawn threads of its own.
+
+   A parallel call hands its chunks out to the threads of the pool,
+   each of which takes its chunks from its own range and, when that is
+   empty, steals half of the remaining range of another thread
+   (preferring threads on its NUMA node). The calling thread works
+   too, so calls can be nested and made from any thread, including
+   the background job thread (see jobs.hpp).
+*/
+
+
+//returns the number of threads used by the parallel helpers,
+//including the calling thread
+int nb_threads();
+
+/* sets the number of threads of the pool (--threads); 0 is the number
+   of cores. Must not be called while a parallel call runs. */
+void set_nb_threads(int n);
+
+/* pins the threads of the pool (--pin): thread t runs on NUMA node t
+   % nb_nodes, on one of its cores, so the threads are spread over the
+   nodes, and the calling thread is thread 0. Linux only. Must not be
+   called while a parallel call runs. */
+void set_thread_pinning(int pin);
+
+
+/* runs run(ctx, c) for c in [0, nchunks) on the pool, and returns
+   when they are all done; used by the templates below */
+void pool_run(int nchunks, void (*run)(void*, int), void* ctx);
+
+
+/*
+   splits [0,n) into nchunks contiguous chunks and calls f(chunk,
+   begin, end) on each of them, in parallel. The chunks are handed out
+   dynamically to the threads, so they don't need to have the same
+   cost.
+
+   Chunk c is always the same range of [0,n), so per-chunk
+   accumulators (merged after the call) give deterministic results.
+*/
+template <class F>
+void parallel_for_chunks(long n, int nchunks, F f) {
+
+  if (n <= 0) return;
+  if (nchunks > n) nchunks = n;
+  if (nchunks < 1) nchunks = 1;
+
+  struct call {
+    F* f;
+    long n;
+    int nchunks;
+  } ctx = {&f, n, nchunks};
+  pool_run(nchunks, [](void* p, int c) {
+      call* ctx = (call*)p;
+      (*ctx->f)(c, ctx->n * c / ctx->nchunks, ctx->n * (c+1) / ctx->nchunks);
+    }, &ctx);
+}
+
+
+/* calls f(begin, end) on chunks of [0, n), in parallel */
+template <class F>
+void parallel_for(long n, F f) {
+  parallel_for_chunks(n, 4*nb_threads(), [&](int c, long b, long e) { f(b, e); });
+}
+
+
+/* calls f(begin, end, acc) on chunks of [0, n), in parallel, each
+   chunk with its own acc starting at identity, and returns the
+   combine(a, b) of the chunks' accs, in chunk order */
+template <class T, class F, class R>
+T parallel_reduce(long n, T identity, F f, R combine) {
+  int nchunks = 4*nb_threads();
+  vector<T> acc(nchunks, identity);
+  parallel_for_chunks(n, nchunks, [&](int c, long b, long e) { f(b, e, acc[c]); });
+  T total = identity;
+  for (int c = 0; c < nchunks; c++) total = combine(total, acc[c]);
+  return total;
+}
+
+
+#endif
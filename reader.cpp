@@ -0,0 +1,514 @@
+#include "reader.hpp"
+#include "parallel.hpp"
+
+#include <assert.h>
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <vector>
+using namespace std;
+
+
+//what a column holds
+const int F_SKIP = 0;
+const int F_X = 1;
+const int F_Y = 2;
+const int F_Z = 3;
+const int F_RETURN = 4;
+const int F_NB_RETURNS = 5;
+const int F_CLASS = 6;
+const int F_INTENSITY = 7;
+const int F_GPS_TIME = 8;
+const int F_SOURCE_ID = 9;
+
+//the file is read in blocks of this many bytes
+const long READ_BLOCK = 1 << 25;
+
+//the columns of a file without header and without columns given, as
+//written by 'pdal translate' with the dimensions we need
+const char* DEFAULT_COLUMNS = "xyzrnc";
+
+
+//slack on the number of points estimated from the first block, so
+//that the storage reserved rarely has to grow
+const double ESTIMATE_SLACK = 1.02;
+
+
+//the column names we know, lowercase and without '_' and spaces
+typedef struct _column_name {
+  const char* name;
+  int field;
+} column_name;
+
+static const column_name COLUMN_NAMES[] = {
+  {"x", F_X}, {"y", F_Y}, {"z", F_Z},
+  {"returnnumber", F_RETURN}, {"return", F_RETURN}, {"returnnb", F_RETURN},
+  {"numberofreturns", F_NB_RETURNS}, {"numreturns", F_NB_RETURNS}, {"nbofreturns", F_NB_RETURNS},
+  {"classification", F_CLASS}, {"class", F_CLASS},
+  {"intensity", F_INTENSITY},
+  {"gpstime", F_GPS_TIME}, {"time", F_GPS_TIME},
+  {"pointsourceid", F_SOURCE_ID}, {"sourceid", F_SOURCE_ID},
+  {NULL, F_SKIP}
+};
+
+//the fields of the las2txt -parse letters
+static int field_by_letter(char c) {
+  switch (c) {
+  case 'x': return F_X;
+  case 'y': return F_Y;
+  case 'z': return F_Z;
+  case 'r': return F_RETURN;
+  case 'n': return F_NB_RETURNS;
+  case 'c': return F_CLASS;
+  case 'i': return F_INTENSITY;
+  case 't': return F_GPS_TIME;
+  case 'p': return F_SOURCE_ID;
+  default: return F_SKIP;
+  }
+}
+
+
+/* how to parse the lines of a file: the delimiter (0 for runs of
+   spaces or tabs), the field of every column, and the number of
+   columns that need to be looked at: the ones after the last needed
+   field are skipped without being scanned */
+typedef struct _read_schema {
+  char delim;
+  vector<int> field;
+  int ncols;
+} read_schema;
+
+
+//the points parsed from a part of a block
+typedef struct _read_part {
+  vector<lidar_point> data;
+  vector<float> intensity;
+  vector<double> gps_time;
+  vector<int> point_source_id;
+  long bad;
+} read_part;
+
+
+
+int parse_attrs(const char* list) {
+
+  int attrs = 0;
+  const char* s = list;
+  while (*s) {
+    const char* e = strchr(s, ',');
+    size_t len = e ? (size_t)(e - s): strlen(s);
+    if (len == 9 && strncmp(s, "intensity", len) == 0) attrs |= ATTR_INTENSITY;
+    else if (len == 8 && strncmp(s, "gps_time", len) == 0) attrs |= ATTR_GPS_TIME;
+    else if (len == 15 && strncmp(s, "point_source_id", len) == 0) attrs |= ATTR_POINT_SOURCE_ID;
+    else {
+      printf("parse_attrs: unknown attribute %.*s (known: intensity, gps_time, point_source_id)\n",
+	     (int)len, s);
+      exit(1);
+    }
+    s += len;
+    if (*s == ',') s++;
+  }
+  return attrs;
+}
+
+
+//the delimiter of a line: the first of ',', tab, ';' it contains, or
+//0 for spaces
+static char detect_delimiter(const char* line, const char* end) {
+  const char candidates[3] = {',', '\t', ';'};
+  for (int k = 0; k < 3; k++)
+    if (memchr(line, candidates[k], end - line)) return candidates[k];
+  return 0;
+}
+
+
+//the field of a column named name[0..len), e.g. "ReturnNumber" or
+//"return_number"
+static int field_by_name(const char* name, size_t len) {
+  char norm[64];
+  size_t n = 0;
+  for (size_t k = 0; k < len && n + 1 < sizeof norm; k++) {
+    char c = name[k];
+    if (c == '"' || c == '\'' || c == '_' || c == ' ' || c == '\r') continue;
+    norm[n++] = tolower((unsigned char)c);
+  }
+  norm[n] = 0;
+  for (int k = 0; COLUMN_NAMES[k].name; k++)
+    if (strcmp(norm, COLUMN_NAMES[k].name) == 0) return COLUMN_NAMES[k].field;
+  return F_SKIP;
+}
+
+
+//the fields of the attributes not requested are skipped
+static int wanted(int field, int attrs) {
+  if (field == F_INTENSITY) return (attrs & ATTR_INTENSITY) != 0;
+  if (field == F_GPS_TIME) return (attrs & ATTR_GPS_TIME) != 0;
+  if (field == F_SOURCE_ID) return (attrs & ATTR_POINT_SOURCE_ID) != 0;
+  return 1;
+}
+
+
+/* builds the schema from the columns letters if given, otherwise from
+   the header line [header, end) */
+static void build_schema(const char* header, const char* end, const char* columns,
+			 char delim, int attrs, read_schema* sch) {
+
+  sch->delim = delim;
+  sch->field.clear();
+  if (columns) {
+    for (const char* c = columns; *c; c++) sch->field.push_back(field_by_letter(*c));
+  } else {
+    const char* s = header;
+    while (s < end) {
+      if (delim == 0) while (s < end && (*s == ' ' || *s == '\t')) s++;
+      if (s == end || *s == '\n' || *s == '\r') break;
+      const char* e = s;
+      while (e < end && *e != '\n' && (delim ? *e != delim: (*e != ' ' && *e != '\t'))) e++;
+      sch->field.push_back(field_by_name(s, e - s));
+      s = (e < end && *e == delim && delim) ? e + 1: e;
+    }
+  }
+
+  //a field in two columns is read from the first
+  int seen[16] = {0};
+  sch->ncols = 0;
+  for (int c = 0; c < (int)sch->field.size(); c++) {
+    int & f = sch->field[c];
+    if (!wanted(f, attrs) || seen[f]) f = F_SKIP;
+    if (f == F_SKIP) continue;
+    seen[f] = 1;
+    sch->ncols = c + 1;
+  }
+  if (!seen[F_X] || !seen[F_Y] || !seen[F_Z]) {
+    printf("read_lidar_from_file: the file has no x, y or z column\n");
+    exit(1);
+  }
+}
+
+
+/* parses the number at s, and moves s past it; returns 0 if there is
+   no number. Much faster than strtod(), and good to the precision of
+   the files we read. */
+static inline int parse_number(const char* & s, const char* end, double* v) {
+
+  static const double POW10[] = {1, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+				 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18};
+  while (s < end && *s == ' ') s++;
+  int neg = 0;
+  if (s < end && (*s == '-' || *s == '+')) {
+    neg = (*s == '-');
+    s++;
+  }
+  unsigned long long m = 0;
+  int digits = 0, scale = 0;
+  for (; s < end && *s >= '0' && *s <= '9'; s++, digits++) {
+    if (m < 100000000000000000ULL) m = 10*m + (*s - '0');
+    else scale++;
+  }
+  if (s < end && *s == '.') {
+    for (s++; s < end && *s >= '0' && *s <= '9'; s++, digits++) {
+      if (m < 100000000000000000ULL) {
+	m = 10*m + (*s - '0');
+	scale--;
+      }
+    }
+  }
+  if (digits == 0) return 0;
+  if (s < end && (*s == 'e' || *s == 'E')) {
+    const char* e = s + 1;
+    int eneg = 0, ev = 0, edigits = 0;
+    if (e < end && (*e == '-' || *e == '+')) {
+      eneg = (*e == '-');
+      e++;
+    }
+    for (; e < end && *e >= '0' && *e <= '9'; e++, edigits++) ev = 10*ev + (*e - '0');
+    if (edigits > 0) {
+      scale += eneg ? -ev: ev;
+      s = e;
+    }
+  }
+  double d = (double)m;
+  if (scale < 0) d = (scale >= -18) ? d / POW10[-scale]: d * pow(10.0, scale);
+  else if (scale > 0) d = (scale <= 18) ? d * POW10[scale]: d * pow(10.0, scale);
+  *v = neg ? -d: d;
+  return 1;
+}
+
+
+/* parses the lines in [s, end), which ends with a newline, into
+   part. Lines that don't have all the columns needed, or have
+   something else than a number in them, are counted as bad. */
+static void parse_lines(const char* s, const char* end, const read_schema & sch, int attrs,
+			read_part* part) {
+
+  part->bad = 0;
+  char delim = sch.delim;
+  while (s < end) {
+    const char* eol = (const char*)memchr(s, '\n', end - s);
+    if (!eol) eol = end;
+
+    lidar_point p;
+    p.x = p.y = p.z = 0;
+    p.return_number = p.nb_of_returns = 1;
+    p.code = 0;
+    p.mycode = 0;
+    float intensity = 0;
+    double gps_time = 0;
+    int source_id = 0;
+
+    int ok = 1, empty = 1;
+    for (const char* c = s; c < eol; c++)
+      if (*c != ' ' && *c != '\t' && *c != '\r') empty = 0;
+    for (int c = 0; c < sch.ncols && ok && !empty; c++) {
+      if (delim == 0) {
+	while (s < eol && (*s == ' ' || *s == '\t')) s++;
+      } else if (c > 0) {
+	if (s < eol && *s == delim) s++;
+	else ok = 0;
+      }
+      int f = sch.field[c];
+      if (f == F_SKIP) {
+	while (s < eol && (delim ? *s != delim: (*s != ' ' && *s != '\t'))) s++;
+	continue;
+      }
+      double v;
+      if (!parse_number(s, eol, &v)) {
+	ok = 0;
+	break;
+      }
+      while (s < eol && (*s == ' ' || *s == '\r')) s++;
+      switch (f) {
+      case F_X: p.x = v; break;
+      case F_Y: p.y = v; break;
+      case F_Z: p.z = v; break;
+      case F_RETURN: p.return_number = (int)v; break;
+      case F_NB_RETURNS: p.nb_of_returns = (int)v; break;
+      case F_CLASS: p.code = (int)v; break;
+      case F_INTENSITY: intensity = v; break;
+      case F_GPS_TIME: gps_time = v; break;
+      case F_SOURCE_ID: source_id = (int)v; break;
+      }
+    }
+    s = eol + 1;
+    if (empty) continue;
+    if (!ok) {
+      part->bad++;
+      continue;
+    }
+    part->data.push_back(p);
+    if (attrs & ATTR_INTENSITY) part->intensity.push_back(intensity);
+    if (attrs & ATTR_GPS_TIME) part->gps_time.push_back(gps_time);
+    if (attrs & ATTR_POINT_SOURCE_ID) part->point_source_id.push_back(source_id);
+  }
+}
+
+
+/* the number of points in the file, estimated from its size and the
+   average length of the lines of the block [s, e) */
+static long estimate_nb_points(long file_size, const char* s, const char* e) {
+  long lines = 0;
+  for (const char* c = s; c < e; c++) lines += (*c == '\n');
+  if (lines == 0) return 0;
+  return (long)(ESTIMATE_SLACK * file_size * lines / (e - s));
+}
+
+
+/* makes room for n elements in v (a vector or a point_buffer),
+   doubling its capacity, but never beyond max_points if it is set */
+template<class V> static void reserve_points(V & v, long n, long max_points) {
+  if (n <= (long)v.capacity()) return;
+  long c = 2 * (long)v.capacity();
+  if (c < n) c = n;
+  if (max_points > 0 && c > max_points) c = max_points;
+  v.reserve(c);
+}
+
+
+//splitmix64; the sampling is the same from run to run
+static inline uint64_t next_random(uint64_t* state) {
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+
+/* adds the points of part to points. With max_points, once there are
+   max_points points, the t-th point of the file replaces a random one
+   with probability max_points/(t+1) (reservoir sampling), so the
+   points kept are a uniform sample of all the points read; seen
+   counts the points read so far */
+static void add_points(const read_part & part, int attrs, long max_points,
+		       lidar_point_cloud* points, long* seen, uint64_t* rng) {
+
+  long np = part.data.size();
+  long room = (max_points > 0) ? max_points - (long)points->data.size(): np;
+  long take = (np < room) ? np: room;
+  long n = points->data.size() + take;
+  reserve_points(points->data, n, max_points);
+  points->data.append(part.data.data(), take);
+  if (attrs & ATTR_INTENSITY) {
+    reserve_points(points->intensity, n, max_points);
+    points->intensity.insert(points->intensity.end(), part.intensity.begin(),
+			     part.intensity.begin() + take);
+  }
+  if (attrs & ATTR_GPS_TIME) {
+    reserve_points(points->gps_time, n, max_points);
+    points->gps_time.insert(points->gps_time.end(), part.gps_time.begin(),
+			    part.gps_time.begin() + take);
+  }
+  if (attrs & ATTR_POINT_SOURCE_ID) {
+    reserve_points(points->point_source_id, n, max_points);
+    points->point_source_id.insert(points->point_source_id.end(), part.point_source_id.begin(),
+				   part.point_source_id.begin() + take);
+  }
+  *seen += take;
+
+  for (long i = take; i < np; i++) {
+    long j = next_random(rng) % (*seen + 1);
+    (*seen)++;
+    if (j >= max_points) continue;
+    points->data[j] = part.data[i];
+    if (attrs & ATTR_INTENSITY) points->intensity[j] = part.intensity[i];
+    if (attrs & ATTR_GPS_TIME) points->gps_time[j] = part.gps_time[i];
+    if (attrs & ATTR_POINT_SOURCE_ID) points->point_source_id[j] = part.point_source_id[i];
+  }
+}
+
+
+long read_lidar_from_file(const char* fname, lidar_point_cloud* points, int attrs,
+			  const char* columns, long max_points) {
+
+  assert(points);
+  FILE* file = fopen(fname, "rb");
+  if (!file) {
+    printf("read_lidar:from_file: cannot open file %s\n",  fname);
+    exit(1);
+  }
+
+  fseek(file, 0, SEEK_END);
+  long file_size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  points->data.clear();
+  points->intensity.clear();
+  points->gps_time.clear();
+  points->point_source_id.clear();
+
+  vector<char> buf(READ_BLOCK);
+  long carry = 0, bad = 0, seen = 0;
+  uint64_t rng = 1;
+  int first = 1, eof = 0;
+  read_schema sch;
+  int nparts = 4 * nb_threads();
+  vector<read_part> parts(nparts);
+
+  while (!eof) {
+    long got = fread(&buf[carry], 1, READ_BLOCK - carry, file);
+    if (got < READ_BLOCK - carry) eof = 1;
+    long len = carry + got;
+    if (len == 0) break;
+
+    //parse up to the last newline; the rest goes to the next block
+    long end = len;
+    while (end > 0 && buf[end-1] != '\n') end--;
+    if (eof && end < len) {
+      if (len == READ_BLOCK) buf.push_back(0);
+      buf[len++] = '\n';
+      end = len;
+    }
+    if (end == 0) {
+      printf("read_lidar_from_file: line longer than %ld bytes in %s\n", READ_BLOCK, fname);
+      exit(1);
+    }
+    const char* s = &buf[0];
+    const char* e = s + end;
+
+    if (first) {
+      first = 0;
+      const char* eol = (const char*)memchr(s, '\n', e - s);
+      const char* c = s;
+      while (c < eol && (*c == ' ' || *c == '\t')) c++;
+      int has_header = (c < eol && (isalpha((unsigned char)*c) || *c == '"' || *c == '\''));
+      char delim = detect_delimiter(s, eol);
+      if (!has_header && !columns) columns = DEFAULT_COLUMNS;
+      build_schema(s, eol, columns, delim, attrs, &sch);
+      if (has_header) {
+	const char* h = eol;
+	while (h > s && h[-1] == '\r') h--;
+	printf("%.*s\n", (int)(h - s), s);
+	s = eol + 1;
+      }
+      printf("\tcolumns: ");
+      const char* letters = "-xyzrncitp";
+      for (size_t k = 0; k < sch.field.size(); k++) printf("%c", letters[sch.field[k]]);
+      printf(" (delimiter '%s', - skipped)\n", delim == ',' ? ",": delim == '\t' ? "\\t": delim == ';' ? ";": " ");
+
+      //reserve the storage for the whole file at once, rather than
+      //growing it by copies
+      long est = estimate_nb_points(file_size - (s - &buf[0]), s, e);
+      if (max_points > 0 && est > max_points) est = max_points;
+      points->data.reserve(est);
+      if (attrs & ATTR_INTENSITY) points->intensity.reserve(est);
+      if (attrs & ATTR_GPS_TIME) points->gps_time.reserve(est);
+      if (attrs & ATTR_POINT_SOURCE_ID) points->point_source_id.reserve(est);
+    }
+
+    //split at newlines and parse the parts in parallel
+    vector<const char*> cut(nparts + 1);
+    cut[0] = s;
+    for (int k = 1; k < nparts; k++) {
+      const char* c = s + (e - s) * k / nparts;
+      if (c < cut[k-1]) c = cut[k-1];
+      const char* nl = (const char*)memchr(c, '\n', e - c);
+      cut[k] = nl ? nl + 1: e;
+    }
+    cut[nparts] = e;
+    parallel_for_chunks(nparts, nparts, [&](int k, long b, long ee) {
+	read_part & part = parts[k];
+	part.data.clear();
+	part.intensity.clear();
+	part.gps_time.clear();
+	part.point_source_id.clear();
+	parse_lines(cut[k], cut[k+1], sch, attrs, &part);
+      });
+    for (int k = 0; k < nparts; k++) {
+      add_points(parts[k], attrs, max_points, points, &seen, &rng);
+      bad += parts[k].bad;
+    }
+
+    carry = len - end;
+    memmove(&buf[0], &buf[end], carry);
+  }
+  fclose(file);
+
+  //the attributes requested that the file doesn't have
+  const char* names[3] = {"intensity", "gps_time", "point_source_id"};
+  int fields[3] = {F_INTENSITY, F_GPS_TIME, F_SOURCE_ID};
+  for (int k = 0; k < 3; k++) {
+    if (!(attrs & (1 << k))) continue;
+    int found = 0;
+    for (size_t c = 0; c < sch.field.size(); c++) found |= (sch.field[c] == fields[k]);
+    if (!found) printf("read_lidar_from_file: no %s column in %s\n", names[k], fname);
+  }
+  if (!(attrs & ATTR_INTENSITY)) points->intensity.clear();
+  if (!(attrs & ATTR_GPS_TIME)) points->gps_time.clear();
+  if (!(attrs & ATTR_POINT_SOURCE_ID)) points->point_source_id.clear();
+
+  compute_bbox(*points);
+
+  //print info about the points that were read
+  printf("read total %d points\n", (int)points->data.size());
+  if (seen > (long)points->data.size())
+    printf("\tmemory budget: kept a uniform sample of %ld of the %ld points, dropped %ld (%.1f%%)\n",
+	   (long)points->data.size(), seen, seen - (long)points->data.size(),
+	   100.0 * (seen - (long)points->data.size()) / seen);
+  if (bad > 0) printf("\tskipped %ld lines that could not be parsed\n", bad);
+  printf("\tbounding box:  x=[%.2f, %.2f], y=[%.2f,%.2f], z=[%.2f,%.2f]\n",
+	 points->minx, points->maxx, points->miny, points->maxy, points->minz, points->maxz);
+  return seen - (long)points->data.size();
+}
@@ -0,0 +1,59 @@
+#ifndef __READER_HPP
+#define __READER_HPP
+
+#include "lidar.hpp"
+
+#include <stddef.h>
+
+
+
+/* optional attributes, stored in the side columns of the cloud only
+   when requested (see read_lidar_from_file) */
+const int ATTR_INTENSITY = 1;
+const int ATTR_GPS_TIME = 2;
+const int ATTR_POINT_SOURCE_ID = 4;
+
+/* returns the attributes named in list, separated by commas:
+   intensity, gps_time, point_source_id. Exits on an unknown name. */
+int parse_attrs(const char* list);
+
+
+/*
+  reads lidar points from a text file and populates points.
+
+  The columns are mapped by the names in the header line, in any
+  order and case, with the common synonyms (X, ReturnNumber or
+  return_number, Classification or class, GpsTime, ...), so it reads
+  the output of 'pdal translate' with any set of dimensions. The
+  delimiter (comma, tab, semicolon or spaces) is detected from the
+  header.
+
+  Files without a header, such as the output of LAStools 'las2txt
+  -parse xyznrc', need columns: one letter per column, as in las2txt
+  (x, y, z, i intensity, r return number, n number of returns, c
+  classification, t gps time, p point source id; any other letter is
+  a column that is skipped). Without columns, a file without a header
+  is read as x,y,z,r,n,c.
+
+  x, y and z are required; the return number and number of returns
+  default to 1 and the classification to 0. The optional attributes
+  in attrs (ATTR_*) are stored in the side columns of points; the
+  other columns are skipped without being converted.
+
+  The file is read in large blocks, each parsed in parallel. The
+  storage is reserved once, for the number of points estimated from
+  the size of the file and the length of the lines of the first block.
+
+  If max_points > 0, at most max_points points are kept, and storage
+  for no more is ever reserved: past max_points the points are
+  reservoir sampled, so the points kept are a uniform random sample of
+  the file (the same from run to run): every point is kept with the
+  same probability, so the density pattern of the file (denser where
+  flight lines overlap, sparser under trees) is kept, not evened out.
+  The number of points dropped is printed, and returned.
+*/
+long read_lidar_from_file(const char* fname, lidar_point_cloud* points,
+			  int attrs = 0, const char* columns = NULL, long max_points = 0);
+
+
+#endif
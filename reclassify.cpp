@@ -0,0 +1,217 @@
+#include "reclassify.hpp"
+#include "hag.hpp"
+#include "parallel.hpp"
+#include "timer.hpp"
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include <algorithm>
+#include <utility>
+
+
+
+//the tile of point p of the cloud with bounding box of points
+static int tile_of(const lidar_point_cloud & points, const lidar_point & p) {
+
+  double dx = points.maxx - points.minx, dy = points.maxy - points.miny;
+  int c = (dx > 0) ? (int)((p.x - points.minx) / dx * RECLASSIFY_TILES): 0;
+  int r = (dy > 0) ? (int)((p.y - points.miny) / dy * RECLASSIFY_TILES): 0;
+  if (c >= RECLASSIFY_TILES) c = RECLASSIFY_TILES - 1;
+  if (r >= RECLASSIFY_TILES) r = RECLASSIFY_TILES - 1;
+  return r * RECLASSIFY_TILES + c;
+}
+
+
+//sorts the vegetation of tile t by the current points.hag
+static void sort_tile(const lidar_point_cloud & points, classify_cache* c, int t) {
+
+  long b = c->tile_start[t], e = c->tile_start[t+1];
+  vector< pair<float, unsigned int> > v(e - b);
+  for (long k = b; k < e; k++) v[k-b] = make_pair(points.hag[c->veg[k]], c->veg[k]);
+  sort(v.begin(), v.end());
+  for (long k = b; k < e; k++) {
+    c->veg_hag[k] = v[k-b].first;
+    c->veg[k] = v[k-b].second;
+  }
+}
+
+
+/* sets the mycode of the vegetation points veg[b..e) of c with the
+   parameters cp; returns the number of points whose mycode changed */
+static long classify_range(lidar_point_cloud & points, const classify_params & cp,
+			   const classify_cache & c, long b, long e) {
+  long changed = 0;
+  for (long k = b; k < e; k++) {
+    lidar_point & p = points.data[c.veg[k]];
+    int code = vegetation_code(cp, c.veg_hag[k]);
+    if (p.mycode != code) {
+      p.mycode = code;
+      changed++;
+    }
+  }
+  return changed;
+}
+
+
+
+void classify_cache_build(const lidar_point_cloud & points, const classify_params & params,
+			  double ground_cellsize, classify_cache* c) {
+
+  assert(c);
+  double t = get_time();
+  long n = points.data.size();
+  int ntiles = RECLASSIFY_TILES * RECLASSIFY_TILES;
+  c->params = params;
+  c->ground_cellsize = ground_cellsize;
+
+  //count the vegetation points of every chunk in every tile, then
+  //each chunk writes its points of a tile after those of the tiles
+  //before, and of the chunks before in the same tile
+  int nchunks = 4*nb_threads();
+  vector<long> count((long)nchunks * ntiles, 0);
+  parallel_for_chunks(n, nchunks, [&](int ch, long b, long e) {
+      long* cc = &count[(long)ch * ntiles];
+      for (long i = b; i < e; i++)
+	if (is_vegetation_return(points.data[i])) cc[tile_of(points, points.data[i])]++;
+    });
+  c->tile_start.assign(ntiles + 1, 0);
+  long total = 0;
+  for (int tile = 0; tile < ntiles; tile++) {
+    c->tile_start[tile] = total;
+    for (int ch = 0; ch < nchunks; ch++) {
+      long k = count[(long)ch * ntiles + tile];
+      count[(long)ch * ntiles + tile] = total;
+      total += k;
+    }
+  }
+  c->tile_start[ntiles] = total;
+
+  c->veg.resize(total);
+  c->veg_hag.resize(total);
+  parallel_for_chunks(n, nchunks, [&](int ch, long b, long e) {
+      long* cc = &count[(long)ch * ntiles];
+      for (long i = b; i < e; i++)
+	if (is_vegetation_return(points.data[i])) c->veg[cc[tile_of(points, points.data[i])]++] = i;
+    });
+
+  parallel_for(ntiles, [&](long b, long e) {
+      for (long tile = b; tile < e; tile++) sort_tile(points, c, tile);
+    });
+  printf("classify_cache_build: %ld vegetation points in %d tiles, %.1f ms\n",
+	 total, ntiles, 1000 * (get_time() - t));
+}
+
+
+
+long reclassify(lidar_point_cloud & points, const classify_params & cp, int hag_fixed,
+		classify_cache* c) {
+
+  assert(c);
+  double t = get_time();
+  int ntiles = RECLASSIFY_TILES * RECLASSIFY_TILES;
+  const classify_params old = c->params;
+
+  //the points changed in every tile, -1 for the tiles not touched
+  vector<long> tile_changed(ntiles, -1);
+
+  if (!hag_fixed && cp.ground_cellsize != old.ground_cellsize) {
+    //the height above ground changes everywhere: redo it, and all the
+    //tiles with it
+    c->ground_cellsize = compute_hag(points, cp.ground_cellsize);
+    parallel_for(ntiles, [&](long b, long e) {
+	for (long tile = b; tile < e; tile++) {
+	  sort_tile(points, c, tile);
+	  tile_changed[tile] = classify_range(points, cp, *c, c->tile_start[tile], c->tile_start[tile+1]);
+	}
+      });
+
+  } else {
+    /* a point changes class only if its height is in the band between
+       the old and new height of low vegetation, or in the band of
+       medium vegetation */
+    float band[2][2] = {
+      {min(old.low_veg_max_hag, cp.low_veg_max_hag), max(old.low_veg_max_hag, cp.low_veg_max_hag)},
+      {min(old.medium_veg_max_hag, cp.medium_veg_max_hag), max(old.medium_veg_max_hag, cp.medium_veg_max_hag)}
+    };
+    parallel_for(ntiles, [&](long b, long e) {
+	for (long tile = b; tile < e; tile++) {
+	  long first = c->tile_start[tile], last = c->tile_start[tile+1];
+	  if (first == last) continue;
+	  const float* h = &c->veg_hag[0];
+	  for (int k = 0; k < 2; k++) {
+	    if (band[k][0] == band[k][1]) continue;
+	    if (band[k][1] <= h[first] || band[k][0] > h[last-1]) continue;
+	    long from = lower_bound(h + first, h + last, band[k][0]) - h;
+	    long to = lower_bound(h + first, h + last, band[k][1]) - h;
+	    if (tile_changed[tile] < 0) tile_changed[tile] = 0;
+	    tile_changed[tile] += classify_range(points, cp, *c, from, to);
+	  }
+	}
+      });
+  }
+
+  int nredone = 0;
+  long changed = 0;
+  for (int tile = 0; tile < ntiles; tile++) {
+    if (tile_changed[tile] < 0) continue;
+    nredone++;
+    changed += tile_changed[tile];
+  }
+  c->params = cp;
+  if (hag_fixed) c->params.ground_cellsize = old.ground_cellsize;
+  printf("reclassify: %d of %d tiles redone, %ld points changed class, %.1f ms\n",
+	 nredone, ntiles, changed, 1000 * (get_time() - t));
+  return changed;
+}
+
+
+
+int read_classify_config(const char* fname, classify_params* cp) {
+
+  assert(cp);
+  FILE* f = fopen(fname, "r");
+  if (!f) {
+    printf("cannot open classification parameters %s\n", fname);
+    return 0;
+  }
+
+  //parse into a copy, so that a bad file leaves cp as it was
+  classify_params p = *cp;
+  char line[1024];
+  int nline = 0, ok = 1;
+  while (fgets(line, sizeof(line), f)) {
+    nline++;
+    char* hash = strchr(line, '#');
+    if (hash) *hash = '\0';
+    char name[64], rest[2];
+    double v;
+    int k = sscanf(line, " %63[a-z_] = %lf %1s", name, &v, rest);
+    if (k == EOF) continue;
+    if (k != 2 || v < 0) {
+      printf("%s:%d: expected name = value, with a value >= 0\n", fname, nline);
+      ok = 0;
+    } else if (strcmp(name, "low_veg_max_hag") == 0) {
+      p.low_veg_max_hag = v;
+    } else if (strcmp(name, "medium_veg_max_hag") == 0) {
+      p.medium_veg_max_hag = v;
+    } else if (strcmp(name, "ground_cellsize") == 0) {
+      p.ground_cellsize = v;
+    } else {
+      printf("%s:%d: unknown parameter %s\n", fname, nline, name);
+      ok = 0;
+    }
+  }
+  fclose(f);
+  if (ok) *cp = p;
+  return ok;
+}
+
+
+void print_classify_params(const classify_params & cp) {
+  printf("classify: low vegetation up to %.2f, medium vegetation up to %.2f, ",
+	 cp.low_veg_max_hag, cp.medium_veg_max_hag);
+  if (cp.ground_cellsize > 0) printf("ground cellsize %.2f\n", cp.ground_cellsize);
+  else printf("ground cellsize automatic\n");
+}
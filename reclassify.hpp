@@ -0,0 +1,69 @@
+#ifndef __RECLASSIFY_HPP
+#define __RECLASSIFY_HPP
+
+#include "lidar.hpp"
+
+#include <vector>
+using namespace std;
+
+
+
+//the cloud is split in RECLASSIFY_TILES x RECLASSIFY_TILES tiles in xy
+const int RECLASSIFY_TILES = 64;
+
+
+/* what classify() computed that a change of its parameters can reuse:
+   the height above ground (in points.hag) and the vegetation points
+   of every tile, sorted by their height above ground.
+
+   A change of the vegetation heights only changes the class of the
+   vegetation between the old and the new height. A tile whose range
+   of heights doesn't reach that band is not touched, and in the other
+   tiles the points in the band are found by binary search; so the
+   work is proportional to the points that change class, not to the
+   cloud. Only a change of the ground cell size redoes the height
+   above ground, and then all the tiles.
+*/
+typedef struct _classify_cache {
+
+  //the parameters that mycode and hag are up to date with
+  classify_params params;
+
+  //the cell size of the ground grid that hag comes from (the one
+  //chosen, when params.ground_cellsize is 0)
+  double ground_cellsize;
+
+  //the vegetation points of tile t, by increasing height above ground,
+  //are veg[tile_start[t]..tile_start[t+1]); veg_hag are their heights
+  vector<long> tile_start;
+  vector<unsigned int> veg;
+  vector<float> veg_hag;
+
+} classify_cache;
+
+
+/* builds the cache of points, which have been classified with
+   params, with a ground grid of cells of side ground_cellsize */
+void classify_cache_build(const lidar_point_cloud & points, const classify_params & params,
+			  double ground_cellsize, classify_cache* c);
+
+
+/* brings the classification of points, cached in c, up to the
+   parameters cp: only the tiles that the change affects are redone,
+   in parallel. If hag_fixed the height above ground is not recomputed
+   (e.g. it comes from the ground mesh) and the ground cell size of cp
+   is ignored. Returns the number of points whose mycode changed. */
+long reclassify(lidar_point_cloud & points, const classify_params & cp, int hag_fixed,
+		classify_cache* c);
+
+
+/* reads the parameters in the file fname into cp, one "name = value"
+   per line, with the names of the fields of classify_params; lines
+   starting with # are comments, and missing names keep their values
+   in cp. Returns 0 and prints why if the file can't be read. */
+int read_classify_config(const char* fname, classify_params* cp);
+
+void print_classify_params(const classify_params & cp);
+
+
+#endif
@@ -0,0 +1,180 @@
+#include "reorder.hpp"
+#include "parallel.hpp"
+#include "timer.hpp"
+
+#include <assert.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <vector>
+using namespace std;
+
+
+//bits per coordinate in a Morton key
+const int MORTON_BITS = 21;
+
+//bits sorted by each pass of the radix sort
+const int RADIX_BITS = 8;
+const int RADIX = 1 << RADIX_BITS;
+
+
+//spreads the lower 21 bits of v so that there are two 0 bits between
+//consecutive bits
+static inline unsigned long long spread_bits(unsigned long long v) {
+  v &= 0x1fffff;
+  v = (v | v << 32) & 0x1f00000000ffffULL;
+  v = (v | v << 16) & 0x1f0000ff0000ffULL;
+  v = (v | v << 8) & 0x100f00f00f00f00fULL;
+  v = (v | v << 4) & 0x10c30c30c30c30c3ULL;
+  v = (v | v << 2) & 0x1249249249249249ULL;
+  return v;
+}
+
+static inline unsigned long long quantize(double v, double cell) {
+  if (v < 0) return 0;
+  unsigned long long q = (unsigned long long)(v / cell);
+  return (q < (1 << MORTON_BITS)) ? q: (1 << MORTON_BITS) - 1;
+}
+
+
+unsigned long long morton_key(const lidar_point_cloud & points, double cell,
+			      float x, float y, float z) {
+  return spread_bits(quantize(x - points.minx, cell))
+    | spread_bits(quantize(y - points.miny, cell)) << 1
+    | spread_bits(quantize(z - points.minz, cell)) << 2;
+}
+
+
+
+/* LSD radix sort: each pass counts the digits per chunk, then every
+   chunk scatters its elements, in order, after all the smaller digits
+   and after the same digit of the chunks before it, so the sort is
+   stable. Passes where all the keys have the same digit are
+   skipped. */
+void radix_sort(vector<unsigned long long> & key, vector<int> & idx) {
+
+  long n = key.size();
+  vector<unsigned long long> key2(n);
+  vector<int> idx2(n);
+  int nchunks = 4 * nb_threads();
+  vector<long> count((long)nchunks * RADIX);
+
+  for (int shift = 0; shift < 64; shift += RADIX_BITS) {
+
+    fill(count.begin(), count.end(), 0);
+    parallel_for_chunks(n, nchunks, [&](int c, long b, long e) {
+	long* cnt = &count[(long)c * RADIX];
+	for (long i = b; i < e; i++) cnt[(key[i] >> shift) & (RADIX - 1)]++;
+      });
+
+    //count[c][d] becomes the position of the first element of chunk
+    //c with digit d
+    long pos = 0;
+    int ndigits = 0;
+    for (int d = 0; d < RADIX; d++) {
+      long before = pos;
+      for (int c = 0; c < nchunks; c++) {
+	long k = count[(long)c * RADIX + d];
+	count[(long)c * RADIX + d] = pos;
+	pos += k;
+      }
+      if (pos > before) ndigits++;
+    }
+    if (ndigits <= 1) continue;
+
+    parallel_for_chunks(n, nchunks, [&](int c, long b, long e) {
+	long* next = &count[(long)c * RADIX];
+	for (long i = b; i < e; i++) {
+	  long j = next[(key[i] >> shift) & (RADIX - 1)]++;
+	  key2[j] = key[i];
+	  idx2[j] = idx[i];
+	}
+      });
+    key.swap(key2);
+    idx.swap(idx2);
+  }
+}
+
+
+
+//moves column[idx[i]] to column[i], if the column has a value per
+//point; empty side columns stay empty
+template<typename T> static void permute_column(vector<T> & column, const vector<int> & idx) {
+  long n = idx.size();
+  if ((long)column.size() != n) return;
+  vector<T> moved(n);
+  parallel_for(n, [&](long b, long e) {
+      for (long i = b; i < e; i++) moved[i] = column[idx[i]];
+    });
+  column.swap(moved);
+}
+
+
+void reorder_points(lidar_point_cloud & points) {
+
+  double t = get_time();
+  long n = points.data.size();
+
+  //cubic cells, so that the order doesn't favor any axis
+  double side = points.maxx - points.minx;
+  if (points.maxy - points.miny > side) side = points.maxy - points.miny;
+  if (points.maxz - points.minz > side) side = points.maxz - points.minz;
+  double cell = (side > 0) ? side / ((1 << MORTON_BITS) - 1): 1;
+
+  vector<unsigned long long> key(n);
+  vector<int> idx(n);
+  parallel_for(n, [&](long b, long e) {
+      for (long i = b; i < e; i++) {
+	const lidar_point & p = points.data[i];
+	key[i] = morton_key(points, cell, p.x, p.y, p.z);
+	idx[i] = i;
+      }
+    });
+  radix_sort(key, idx);
+
+  //move the points, and every per-point column, to their new place
+  point_buffer<lidar_point> data;
+  data.resize(n);
+  parallel_for(n, [&](long b, long e) {
+      for (long i = b; i < e; i++) data[i] = points.data[idx[i]];
+    });
+  points.data.swap(data);
+  permute_column(points.hag, idx);
+  permute_column(points.intensity, idx);
+  permute_column(points.gps_time, idx);
+  permute_column(points.point_source_id, idx);
+
+  compute_chunks(points, CHUNK_SIZE);
+  printf("reorder_points: sorted %ld points in Morton order in %.1f ms\n", n, 1000 * (get_time() - t));
+}
+
+
+
+void compute_chunks(lidar_point_cloud & points, long chunk_size) {
+
+  assert(chunk_size > 0);
+  long n = points.data.size();
+  long nchunks = (n + chunk_size - 1) / chunk_size;
+  points.chunks.resize(nchunks);
+
+  parallel_for(nchunks, [&](long b, long e) {
+      for (long c = b; c < e; c++) {
+	lidar_chunk & ch = points.chunks[c];
+	ch.begin = c * chunk_size;
+	ch.end = (ch.begin + chunk_size < n) ? ch.begin + chunk_size: n;
+	const lidar_point & first = points.data[ch.begin];
+	ch.minx = ch.maxx = first.x;
+	ch.miny = ch.maxy = first.y;
+	ch.minz = ch.maxz = first.z;
+	for (long i = ch.begin + 1; i < ch.end; i++) {
+	  const lidar_point & p = points.data[i];
+	  if (ch.minx > p.x) ch.minx = p.x;
+	  if (ch.maxx < p.x) ch.maxx = p.x;
+	  if (ch.miny > p.y) ch.miny = p.y;
+	  if (ch.maxy < p.y) ch.maxy = p.y;
+	  if (ch.minz > p.z) ch.minz = p.z;
+	  if (ch.maxz < p.z) ch.maxz = p.z;
+	}
+      }
+    });
+}
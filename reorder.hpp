@@ -0,0 +1,40 @@
+#ifndef __REORDER_HPP
+#define __REORDER_HPP
+
+#include "lidar.hpp"
+
+#include <vector>
+using namespace std;
+
+
+
+//number of points in a chunk
+const long CHUNK_SIZE = 4096;
+
+
+/* returns the 3D Morton key of (x,y,z): the bits of the coordinates,
+   quantized to 21 bits each on cubic cells of side cell from (minx,
+   miny, minz), interleaved. Points close in space tend to have close
+   keys. */
+unsigned long long morton_key(const lidar_point_cloud & points, double cell,
+			      float x, float y, float z);
+
+
+/* sorts key, and idx along with it, by key, in parallel. The sort
+   is stable. */
+void radix_sort(vector<unsigned long long> & key, vector<int> & idx);
+
+
+/* sorts the points (and all the per-point columns, i.e. hag) by their
+   Morton key, with a parallel radix sort, then computes the chunks of
+   CHUNK_SIZE points. Afterwards, points close in space are mostly
+   close in memory. */
+void reorder_points(lidar_point_cloud & points);
+
+
+/* splits the points in chunks of chunk_size consecutive points and
+   computes the bounding box of each, in parallel */
+void compute_chunks(lidar_point_cloud & points, long chunk_size);
+
+
+#endif
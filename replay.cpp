@@ -0,0 +1,89 @@
+#include "replay.hpp"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+using namespace std;
+
+
+
+void read_camera_path(const char* fname, vector<replay_frame>* frames) {
+
+  assert(frames);
+  FILE* file = fopen(fname, "r");
+  if (!file) {
+    printf("read_camera_path: cannot open file %s\n", fname);
+    exit(1);
+  }
+
+  replay_frame prev;
+  memset(&prev, 0, sizeof(replay_frame));
+  char line[1000];
+  int lineno = 0;
+  while (fgets(line, sizeof line, file) != NULL) {
+    lineno++;
+    if (line[0] == '#' || line[0] == '\n') continue;
+
+    int nframes;
+    replay_frame key;
+    memset(&key, 0, sizeof(replay_frame));
+    int k = sscanf(line, "%d %f %f %f %f %f %f %31s", &nframes,
+		   &key.pos[0], &key.pos[1], &key.pos[2],
+		   &key.theta[0], &key.theta[1], &key.theta[2], key.keys);
+    if (k < 7 || nframes < 0) {
+      printf("read_camera_path: %s:%d: expected frames px py pz tx ty tz [keys]\n", fname, lineno);
+      exit(1);
+    }
+
+    //the first keyframe sets the starting pose
+    if (frames->empty() && nframes == 0) {
+      prev = key;
+      continue;
+    }
+    for (int f = 1; f <= nframes; f++) {
+      replay_frame r;
+      double t = (double)f / nframes;
+      for (int a = 0; a < 3; a++) {
+	r.pos[a] = prev.pos[a] + t * (key.pos[a] - prev.pos[a]);
+	r.theta[a] = prev.theta[a] + t * (key.theta[a] - prev.theta[a]);
+      }
+      strcpy(r.keys, (f == 1) ? key.keys: "");
+      frames->push_back(r);
+    }
+    prev = key;
+  }
+  fclose(file);
+
+  if (frames->empty()) {
+    printf("read_camera_path: %s has no frames\n", fname);
+    exit(1);
+  }
+}
+
+
+
+void print_replay_report(const vector<double> & times, const vector<long> & points) {
+
+  assert(times.size() == points.size());
+  if (times.empty()) return;
+
+  vector<double> sorted = times;
+  sort(sorted.begin(), sorted.end());
+  double total = 0;
+  long total_points = 0;
+  for (size_t i = 0; i < times.size(); i++) {
+    total += times[i];
+    total_points += points[i];
+  }
+  size_t p99 = (99 * sorted.size()) / 100;
+  if (p99 >= sorted.size()) p99 = sorted.size() - 1;
+
+  printf("replay: %d frames, %.1f points per frame\n", (int)times.size(), (double)total_points / times.size());
+  printf("\tframe time: min %.2f ms, median %.2f ms, p99 %.2f ms, max %.2f ms\n",
+	 1000 * sorted[0], 1000 * sorted[sorted.size()/2], 1000 * sorted[p99], 1000 * sorted.back());
+  printf("\t%.1f frames/s, %.0f points/s\n", times.size() / total, total_points / total);
+}
@@ -0,0 +1,40 @@
+#ifndef __REPLAY_HPP
+#define __REPLAY_HPP
+
+#include <vector>
+using namespace std;
+
+
+
+/* A camera path, for benchmarking rendering. The file has one
+   keyframe per line:
+
+     frames px py pz tx ty tz [keys]
+
+   The camera moves linearly from the pose (pos[] and theta[] in
+   lidarview) of the previous keyframe to pos = (px,py,pz) and theta
+   = (tx,ty,tz) over the given number of frames. The keys, if any, are
+   pressed at the start of the segment, e.g. "c" to change the colormap
+   or "3" to filter the last returns. Lines starting with # are
+   comments.
+*/
+const int REPLAY_MAX_KEYS = 32;
+
+typedef struct _replay_frame {
+  float pos[3], theta[3];
+  char keys[REPLAY_MAX_KEYS];  //pressed before this frame
+} replay_frame;
+
+
+/* reads the camera path from file fname and expands it into one
+   replay_frame per frame */
+void read_camera_path(const char* fname, vector<replay_frame>* frames);
+
+
+/* prints min/median/p99 frame times, frames per second and points
+   per second, given the time of each frame (in seconds) and the
+   number of points it drew */
+void print_replay_report(const vector<double> & times, const vector<long> & points);
+
+
+#endif
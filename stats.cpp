@@ -0,0 +1,213 @@
+#include "stats.hpp"
+#include "parallel.hpp"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <atomic>
+#include <vector>
+using namespace std;
+
+
+//largest number of cells in the grid used for the covered area
+const long MAX_COVER_CELLS = 1 << 24;
+
+
+//the counters accumulated by one chunk of points
+typedef struct _stats_acc {
+  long code[STATS_NB_CODES];
+  long mycode[STATS_NB_CODES];
+  long returns[STATS_MAX_RETURNS][STATS_MAX_RETURNS];
+  long zhist[STATS_NB_BINS];
+  long haghist[STATS_NB_BINS];
+} stats_acc;
+
+
+//returns the bin of value v in a histogram over [lo, hi]
+static inline int bin(double v, double lo, double hi) {
+  if (hi <= lo) return 0;
+  int b = (int)(STATS_NB_BINS * (v - lo) / (hi - lo));
+  if (b < 0) b = 0;
+  if (b >= STATS_NB_BINS) b = STATS_NB_BINS - 1;
+  return b;
+}
+
+static inline int clamp_return(int r) {
+  if (r < 0) return 0;
+  return (r < STATS_MAX_RETURNS) ? r: STATS_MAX_RETURNS - 1;
+}
+
+static inline int clamp_code(int c) {
+  if (c < 0) return 0;
+  return (c < STATS_NB_CODES) ? c: STATS_NB_CODES - 1;
+}
+
+
+
+void compute_stats(const lidar_point_cloud & points, lidar_stats* s) {
+
+  assert(s);
+  memset(s, 0, sizeof(lidar_stats));
+  long n = points.data.size();
+  s->n = n;
+  if (n == 0) return;
+
+  bool has_hag = ((long)points.hag.size() == n);
+  s->zmin = points.minz;
+  s->zmax = points.maxz;
+  //the hag range is not known before the pass; heights above ground
+  //are at most the z range, and the ones below 0 go in the first bin
+  if (has_hag) {
+    s->hagmin = 0;
+    s->hagmax = points.maxz - points.minz;
+  }
+
+  //grid of unit cells (larger if too many) to measure the area
+  //actually covered by points
+  double dx = points.maxx - points.minx, dy = points.maxy - points.miny;
+  double cellsize = 1;
+  while ((dx/cellsize + 1) * (dy/cellsize + 1) > MAX_COVER_CELLS) cellsize *= 2;
+  int ncols = (int)(dx / cellsize) + 1, nrows = (int)(dy / cellsize) + 1;
+  vector< atomic<unsigned char> > covered((long)nrows * ncols);
+  parallel_for(covered.size(), [&](long b, long e) {
+      for (long i = b; i < e; i++) covered[i].store(0, memory_order_relaxed);
+    });
+
+  //one pass over the points, with the counters of each chunk kept
+  //separately and merged at the end
+  int nchunks = nb_threads();
+  vector<stats_acc> acc(nchunks);
+  memset(&acc[0], 0, nchunks * sizeof(stats_acc));
+  parallel_for_chunks(n, nchunks, [&](int c, long b, long e) {
+      stats_acc & a = acc[c];
+      for (long i = b; i < e; i++) {
+	const lidar_point & p = points.data[i];
+	a.code[clamp_code(p.code)]++;
+	a.mycode[clamp_code(p.mycode)]++;
+	a.returns[clamp_return(p.nb_of_returns)][clamp_return(p.return_number)]++;
+	a.zhist[bin(p.z, s->zmin, s->zmax)]++;
+	if (has_hag) a.haghist[bin(points.hag[i], s->hagmin, s->hagmax)]++;
+	long cell = (long)((p.y - points.miny) / cellsize) * ncols + (long)((p.x - points.minx) / cellsize);
+	covered[cell].store(1, memory_order_relaxed);
+      }
+    });
+
+  for (int c = 0; c < nchunks; c++) {
+    for (int k = 0; k < STATS_NB_CODES; k++) {
+      s->code[k] += acc[c].code[k];
+      s->mycode[k] += acc[c].mycode[k];
+    }
+    for (int k = 0; k < STATS_MAX_RETURNS; k++)
+      for (int r = 0; r < STATS_MAX_RETURNS; r++)
+	s->returns[k][r] += acc[c].returns[k][r];
+    for (int k = 0; k < STATS_NB_BINS; k++) {
+      s->zhist[k] += acc[c].zhist[k];
+      s->haghist[k] += acc[c].haghist[k];
+    }
+  }
+
+  long ncovered = 0;
+  for (size_t i = 0; i < covered.size(); i++) ncovered += covered[i].load(memory_order_relaxed);
+  s->area = dx * dy;
+  s->density = (s->area > 0) ? n / s->area: 0;
+  s->cellsize = cellsize;
+  s->covered_area = ncovered * cellsize * cellsize;
+  s->covered_density = n / s->covered_area;
+}
+
+
+
+//prints a histogram over [lo, hi] on one line
+static void print_histogram(const char* name, const long* h, double lo, double hi) {
+  printf("\t%s histogram, %d bins over [%.2f, %.2f]:", name, STATS_NB_BINS, lo, hi);
+  for (int k = 0; k < STATS_NB_BINS; k++) printf(" %ld", h[k]);
+  printf("\n");
+}
+
+//prints the non-zero counts of a per-code array
+static void print_codes(const char* name, const long* count, long n) {
+  printf("\t%s:", name);
+  for (int k = 0; k < STATS_NB_CODES; k++)
+    if (count[k] > 0) printf(" %d: %ld (%.1f%%)", k, count[k], 100.0 * count[k] / n);
+  printf("\n");
+}
+
+
+void print_stats(const lidar_stats & s) {
+
+  printf("statistics: %ld points\n", s.n);
+  if (s.n == 0) return;
+  printf("\tdensity: %.2f points per unit^2 over the bounding box (area %.1f), "
+	 "%.2f over the covered area (%.1f, cells of %.0f)\n",
+	 s.density, s.area, s.covered_density, s.covered_area, s.cellsize);
+  print_codes("code", s.code, s.n);
+  print_codes("mycode", s.mycode, s.n);
+  printf("\treturns:");
+  for (int k = 0; k < STATS_MAX_RETURNS; k++)
+    for (int r = 0; r < STATS_MAX_RETURNS; r++)
+      if (s.returns[k][r] > 0) printf(" %d of %d: %ld", r, k, s.returns[k][r]);
+  printf("\n");
+  print_histogram("z", s.zhist, s.zmin, s.zmax);
+  if (s.hagmax > s.hagmin) print_histogram("hag", s.haghist, s.hagmin, s.hagmax);
+}
+
+
+
+//writes the non-zero counts of a per-code array as a JSON object
+static void json_codes(FILE* f, const char* name, const long* count) {
+  fprintf(f, "  \"%s\": {", name);
+  const char* sep = "";
+  for (int k = 0; k < STATS_NB_CODES; k++) {
+    if (count[k] == 0) continue;
+    fprintf(f, "%s\"%d\": %ld", sep, k, count[k]);
+    sep = ", ";
+  }
+  fprintf(f, "},\n");
+}
+
+//writes a histogram as a JSON object
+static void json_histogram(FILE* f, const char* name, const long* h, double lo, double hi, const char* end) {
+  fprintf(f, "  \"%s\": {\"min\": %f, \"max\": %f, \"counts\": [", name, lo, hi);
+  for (int k = 0; k < STATS_NB_BINS; k++) fprintf(f, "%s%ld", k ? ", ": "", h[k]);
+  fprintf(f, "]}%s\n", end);
+}
+
+
+void write_stats_json(const lidar_stats & s, const char* fname) {
+
+  FILE* f = fopen(fname, "w");
+  if (!f) {
+    printf("write_stats_json: cannot open file %s\n", fname);
+    exit(1);
+  }
+
+  fprintf(f, "{\n");
+  fprintf(f, "  \"points\": %ld,\n", s.n);
+  fprintf(f, "  \"area\": %f,\n", s.area);
+  fprintf(f, "  \"density\": %f,\n", s.density);
+  fprintf(f, "  \"covered_cellsize\": %f,\n", s.cellsize);
+  fprintf(f, "  \"covered_area\": %f,\n", s.covered_area);
+  fprintf(f, "  \"covered_density\": %f,\n", s.covered_density);
+  json_codes(f, "code", s.code);
+  json_codes(f, "mycode", s.mycode);
+
+  //"return of returns" pairs, e.g. "1/2"
+  fprintf(f, "  \"returns\": {");
+  const char* sep = "";
+  for (int k = 0; k < STATS_MAX_RETURNS; k++)
+    for (int r = 0; r < STATS_MAX_RETURNS; r++) {
+      if (s.returns[k][r] == 0) continue;
+      fprintf(f, "%s\"%d/%d\": %ld", sep, r, k, s.returns[k][r]);
+      sep = ", ";
+    }
+  fprintf(f, "},\n");
+
+  json_histogram(f, "z_histogram", s.zhist, s.zmin, s.zmax, ",");
+  json_histogram(f, "hag_histogram", s.haghist, s.hagmin, s.hagmax, "");
+  fprintf(f, "}\n");
+  fclose(f);
+  printf("statistics written to %s\n", fname);
+}
@@ -0,0 +1,58 @@
+#ifndef __STATS_HPP
+#define __STATS_HPP
+
+#include "lidar.hpp"
+
+
+
+const int STATS_NB_CODES = 256;
+
+//return numbers and numbers of returns >= STATS_MAX_RETURNS are
+//counted with STATS_MAX_RETURNS-1
+const int STATS_MAX_RETURNS = 16;
+
+//number of bins of the z and hag histograms
+const int STATS_NB_BINS = 20;
+
+
+/* statistics of a point cloud, for quality control */
+typedef struct _lidar_stats {
+
+  long n;
+
+  //number of points with each code and mycode
+  long code[STATS_NB_CODES];
+  long mycode[STATS_NB_CODES];
+
+  //returns[k][r] is the number of points that are return r of k
+  long returns[STATS_MAX_RETURNS][STATS_MAX_RETURNS];
+
+  //histogram of z over [zmin, zmax]
+  double zmin, zmax;
+  long zhist[STATS_NB_BINS];
+
+  //histogram of the height above ground over [hagmin, hagmax];
+  //hagmin=hagmax=0 if the cloud has no hag
+  double hagmin, hagmax;
+  long haghist[STATS_NB_BINS];
+
+  //points per square unit, over the bounding box and over the
+  //cells of a grid of side cellsize that contain points
+  double area, density;
+  double cellsize, covered_area, covered_density;
+
+} lidar_stats;
+
+
+/* computes the statistics of points in one pass over the points,
+   in parallel */
+void compute_stats(const lidar_point_cloud & points, lidar_stats* s);
+
+//prints s on stdout
+void print_stats(const lidar_stats & s);
+
+//writes s to file fname as JSON
+void write_stats_json(const lidar_stats & s, const char* fname);
+
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef __TIMER_HPP
+#define __TIMER_HPP
+
+#include <chrono>
+
+
+//returns the wall clock time in seconds, for timing stages
+static inline double get_time() {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+#endif
@@ -0,0 +1,567 @@
+#include "tin.hpp"
+#include "hag.hpp"
+#include "parallel.hpp"
+#include "timer.hpp"
+
+#include <assert.h>
+#include <stdio.h>
+#include <math.h>
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+using namespace std;
+
+
+//the number of tiles is chosen so that tiles have between
+//TIN_MIN_TILE_POINTS and TIN_TILE_POINTS points, and there are at
+//least 4 tiles per thread if possible
+const long TIN_TILE_POINTS = 1 << 18;
+const long TIN_MIN_TILE_POINTS = 1 << 16;
+
+//the initial margin around a tile, in mean distances between points
+const double TIN_MARGIN = 16;
+
+//the vertices are bucketed for the tiles in cells of 1/TIN_SUBCELLS
+//of a tile
+const int TIN_SUBCELLS = 8;
+
+//steps of a walk before giving up and scanning all the triangles
+const int TIN_MAX_WALK = 100000;
+
+
+
+/* ************************************************************ */
+/* Bowyer-Watson triangulation of the points of a tile */
+
+//triangle with vertices v[0], v[1], v[2] counterclockwise; n[i] is
+//the triangle across the edge opposite v[i], -1 if none. A deleted
+//triangle has v[0] = -1
+typedef struct _dt_triangle {
+  int v[3];
+  int n[3];
+} dt_triangle;
+
+typedef struct _delaunay {
+  //the vertices; the last 3 are the corners of the super triangle
+  vector<double> x, y;
+  vector<dt_triangle> t;
+  //deleted triangles, to reuse
+  vector<int> free;
+  //mark[t] == stamp if triangle t is in the current cavity
+  vector<int> mark;
+  int stamp;
+  //where the next walk starts
+  int last;
+} delaunay;
+
+//an edge a->b of the border of a cavity, with the triangle outside it
+typedef struct _dt_edge {
+  int a, b, out, tri;
+} dt_edge;
+
+
+//> 0 if a, b, c are counterclockwise
+static inline double orient(const delaunay & d, int a, int b, double cx, double cy) {
+  return (d.x[b] - d.x[a]) * (cy - d.y[a]) - (d.y[b] - d.y[a]) * (cx - d.x[a]);
+}
+
+//> 0 if (px,py) is inside the circumcircle of the counterclockwise
+//triangle t
+static inline double incircle(const delaunay & d, const dt_triangle & t, double px, double py) {
+  double ax = d.x[t.v[0]] - px, ay = d.y[t.v[0]] - py;
+  double bx = d.x[t.v[1]] - px, by = d.y[t.v[1]] - py;
+  double cx = d.x[t.v[2]] - px, cy = d.y[t.v[2]] - py;
+  return (ax*ax + ay*ay) * (bx*cy - cx*by) - (bx*bx + by*by) * (ax*cy - cx*ay)
+    + (cx*cx + cy*cy) * (ax*by - bx*ay);
+}
+
+
+static int new_triangle(delaunay & d) {
+  if (!d.free.empty()) {
+    int t = d.free.back();
+    d.free.pop_back();
+    return t;
+  }
+  d.t.push_back(dt_triangle());
+  d.mark.push_back(0);
+  return d.t.size() - 1;
+}
+
+
+/* returns a triangle that contains (px,py): walks from d.last towards
+   the point, starting with a different edge at every step so that it
+   can't cycle; scans all the triangles if the walk is too long */
+static int locate(const delaunay & d, double px, double py) {
+
+  int t = d.last;
+  for (int step = 0; step < TIN_MAX_WALK; step++) {
+    const dt_triangle & tr = d.t[t];
+    int next = -1;
+    for (int k = 0; k < 3 && next < 0; k++) {
+      int i = (step + k) % 3;
+      if (orient(d, tr.v[(i+1)%3], tr.v[(i+2)%3], px, py) < 0) next = tr.n[i];
+    }
+    if (next < 0) return t;
+    t = next;
+  }
+  for (t = 0; t < (int)d.t.size(); t++) {
+    const dt_triangle & tr = d.t[t];
+    if (tr.v[0] < 0) continue;
+    if (orient(d, tr.v[1], tr.v[2], px, py) >= 0 && orient(d, tr.v[2], tr.v[0], px, py) >= 0 &&
+	orient(d, tr.v[0], tr.v[1], px, py) >= 0)
+      return t;
+  }
+  return d.last;
+}
+
+
+/* inserts vertex p: removes the triangles whose circumcircle contains
+   it (the cavity) and connects p to the border of the cavity. The
+   cavity is grown until p sees all its border edges, so that rounding
+   errors in incircle() can't make overlapping triangles. Vertices
+   equal to a vertex already inserted are skipped. */
+static void insert_vertex(delaunay & d, int p, vector<int> & cavity, vector<dt_edge> & border) {
+
+  double px = d.x[p], py = d.y[p];
+  int t0 = locate(d, px, py);
+  for (int i = 0; i < 3; i++) {
+    int v = d.t[t0].v[i];
+    if (d.x[v] == px && d.y[v] == py) return;
+  }
+
+  d.stamp++;
+  cavity.clear();
+  cavity.push_back(t0);
+  d.mark[t0] = d.stamp;
+  for (size_t k = 0; k < cavity.size(); k++) {
+    const dt_triangle & tr = d.t[cavity[k]];
+    for (int i = 0; i < 3; i++) {
+      int nb = tr.n[i];
+      if (nb < 0 || d.mark[nb] == d.stamp) continue;
+      if (incircle(d, d.t[nb], px, py) > 0) {
+	d.mark[nb] = d.stamp;
+	cavity.push_back(nb);
+      }
+    }
+  }
+  int grown = 1;
+  while (grown) {
+    grown = 0;
+    for (size_t k = 0; k < cavity.size(); k++) {
+      const dt_triangle & tr = d.t[cavity[k]];
+      for (int i = 0; i < 3; i++) {
+	int nb = tr.n[i];
+	if (nb < 0 || d.mark[nb] == d.stamp) continue;
+	if (orient(d, tr.v[(i+1)%3], tr.v[(i+2)%3], px, py) <= 0) {
+	  d.mark[nb] = d.stamp;
+	  cavity.push_back(nb);
+	  grown = 1;
+	}
+      }
+    }
+  }
+
+  border.clear();
+  for (size_t k = 0; k < cavity.size(); k++) {
+    const dt_triangle & tr = d.t[cavity[k]];
+    for (int i = 0; i < 3; i++) {
+      int nb = tr.n[i];
+      if (nb >= 0 && d.mark[nb] == d.stamp) continue;
+      dt_edge e = {tr.v[(i+1)%3], tr.v[(i+2)%3], nb, -1};
+      border.push_back(e);
+    }
+  }
+  for (size_t k = 0; k < cavity.size(); k++) {
+    d.t[cavity[k]].v[0] = -1;
+    d.free.push_back(cavity[k]);
+  }
+
+  //triangle (a, b, p) for every border edge a->b
+  for (size_t k = 0; k < border.size(); k++) {
+    dt_edge & e = border[k];
+    e.tri = new_triangle(d);
+    dt_triangle & tr = d.t[e.tri];
+    tr.v[0] = e.a; tr.v[1] = e.b; tr.v[2] = p;
+    tr.n[2] = e.out;
+    if (e.out >= 0) {
+      dt_triangle & o = d.t[e.out];
+      for (int i = 0; i < 3; i++)
+	if (o.v[(i+1)%3] == e.b && o.v[(i+2)%3] == e.a) o.n[i] = e.tri;
+    }
+  }
+  //the new triangles around p: across b->p is the one whose border
+  //edge starts at b, across p->a the one whose border edge ends at a
+  for (size_t k = 0; k < border.size(); k++) {
+    dt_triangle & tr = d.t[border[k].tri];
+    for (size_t j = 0; j < border.size(); j++) {
+      if (border[j].a == border[k].b) tr.n[0] = border[j].tri;
+      if (border[j].b == border[k].a) tr.n[1] = border[j].tri;
+    }
+  }
+  d.last = border[0].tri;
+}
+
+
+/* triangulates the points (x[i], y[i]), i < m, which are in the box
+   [0,w] x [0,h]. Returns the triangles, 3 vertices each. */
+static void triangulate(const vector<double> & x, const vector<double> & y, double w, double h,
+			vector<int> & result) {
+
+  int m = x.size();
+  result.clear();
+  if (m < 3) return;
+
+  delaunay d;
+  d.x = x;
+  d.y = y;
+  double side = (w > h ? w: h) + 1;
+  d.x.push_back(-20 * side); d.y.push_back(-20 * side);
+  d.x.push_back(20 * side);  d.y.push_back(-20 * side);
+  d.x.push_back(w / 2);      d.y.push_back(20 * side);
+  dt_triangle super = {{m, m+1, m+2}, {-1, -1, -1}};
+  d.t.push_back(super);
+  d.mark.push_back(0);
+  d.stamp = 0;
+  d.last = 0;
+
+  //insert in Morton order, so that every walk is short
+  vector< pair<unsigned int, int> > order(m);
+  for (int i = 0; i < m; i++) {
+    unsigned int qx = (unsigned int)(x[i] / side * 65535), qy = (unsigned int)(y[i] / side * 65535);
+    unsigned int key = 0;
+    for (int b = 0; b < 16; b++) key |= (qx >> b & 1) << (2*b) | (qy >> b & 1) << (2*b + 1);
+    order[i] = make_pair(key, i);
+  }
+  sort(order.begin(), order.end());
+
+  vector<int> cavity;
+  vector<dt_edge> border;
+  for (int i = 0; i < m; i++) insert_vertex(d, order[i].second, cavity, border);
+
+  for (size_t t = 0; t < d.t.size(); t++) {
+    const dt_triangle & tr = d.t[t];
+    if (tr.v[0] < 0 || tr.v[0] >= m || tr.v[1] >= m || tr.v[2] >= m) continue;
+    result.push_back(tr.v[0]);
+    result.push_back(tr.v[1]);
+    result.push_back(tr.v[2]);
+  }
+}
+
+
+
+/* ************************************************************ */
+/* tiles */
+
+//a rectangle: x in [x0, x1], y in [y0, y1]
+typedef struct _tin_rect {
+  double x0, y0, x1, y1;
+} tin_rect;
+
+
+//squared distance from (x,y) to rectangle r
+static inline double rect_dist2(const tin_rect & r, double x, double y) {
+  double dx = (x < r.x0) ? r.x0 - x: (x > r.x1) ? x - r.x1: 0;
+  double dy = (y < r.y0) ? r.y0 - y: (y > r.y1) ? y - r.y1: 0;
+  return dx*dx + dy*dy;
+}
+
+
+/* computes the center (ux,uy) and the squared radius r2 of the
+   circumcircle of (a,b,c); returns 0 if they are collinear */
+static int circumcircle(double ax, double ay, double bx, double by, double cx, double cy,
+			double* ux, double* uy, double* r2) {
+  bx -= ax; by -= ay; cx -= ax; cy -= ay;
+  double den = 2 * (bx*cy - by*cx);
+  if (den == 0) return 0;
+  double x = (cy*(bx*bx + by*by) - by*(cx*cx + cy*cy)) / den;
+  double y = (bx*(cx*cx + cy*cy) - cx*(bx*bx + by*by)) / den;
+  *r2 = x*x + y*y;
+  *ux = x + ax;
+  *uy = y + ay;
+  return 1;
+}
+
+
+/* returns 1 if the circle of center (ux,uy) and squared radius r2
+   doesn't contain any part of box outside of rect, i.e. no point of
+   box outside rect can be in it */
+static int circle_inside(double ux, double uy, double r2, const tin_rect & box,
+			 const tin_rect & rect) {
+
+  r2 *= 1 + 1e-9;
+  //box minus rect is covered by at most 4 strips
+  tin_rect strip[4] = {
+    {box.x0, box.y0, rect.x0, box.y1}, {rect.x1, box.y0, box.x1, box.y1},
+    {box.x0, box.y0, box.x1, rect.y0}, {box.x0, rect.y1, box.x1, box.y1}};
+  int nonempty[4] = {rect.x0 > box.x0, rect.x1 < box.x1, rect.y0 > box.y0, rect.y1 < box.y1};
+  for (int s = 0; s < 4; s++)
+    if (nonempty[s] && rect_dist2(strip[s], ux, uy) < r2) return 0;
+  return 1;
+}
+
+
+
+long tin_build(const lidar_point_cloud & points, int use_code, double tolerance,
+	       lidar_tin* tin) {
+
+  double t = get_time();
+  long n = points.data.size();
+  double minx = points.minx, miny = points.miny;
+  double dx = points.maxx - minx, dy = points.maxy - miny;
+  auto is_ground = [&](long i) {
+    return (use_code ? points.data[i].code: points.data[i].mycode) == 2;
+  };
+
+  //the vertices: all the ground points, or the lowest in every
+  //tolerance cell
+  vector<int> & vpoint = tin->point;
+  vpoint.clear();
+  if (tolerance > 0) {
+    int ncols = (int)(dx / tolerance) + 1, nrows = (int)(dy / tolerance) + 1;
+    while ((double)nrows * ncols > 4.0 * n + 1024) {
+      tolerance *= 2;
+      ncols = (int)(dx / tolerance) + 1;
+      nrows = (int)(dy / tolerance) + 1;
+    }
+    vector< atomic<int> > low((long)nrows * ncols);
+    parallel_for(low.size(), [&](long b, long e) {
+	for (long i = b; i < e; i++) low[i].store(-1, memory_order_relaxed);
+      });
+    parallel_for(n, [&](long b, long e) {
+	for (long i = b; i < e; i++) {
+	  if (!is_ground(i)) continue;
+	  const lidar_point & p = points.data[i];
+	  atomic<int> & cell = low[(long)((p.y - miny) / tolerance) * ncols + (long)((p.x - minx) / tolerance)];
+	  int old = cell.load(memory_order_relaxed);
+	  while ((old < 0 || p.z < points.data[old].z ||
+		  (p.z == points.data[old].z && i < old)) &&
+		 !cell.compare_exchange_weak(old, (int)i, memory_order_relaxed))
+	    ;
+	}
+      });
+    for (size_t c = 0; c < low.size(); c++)
+      if (low[c] >= 0) vpoint.push_back(low[c]);
+    sort(vpoint.begin(), vpoint.end());
+  } else {
+    for (long i = 0; i < n; i++)
+      if (is_ground(i)) vpoint.push_back(i);
+  }
+  int nv = vpoint.size();
+  tin->xyz.resize(3 * (long)nv);
+  parallel_for(nv, [&](long b, long e) {
+      for (long v = b; v < e; v++) {
+	const lidar_point & p = points.data[vpoint[v]];
+	tin->xyz[3*v] = p.x;
+	tin->xyz[3*v+1] = p.y;
+	tin->xyz[3*v+2] = p.z;
+      }
+    });
+
+  //the tiles
+  long ntiles = nv / TIN_TILE_POINTS;
+  if (ntiles < 4 * nb_threads()) ntiles = 4 * nb_threads();
+  if (ntiles > nv / TIN_MIN_TILE_POINTS) ntiles = nv / TIN_MIN_TILE_POINTS;
+  if (ntiles < 1) ntiles = 1;
+  int ntx = (int)(sqrt(ntiles * (dx + 1) / (dy + 1)) + 0.5);
+  if (ntx < 1) ntx = 1;
+  if (ntx > ntiles) ntx = ntiles;
+  int nty = ntiles / ntx;
+  double tw = (dx > 0 ? dx: 1) / ntx, th = (dy > 0 ? dy: 1) / nty;
+  tin_rect box = {0, 0, dx, dy};
+
+  //the vertices, bucketed in TIN_SUBCELLS x TIN_SUBCELLS cells per
+  //tile, to find the ones in a tile and its margin
+  int bcols = ntx * TIN_SUBCELLS, brows = nty * TIN_SUBCELLS;
+  double bw = tw / TIN_SUBCELLS, bh = th / TIN_SUBCELLS;
+  vector<int> bstart((long)brows * bcols + 1, 0), bvertex(nv);
+  auto bucket = [&](long v) {
+    int c = (int)((tin->xyz[3*v] - minx) / bw), r = (int)((tin->xyz[3*v+1] - miny) / bh);
+    if (c >= bcols) c = bcols - 1;
+    if (r >= brows) r = brows - 1;
+    return (long)r * bcols + c;
+  };
+  for (int v = 0; v < nv; v++) bstart[bucket(v) + 1]++;
+  for (long c = 0; c < (long)brows * bcols; c++) bstart[c+1] += bstart[c];
+  {
+    vector<int> next(bstart.begin(), bstart.end() - 1);
+    for (int v = 0; v < nv; v++) bvertex[next[bucket(v)]++] = v;
+  }
+
+  double spacing = (nv > 0) ? sqrt((dx * dy + 1) / nv): 1;
+  vector< vector<int> > tile_tri(ntx * nty);
+  atomic<long> redone(0);
+  parallel_for_chunks(ntx * nty, ntx * nty, [&](int tile, long b, long e) {
+      int ti = tile % ntx, tj = tile / ntx;
+      tin_rect core = {ti * tw, tj * th, (ti + 1) * tw, (tj + 1) * th};
+      vector<int> local;
+      vector<double> x, y;
+      vector<int> tri;
+      for (double margin = TIN_MARGIN * spacing; ; margin *= 2) {
+
+	tin_rect rect = {max(core.x0 - margin, box.x0), max(core.y0 - margin, box.y0),
+			 min(core.x1 + margin, box.x1), min(core.y1 + margin, box.y1)};
+	int whole = rect.x0 <= box.x0 && rect.y0 <= box.y0 && rect.x1 >= box.x1 && rect.y1 >= box.y1;
+
+	//the vertices in the tile and its margin, relative to its corner
+	local.clear(); x.clear(); y.clear();
+	int c0 = max(0, (int)(rect.x0 / bw)), c1 = min(bcols - 1, (int)(rect.x1 / bw));
+	int r0 = max(0, (int)(rect.y0 / bh)), r1 = min(brows - 1, (int)(rect.y1 / bh));
+	for (int r = r0; r <= r1; r++)
+	  for (int c = c0; c <= c1; c++)
+	    for (int s = bstart[(long)r * bcols + c]; s < bstart[(long)r * bcols + c + 1]; s++) {
+	      int v = bvertex[s];
+	      double vx = tin->xyz[3*v] - minx, vy = tin->xyz[3*v+1] - miny;
+	      if (vx < rect.x0 || vx > rect.x1 || vy < rect.y0 || vy > rect.y1) continue;
+	      local.push_back(v);
+	      x.push_back(vx - rect.x0);
+	      y.push_back(vy - rect.y0);
+	    }
+	triangulate(x, y, rect.x1 - rect.x0, rect.y1 - rect.y0, tri);
+
+	//keep the triangles with their centroid in the tile; all the
+	//triangles that reach into the tile must be final. Triangles
+	//with their circumcenter outside the bounding box are slivers
+	//along the convex hull, with huge circles that no margin
+	//contains; they are dropped
+	vector<int> & out = tile_tri[tile];
+	out.clear();
+	//the margin that the circles of the triangles that are not
+	//final need
+	double need = 0;
+	for (size_t k = 0; k < tri.size(); k += 3) {
+	  int a = tri[k], bb = tri[k+1], c = tri[k+2];
+	  double ax = x[a] + rect.x0, ay = y[a] + rect.y0;
+	  double bx = x[bb] + rect.x0, by = y[bb] + rect.y0;
+	  double cx = x[c] + rect.x0, cy = y[c] + rect.y0;
+	  if (min(ax, min(bx, cx)) > core.x1 || max(ax, max(bx, cx)) < core.x0 ||
+	      min(ay, min(by, cy)) > core.y1 || max(ay, max(by, cy)) < core.y0)
+	    continue;
+	  double ux, uy, r2;
+	  if (!circumcircle(ax, ay, bx, by, cx, cy, &ux, &uy, &r2) ||
+	      ux < box.x0 || ux > box.x1 || uy < box.y0 || uy > box.y1)
+	    continue;
+	  if (!whole && !circle_inside(ux, uy, r2, box, rect)) {
+	    double r = sqrt(r2);
+	    need = max(need, max(max(core.x0 - (ux - r), (ux + r) - core.x1),
+				 max(core.y0 - (uy - r), (uy + r) - core.y1)));
+	    continue;
+	  }
+	  int gi = min(ntx - 1, (int)((ax + bx + cx) / 3 / tw));
+	  int gj = min(nty - 1, (int)((ay + by + cy) / 3 / th));
+	  if (gi != ti || gj != tj || need > 0) continue;
+	  out.push_back(local[a]);
+	  out.push_back(local[bb]);
+	  out.push_back(local[c]);
+	}
+	if (need == 0 || whole) break;
+	redone++;
+	//the circles along the border of the tile and margin, where
+	//the points end, are huge and don't say much about the margin
+	//needed, so it grows by 2 to 8 times
+	margin = min(max(margin, need * 1.01 / 2), 4 * margin);
+      }
+    });
+
+  tin->tri.clear();
+  for (size_t k = 0; k < tile_tri.size(); k++)
+    tin->tri.insert(tin->tri.end(), tile_tri[k].begin(), tile_tri[k].end());
+  long ntri = tin->tri.size() / 3;
+
+  //the triangle buckets, with about 2 triangles per cell
+  tin->minx = minx;
+  tin->miny = miny;
+  tin->cellsize = (ntri > 0) ? sqrt((dx * dy + 1) / ntri) * 1.5: 1;
+  tin->ncols = (int)(dx / tin->cellsize) + 1;
+  tin->nrows = (int)(dy / tin->cellsize) + 1;
+  long ncells = (long)tin->nrows * tin->ncols;
+  vector< atomic<int> > count(ncells + 1);
+  parallel_for(ncells + 1, [&](long b, long e) {
+      for (long c = b; c < e; c++) count[c].store(0, memory_order_relaxed);
+    });
+  auto cells = [&](long k, int* c0, int* r0, int* c1, int* r1) {
+    const float* xyz = &tin->xyz[0];
+    const int* v = &tin->tri[3*k];
+    float x0 = min(xyz[3*v[0]], min(xyz[3*v[1]], xyz[3*v[2]]));
+    float x1 = max(xyz[3*v[0]], max(xyz[3*v[1]], xyz[3*v[2]]));
+    float y0 = min(xyz[3*v[0]+1], min(xyz[3*v[1]+1], xyz[3*v[2]+1]));
+    float y1 = max(xyz[3*v[0]+1], max(xyz[3*v[1]+1], xyz[3*v[2]+1]));
+    *c0 = (int)((x0 - minx) / tin->cellsize); *c1 = (int)((x1 - minx) / tin->cellsize);
+    *r0 = (int)((y0 - miny) / tin->cellsize); *r1 = (int)((y1 - miny) / tin->cellsize);
+  };
+  parallel_for(ntri, [&](long b, long e) {
+      int c0, r0, c1, r1;
+      for (long k = b; k < e; k++) {
+	cells(k, &c0, &r0, &c1, &r1);
+	for (int r = r0; r <= r1; r++)
+	  for (int c = c0; c <= c1; c++) count[(long)r * tin->ncols + c + 1]++;
+      }
+    });
+  tin->start.resize(ncells + 1);
+  tin->start[0] = 0;
+  for (long c = 0; c < ncells; c++) tin->start[c+1] = tin->start[c] + count[c+1];
+  tin->cell_tri.resize(tin->start[ncells]);
+  parallel_for(ncells, [&](long b, long e) {
+      for (long c = b; c < e; c++) count[c].store(tin->start[c], memory_order_relaxed);
+    });
+  parallel_for(ntri, [&](long b, long e) {
+      int c0, r0, c1, r1;
+      for (long k = b; k < e; k++) {
+	cells(k, &c0, &r0, &c1, &r1);
+	for (int r = r0; r <= r1; r++)
+	  for (int c = c0; c <= c1; c++) tin->cell_tri[count[(long)r * tin->ncols + c]++] = k;
+      }
+    });
+
+  printf("tin_build: %d vertices, %ld triangles, %d x %d tiles (%ld redone) in %.1f ms\n",
+	 nv, ntri, ntx, nty, (long)redone, 1000 * (get_time() - t));
+  return ntri;
+}
+
+
+
+float tin_interpolate(const lidar_tin & tin, double x, double y) {
+
+  int c = (int)floor((x - tin.minx) / tin.cellsize), r = (int)floor((y - tin.miny) / tin.cellsize);
+  if (c < 0 || r < 0 || c >= tin.ncols || r >= tin.nrows) return GRID_NODATA;
+  long cell = (long)r * tin.ncols + c;
+  const float* xyz = tin.xyz.empty() ? NULL: &tin.xyz[0];
+  for (int s = tin.start[cell]; s < tin.start[cell+1]; s++) {
+    const int* v = &tin.tri[3 * (long)tin.cell_tri[s]];
+    double ax = xyz[3*v[0]], ay = xyz[3*v[0]+1];
+    double bx = xyz[3*v[1]] - ax, by = xyz[3*v[1]+1] - ay;
+    double cx = xyz[3*v[2]] - ax, cy = xyz[3*v[2]+1] - ay;
+    double px = x - ax, py = y - ay;
+    double det = bx*cy - by*cx;
+    if (det == 0) continue;
+    //barycentric coordinates of p
+    double u = (px*cy - py*cx) / det, w = (bx*py - by*px) / det;
+    const double eps = -1e-9;
+    if (u < eps || w < eps || u + w > 1 - eps) continue;
+    return (1 - u - w) * xyz[3*v[0]+2] + u * xyz[3*v[1]+2] + w * xyz[3*v[2]+2];
+  }
+  return GRID_NODATA;
+}
+
+
+
+void compute_hag_from_tin(lidar_point_cloud & points, const lidar_tin & tin) {
+
+  double t = get_time();
+  long n = points.data.size();
+  points.hag.resize(n);
+  int nchunks = 4 * nb_threads();
+  vector<long> outside(nchunks, 0);
+  parallel_for_chunks(n, nchunks, [&](int c, long b, long e) {
+      for (long i = b; i < e; i++) {
+	const lidar_point & p = points.data[i];
+	float z = tin_interpolate(tin, p.x, p.y);
+	if (z == GRID_NODATA) outside[c]++;
+	else points.hag[i] = p.z - z;
+      }
+    });
+  long nout = 0;
+  for (int c = 0; c < nchunks; c++) nout += outside[c];
+  printf("compute_hag_from_tin: %ld points, %ld outside the TIN, in %.1f ms\n",
+	 n, nout, 1000 * (get_time() - t));
+}
@@ -0,0 +1,67 @@
+#ifndef __TIN_HPP
+#define __TIN_HPP
+
+#include "lidar.hpp"
+
+#include <vector>
+using namespace std;
+
+
+
+/* a triangulated irregular network: a Delaunay triangulation, in xy,
+   of the ground points of a cloud */
+typedef struct _lidar_tin {
+
+  //the vertices: x, y and z of vertex v are xyz[3*v], xyz[3*v+1] and
+  //xyz[3*v+2], and it is point point[v] of the cloud
+  vector<float> xyz;
+  vector<int> point;
+
+  //the triangles: the vertices of triangle t are tri[3*t], tri[3*t+1]
+  //and tri[3*t+2], counterclockwise
+  vector<int> tri;
+
+  //a grid of buckets over the triangles, to find the triangle under
+  //a point: the triangles whose bounding box overlaps cell (r,c) are
+  //cell_tri[start[r*ncols+c]] to cell_tri[start[r*ncols+c+1]-1]
+  double minx, miny, cellsize;
+  int nrows, ncols;
+  vector<int> start, cell_tri;
+
+} lidar_tin;
+
+
+/* builds the Delaunay triangulation of the ground points of points:
+   those with mycode == 2, or code == 2 if use_code. If tolerance > 0
+   the ground is simplified first: only the lowest ground point in
+   every tolerance x tolerance cell is kept.
+
+   The xy extent is split in tiles that are triangulated in parallel
+   (Bowyer-Watson, inserting the points in Morton order), each with
+   the points in a margin around it. A triangle is kept by the tile
+   that contains its centroid, and only if its circumcircle doesn't
+   reach the points outside the tile and margin, so it is also a
+   triangle of the triangulation of all the points. Tiles where that
+   doesn't hold for all their triangles are redone with a margin
+   twice as large. Triangles with their circumcenter outside the
+   bounding box of the cloud (slivers along the convex hull) are
+   dropped, so the boundary of the TIN is a little ragged.
+
+   Returns the number of triangles.
+*/
+long tin_build(const lidar_point_cloud & points, int use_code, double tolerance,
+	       lidar_tin* tin);
+
+
+/* returns the z of the TIN at (x,y), interpolated linearly in the
+   triangle that contains (x,y); returns GRID_NODATA (see hag.hpp) if
+   (x,y) is outside the TIN */
+float tin_interpolate(const lidar_tin & tin, double x, double y);
+
+
+/* sets points.hag to the height of the points above the TIN; points
+   outside the TIN keep their height */
+void compute_hag_from_tin(lidar_point_cloud & points, const lidar_tin & tin);
+
+
+#endif
@@ -0,0 +1,179 @@
+#include "voxel.hpp"
+#include "parallel.hpp"
+
+#include <assert.h>
+#include <math.h>
+
+#include <atomic>
+#include <vector>
+using namespace std;
+
+
+//average number of points per column of voxels, when the size is
+//chosen automatically
+const int POINTS_PER_VOXEL_COLUMN = 16;
+
+
+void voxel_index_build(const lidar_point_cloud & points, double size, voxel_index* vi) {
+
+  assert(vi);
+  long n = points.data.size();
+  double dx = points.maxx - points.minx;
+  double dy = points.maxy - points.miny;
+  double dz = points.maxz - points.minz;
+
+  //lidar points lie mostly on a surface, so size the voxels on the xy
+  //area; then make them bigger if there would be many more voxels
+  //than points
+  if (size <= 0) {
+    size = sqrt(dx * dy * POINTS_PER_VOXEL_COLUMN / (n > 0 ? n: 1));
+    if (size <= 0) size = (dz > 0) ? dz: 1;
+    while ((dx/size + 1) * (dy/size + 1) * (dz/size + 1) > 4.0 * n + 1024) size *= 1.25;
+  }
+
+  vi->minx = points.minx;
+  vi->miny = points.miny;
+  vi->minz = points.minz;
+  vi->size = size;
+  vi->nx = (int)(dx / size) + 1;
+  vi->ny = (int)(dy / size) + 1;
+  vi->nz = (int)(dz / size) + 1;
+  long nvoxels = (long)vi->nx * vi->ny * vi->nz;
+
+  //the voxel of every point, and the number of points in every voxel
+  vector<int> voxel(n);
+  vector< atomic<int> > count(nvoxels);
+  parallel_for(nvoxels, [&](long b, long e) {
+      for (long v = b; v < e; v++) count[v].store(0, memory_order_relaxed);
+    });
+  parallel_for(n, [&](long b, long e) {
+      for (long i = b; i < e; i++) {
+	const lidar_point & p = points.data[i];
+	int x = (int)((p.x - vi->minx) / size);
+	int y = (int)((p.y - vi->miny) / size);
+	int z = (int)((p.z - vi->minz) / size);
+	voxel[i] = voxel_id(*vi, x, y, z);
+	count[voxel[i]].fetch_add(1, memory_order_relaxed);
+      }
+    });
+
+  //prefix sums give the start of each voxel; count[v] is then reused
+  //as the next free position in voxel v
+  vi->start.resize(nvoxels + 1);
+  vi->start[0] = 0;
+  for (long v = 0; v < nvoxels; v++) {
+    vi->start[v+1] = vi->start[v] + count[v].load(memory_order_relaxed);
+    count[v].store(vi->start[v], memory_order_relaxed);
+  }
+
+  vi->points.resize(n);
+  parallel_for(n, [&](long b, long e) {
+      for (long i = b; i < e; i++)
+	vi->points[count[voxel[i]].fetch_add(1, memory_order_relaxed)] = i;
+    });
+}
+
+
+
+long voxel_ray_query(const voxel_index & vi, const lidar_point_cloud & points,
+		     const double o[3], const double d[3], double tol, double zscale,
+		     bool (*accept)(long i)) {
+
+  //work in the space where z is stretched by zscale, so that the
+  //distances are the ones seen on the screen
+  double org[3] = {o[0], o[1], o[2] * zscale};
+  double dir[3] = {d[0], d[1], d[2] * zscale};
+  double len = sqrt(dir[0]*dir[0] + dir[1]*dir[1] + dir[2]*dir[2]);
+  if (len == 0) return -1;
+  for (int a = 0; a < 3; a++) dir[a] /= len;
+
+  double gmin[3] = {vi.minx, vi.miny, vi.minz * zscale};
+  double cell[3] = {vi.size, vi.size, vi.size * zscale};
+  int n[3] = {vi.nx, vi.ny, vi.nz};
+
+  //clip the ray to the grid
+  double tenter = 0, texit = HUGE_VAL;
+  for (int a = 0; a < 3; a++) {
+    double lo = gmin[a], hi = gmin[a] + n[a] * cell[a];
+    if (dir[a] == 0) {
+      if (org[a] < lo || org[a] > hi) return -1;
+      continue;
+    }
+    double t0 = (lo - org[a]) / dir[a], t1 = (hi - org[a]) / dir[a];
+    if (t0 > t1) { double t = t0; t0 = t1; t1 = t; }
+    if (t0 > tenter) tenter = t0;
+    if (t1 < texit) texit = t1;
+  }
+  if (tenter > texit) return -1;
+
+  //3D DDA: the voxel where the ray enters, and how far along the ray
+  //the next voxel boundary is on each axis
+  int v[3], step[3], reach[3];
+  double tmax[3], tdelta[3];
+  for (int a = 0; a < 3; a++) {
+    double c = (org[a] + tenter * dir[a] - gmin[a]) / cell[a];
+    v[a] = (int)floor(c);
+    if (v[a] < 0) v[a] = 0;
+    if (v[a] >= n[a]) v[a] = n[a] - 1;
+    //how many voxels around the ray are within distance tol
+    reach[a] = (int)ceil(tol / cell[a]);
+    if (dir[a] > 0) {
+      step[a] = 1;
+      tdelta[a] = cell[a] / dir[a];
+      tmax[a] = (gmin[a] + (v[a]+1) * cell[a] - org[a]) / dir[a];
+    } else if (dir[a] < 0) {
+      step[a] = -1;
+      tdelta[a] = -cell[a] / dir[a];
+      tmax[a] = (gmin[a] + v[a] * cell[a] - org[a]) / dir[a];
+    } else {
+      step[a] = 0;
+      tdelta[a] = tmax[a] = HUGE_VAL;
+    }
+  }
+
+  long best = -1;
+  double best_t = HUGE_VAL, tol2 = tol * tol;
+  double t = tenter;
+  while (1) {
+
+    //a point is found from the voxel that contains its projection on
+    //the ray, so once we are past the best point we are done
+    if (t > best_t) break;
+
+    //check the points in the voxels around v
+    for (int k = v[2] - reach[2]; k <= v[2] + reach[2]; k++) {
+      if (k < 0 || k >= n[2]) continue;
+      for (int j = v[1] - reach[1]; j <= v[1] + reach[1]; j++) {
+	if (j < 0 || j >= n[1]) continue;
+	for (int i = v[0] - reach[0]; i <= v[0] + reach[0]; i++) {
+	  if (i < 0 || i >= n[0]) continue;
+	  long id = voxel_id(vi, i, j, k);
+	  for (int s = vi.start[id]; s < vi.start[id+1]; s++) {
+	    long pi = vi.points[s];
+	    const lidar_point & p = points.data[pi];
+	    double w[3] = {p.x - org[0], p.y - org[1], p.z * zscale - org[2]};
+	    double tp = w[0]*dir[0] + w[1]*dir[1] + w[2]*dir[2];
+	    if (tp < 0 || tp >= best_t) continue;
+	    double dist2 = w[0]*w[0] + w[1]*w[1] + w[2]*w[2] - tp*tp;
+	    if (dist2 > tol2) continue;
+	    if (accept && !accept(pi)) continue;
+	    best = pi;
+	    best_t = tp;
+	  }
+	}
+      }
+    }
+
+    //step to the next voxel along the ray
+    int a = 0;
+    if (tmax[1] < tmax[a]) a = 1;
+    if (tmax[2] < tmax[a]) a = 2;
+    if (tmax[a] > texit) break;
+    t = tmax[a];
+    v[a] += step[a];
+    if (v[a] < 0 || v[a] >= n[a]) break;
+    tmax[a] += tdelta[a];
+  }
+
+  return best;
+}
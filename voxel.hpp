@@ -0,0 +1,55 @@
+#ifndef __VOXEL_HPP
+#define __VOXEL_HPP
+
+#include "lidar.hpp"
+
+#include <vector>
+using namespace std;
+
+
+
+/* a spatial index of a point cloud: the bounding box is divided into
+   nx x ny x nz cubic voxels, and the indices of the points in voxel
+   v are points[start[v]], ..., points[start[v+1]-1].
+
+   Voxel (i,j,k) is v = (k*ny + j)*nx + i.
+*/
+typedef struct _voxel_index {
+
+  double minx, miny, minz;
+  double size; //side of a voxel
+  int nx, ny, nz;
+
+  vector<int> start;
+  vector<int> points;
+
+} voxel_index;
+
+
+//returns the voxel (i,j,k)
+static inline long voxel_id(const voxel_index & vi, int i, int j, int k) {
+  return ((long)k*vi.ny + j)*vi.nx + i;
+}
+
+
+/* builds the index of the points. If size <= 0, the voxel size is
+   chosen so that a voxel has on average a few points */
+void voxel_index_build(const lidar_point_cloud & points, double size, voxel_index* vi);
+
+
+/* casts the ray o + t*d, t>=0, through the index and returns the
+   point closest to o along the ray, among the points at distance <=
+   tol from the ray for which accept(i) is true (all points if accept
+   is NULL). Distances are measured with z multiplied by zscale, which
+   is how the viewer stretches heights. Returns -1 if there is no such
+   point.
+
+   The query walks the voxels along the ray front to back and stops at
+   the first hit, so it only looks at the points near the ray.
+*/
+long voxel_ray_query(const voxel_index & vi, const lidar_point_cloud & points,
+		     const double o[3], const double d[3], double tol, double zscale,
+		     bool (*accept)(long i));
+
+
+#endif
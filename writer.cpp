@@ -0,0 +1,297 @@
+#include "writer.hpp"
+#include "parallel.hpp"
+#include "timer.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+using namespace std;
+
+
+//points encoded together, in one buffer
+const long WRITE_CHUNK = 16384;
+
+//LAS 1.2, point format 0, or 1 (format 0 and the gps time) when the
+//points have a gps time; the record size by format
+const int LAS_HEADER_SIZE = 227;
+const int LAS_RECORD_SIZE[2] = {20, 28};
+const double LAS_SCALE = 0.001;
+
+//offsets in the LAS header of the fields patched at the end
+const int LAS_NB_POINTS_OFFSET = 107;
+
+//longest line of the text format
+const int TXT_MAX_LINE = 128;
+
+
+//the encoded points of a chunk and what the LAS header needs to know
+//about them
+typedef struct _write_chunk {
+  vector<char> buf;
+  long n;
+  unsigned int by_return[5];
+  double minx, maxx, miny, maxy, minz, maxz;
+} write_chunk;
+
+
+
+//copies the size bytes of v at b, and moves b past them. LAS is
+//little endian, like the machines we run on.
+static inline void put(char* & b, const void* v, int size) {
+  memcpy(b, v, size);
+  b += size;
+}
+
+
+//writes v with 3 decimals at b, and moves b past it; much faster than
+//printf("%.3f")
+static inline void put_fixed3(char* & b, double v) {
+  long long m = llround(v * 1000);
+  if (m < 0) {
+    *b++ = '-';
+    m = -m;
+  }
+  char digits[24];
+  int nd = 0;
+  do {
+    digits[nd++] = '0' + m % 10;
+    m /= 10;
+  } while (nd < 4 || m > 0);
+  while (nd > 3) *b++ = digits[--nd];
+  *b++ = '.';
+  while (nd > 0) *b++ = digits[--nd];
+}
+
+
+static int ends_with(const char* s, const char* suffix) {
+  size_t n = strlen(s), m = strlen(suffix);
+  return n >= m && strcasecmp(s + n - m, suffix) == 0;
+}
+
+
+//the LAS header, with 0 points; the counts and the bounding box are
+//filled in at the end
+static void las_header(int format, const double offset[3], char* h) {
+
+  memset(h, 0, LAS_HEADER_SIZE);
+  char* b = h;
+  put(b, "LASF", 4);
+  b += 2 + 2 + 16;  //file source id, global encoding, guid
+  unsigned char version[2] = {1, 2};
+  put(b, version, 2);
+  strncpy(b, "lidarview classify", 32);   b += 32;
+  strncpy(b, "lidarview", 32);   b += 32;
+  b += 2 + 2;  //creation day and year
+  unsigned short header_size = LAS_HEADER_SIZE;
+  put(b, &header_size, 2);
+  unsigned int data_offset = LAS_HEADER_SIZE;
+  put(b, &data_offset, 4);
+  b += 4;  //no variable length records
+  unsigned char point_format = format;
+  put(b, &point_format, 1);
+  unsigned short record_size = LAS_RECORD_SIZE[format];
+  put(b, &record_size, 2);
+  b += 4 + 5*4;  //number of points, by return
+  double scale[3] = {LAS_SCALE, LAS_SCALE, LAS_SCALE};
+  put(b, scale, 24);
+  put(b, offset, 24);
+}
+
+
+//encodes point i as a LAS point record of the format at b, with its
+//intensity and point source id if they were read
+static inline void las_record(const lidar_point_cloud & points, long i, int format,
+			      const double offset[3], char* & b) {
+  const lidar_point & p = points.data[i];
+  int xyz[3] = {(int)lround((p.x - offset[0]) / LAS_SCALE),
+		(int)lround((p.y - offset[1]) / LAS_SCALE),
+		(int)lround((p.z - offset[2]) / LAS_SCALE)};
+  put(b, xyz, 12);
+  float in = points.intensity.empty() ? 0: points.intensity[i];
+  unsigned short intensity = in <= 0 ? 0: in >= 65535 ? 65535: (unsigned short)lround(in);
+  put(b, &intensity, 2);
+  unsigned char returns = (p.return_number & 7) | (p.nb_of_returns & 7) << 3;
+  put(b, &returns, 1);
+  unsigned char classification = p.mycode & 31;
+  put(b, &classification, 1);
+  unsigned char angle_user[2] = {0, 0};
+  put(b, angle_user, 2);
+  unsigned short source_id = points.point_source_id.empty() ? 0: points.point_source_id[i];
+  put(b, &source_id, 2);
+  if (format == 1) put(b, &points.gps_time[i], 8);
+}
+
+
+//encodes points [begin, end) that pass keep into ch, as LAS records of
+//the format if las
+static void encode_chunk(const lidar_point_cloud & points, bool (*keep)(long), int las,
+			 int format, const double offset[3], long begin, long end,
+			 write_chunk* ch) {
+
+  ch->buf.resize((end - begin) * (las ? LAS_RECORD_SIZE[format]: TXT_MAX_LINE));
+  char* b = ch->buf.empty() ? NULL: &ch->buf[0];
+  ch->n = 0;
+  memset(ch->by_return, 0, sizeof ch->by_return);
+  for (long i = begin; i < end; i++) {
+    if (keep && !keep(i)) continue;
+    const lidar_point & p = points.data[i];
+    if (las) {
+      las_record(points, i, format, offset, b);
+    } else {
+      //the layout of pdal translate: "%.3f,%.3f,%.3f,%.3f,%.3f,%.3f\n"
+      put_fixed3(b, p.x);   *b++ = ',';
+      put_fixed3(b, p.y);   *b++ = ',';
+      put_fixed3(b, p.z);   *b++ = ',';
+      put_fixed3(b, p.return_number);   *b++ = ',';
+      put_fixed3(b, p.nb_of_returns);   *b++ = ',';
+      put_fixed3(b, p.mycode);   *b++ = '\n';
+    }
+    if (ch->n == 0) {
+      ch->minx = ch->maxx = p.x;
+      ch->miny = ch->maxy = p.y;
+      ch->minz = ch->maxz = p.z;
+    } else {
+      if (ch->minx > p.x) ch->minx = p.x;
+      if (ch->maxx < p.x) ch->maxx = p.x;
+      if (ch->miny > p.y) ch->miny = p.y;
+      if (ch->maxy < p.y) ch->maxy = p.y;
+      if (ch->minz > p.z) ch->minz = p.z;
+      if (ch->maxz < p.z) ch->maxz = p.z;
+    }
+    if (p.return_number >= 1 && p.return_number <= 5) ch->by_return[p.return_number - 1]++;
+    ch->n++;
+  }
+  ch->buf.resize(b ? b - &ch->buf[0]: 0);
+}
+
+
+static void write_or_die(FILE* f, const void* buf, size_t size, const char* fname) {
+  if (size > 0 && fwrite(buf, 1, size, f) != size) {
+    printf("write_lidar_to_file: cannot write to %s\n", fname);
+    exit(1);
+  }
+}
+
+
+
+long write_lidar_to_file(const char* fname, const lidar_point_cloud & points,
+			 bool (*keep)(long)) {
+
+  double t = get_time();
+  FILE* f = fopen(fname, "wb");
+  if (!f) {
+    printf("write_lidar_to_file: cannot open file %s\n", fname);
+    exit(1);
+  }
+  int las = ends_with(fname, ".las");
+  int format = points.gps_time.empty() ? 0: 1;
+  double offset[3] = {floor(points.minx), floor(points.miny), floor(points.minz)};
+  char header[LAS_HEADER_SIZE];
+  if (las) {
+    las_header(format, offset, header);
+    write_or_die(f, header, LAS_HEADER_SIZE, fname);
+  } else {
+    const char* names = "\"X\",\"Y\",\"Z\",\"ReturnNumber\",\"NumberOfReturns\",\"Classification\"\n";
+    write_or_die(f, names, strlen(names), fname);
+  }
+
+  long n = points.data.size();
+  long nchunks = (n + WRITE_CHUNK - 1) / WRITE_CHUNK;
+  long batch_size = 4 * nb_threads();
+  long nbatches = (nchunks + batch_size - 1) / batch_size;
+
+  //batch k is encoded in batch[k%2]. The writer thread writes batch
+  //k once posted > k; the encoder reuses batch[k%2] for batch k+2
+  //once written > k
+  vector<write_chunk> batch[2] = {vector<write_chunk>(batch_size), vector<write_chunk>(batch_size)};
+  long posted = 0, written = 0;
+  mutex m;
+  condition_variable cv;
+
+  thread writer([&]() {
+      for (long k = 0; k < nbatches; k++) {
+	{
+	  unique_lock<mutex> lock(m);
+	  cv.wait(lock, [&]() { return posted > k; });
+	}
+	vector<write_chunk> & chunks = batch[k % 2];
+	for (long c = 0; c < batch_size && (k * batch_size + c) < nchunks; c++)
+	  write_or_die(f, chunks[c].buf.empty() ? NULL: &chunks[c].buf[0], chunks[c].buf.size(), fname);
+	{
+	  lock_guard<mutex> lock(m);
+	  written = k + 1;
+	}
+	cv.notify_all();
+      }
+    });
+
+  //totals for the LAS header
+  unsigned int nb_points = 0, by_return[5] = {0, 0, 0, 0, 0};
+  double box[6] = {0, 0, 0, 0, 0, 0};  //maxx, minx, maxy, miny, maxz, minz
+
+  for (long k = 0; k < nbatches; k++) {
+    {
+      unique_lock<mutex> lock(m);
+      cv.wait(lock, [&]() { return written >= k - 1; });
+    }
+    vector<write_chunk> & chunks = batch[k % 2];
+    long first = k * batch_size;
+    long count = (first + batch_size < nchunks) ? batch_size: nchunks - first;
+    parallel_for_chunks(count, count, [&](int c, long b, long e) {
+	long begin = (first + c) * WRITE_CHUNK;
+	long end = (begin + WRITE_CHUNK < n) ? begin + WRITE_CHUNK: n;
+	encode_chunk(points, keep, las, format, offset, begin, end, &chunks[c]);
+      });
+
+    for (long c = 0; c < count; c++) {
+      const write_chunk & ch = chunks[c];
+      if (ch.n == 0) continue;
+      if (nb_points == 0) {
+	box[0] = ch.maxx; box[1] = ch.minx;
+	box[2] = ch.maxy; box[3] = ch.miny;
+	box[4] = ch.maxz; box[5] = ch.minz;
+      } else {
+	if (box[0] < ch.maxx) box[0] = ch.maxx;
+	if (box[1] > ch.minx) box[1] = ch.minx;
+	if (box[2] < ch.maxy) box[2] = ch.maxy;
+	if (box[3] > ch.miny) box[3] = ch.miny;
+	if (box[4] < ch.maxz) box[4] = ch.maxz;
+	if (box[5] > ch.minz) box[5] = ch.minz;
+      }
+      nb_points += ch.n;
+      for (int r = 0; r < 5; r++) by_return[r] += ch.by_return[r];
+    }
+    {
+      lock_guard<mutex> lock(m);
+      posted = k + 1;
+    }
+    cv.notify_all();
+  }
+  writer.join();
+
+  //now that the counts are known, patch them in the header
+  if (las) {
+    char* b = header + LAS_NB_POINTS_OFFSET;
+    put(b, &nb_points, 4);
+    put(b, by_return, 20);
+    b += 48;  //scale and offset
+    put(b, box, 48);
+    fseek(f, 0, SEEK_SET);
+    write_or_die(f, header, LAS_HEADER_SIZE, fname);
+  }
+  if (fclose(f) != 0) {
+    printf("write_lidar_to_file: cannot write to %s\n", fname);
+    exit(1);
+  }
+
+  double s = get_time() - t;
+  printf("write_lidar_to_file: wrote %u points to %s in %.1f ms (%.0f points/s)\n",
+	 nb_points, fname, 1000 * s, s > 0 ? nb_points / s: 0);
+  return nb_points;
+}
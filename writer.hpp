@@ -0,0 +1,27 @@
+#ifndef __WRITER_HPP
+#define __WRITER_HPP
+
+#include "lidar.hpp"
+
+
+
+/* writes the points for which keep(i) returns true (all the points if
+   keep is NULL) to file fname, with mycode as their classification.
+
+   If fname ends in .las the file is LAS 1.2, point format 1 if the
+   points have a gps time and 0 otherwise, with coordinates stored in
+   mm (scale 0.001) from an offset at the lower corner of the cloud.
+   Otherwise it is the PDAL text layout read by
+   read_lidar_from_file.
+
+   The points are encoded in parallel, a batch of chunks at a time,
+   while a dedicated thread writes the previous batch to the file, in
+   order; only two batches are in memory at any time.
+
+   Returns the number of points written.
+*/
+long write_lidar_to_file(const char* fname, const lidar_point_cloud & points,
+			 bool (*keep)(long));
+
+
+#endif